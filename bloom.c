@@ -0,0 +1,135 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./bloom.h"
+#include "./hash.h"
+
+static uint8_t *counters;
+static size_t ncounters;  // a power of two, 0 when disabled
+
+static unsigned long keys;             // keys currently counted in
+static unsigned long negatives;        // lookups answered by the filter
+static unsigned long false_positives;  // lookups it let through in vain
+
+/* Derives the i-th counter for a key from two halves of one hash (double
+   hashing). FNV-1a is weak in its high bits, so the hash is mixed first. */
+static inline void counter_indexes(const char *key, size_t *idx) {
+    uint64_t h = hash_key(key);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    uint32_t h1 = (uint32_t)h;
+    uint32_t h2 = (uint32_t)(h >> 32) | 1;
+    for (int i = 0; i < BLOOM_HASHES; i++)
+        idx[i] = (h1 + (uint32_t)i * h2) & (ncounters - 1);
+}
+
+//------------------------------------------------------------------------------------------------
+// Setup and teardown
+
+void bloom_init(size_t size) {
+    if (size == 0) return;
+    ncounters = 1;
+    while (ncounters < size) ncounters <<= 1;
+    if ((counters = calloc(ncounters, 1)) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+}
+
+void bloom_cleanup(void) {
+    free(counters);
+    counters = NULL;
+    ncounters = 0;
+}
+
+void bloom_reset(void) {
+    if (ncounters == 0) return;
+    for (size_t i = 0; i < ncounters; i++)
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&keys, 0, __ATOMIC_RELAXED);
+}
+
+//------------------------------------------------------------------------------------------------
+// Counting keys in and out
+
+void bloom_add(const char *key) {
+    if (ncounters == 0) return;
+    size_t idx[BLOOM_HASHES];
+    counter_indexes(key, idx);
+
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        uint8_t c = __atomic_load_n(&counters[idx[i]], __ATOMIC_RELAXED);
+        while (c != UINT8_MAX &&
+               !__atomic_compare_exchange_n(&counters[idx[i]], &c, c + 1, 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    __atomic_fetch_add(&keys, 1, __ATOMIC_RELAXED);
+}
+
+void bloom_remove(const char *key) {
+    if (ncounters == 0) return;
+    size_t idx[BLOOM_HASHES];
+    counter_indexes(key, idx);
+
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        // a saturated counter no longer knows how many keys it covers
+        uint8_t c = __atomic_load_n(&counters[idx[i]], __ATOMIC_RELAXED);
+        while (c != UINT8_MAX && c != 0 &&
+               !__atomic_compare_exchange_n(&counters[idx[i]], &c, c - 1, 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    __atomic_fetch_sub(&keys, 1, __ATOMIC_RELAXED);
+}
+
+int bloom_may_contain(const char *key) {
+    if (ncounters == 0) return 1;
+    size_t idx[BLOOM_HASHES];
+    counter_indexes(key, idx);
+
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        if (__atomic_load_n(&counters[idx[i]], __ATOMIC_ACQUIRE) == 0) {
+            __atomic_fetch_add(&negatives, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void bloom_false_positive(void) {
+    if (ncounters == 0) return;
+    __atomic_fetch_add(&false_positives, 1, __ATOMIC_RELAXED);
+}
+
+//------------------------------------------------------------------------------------------------
+// Statistics
+
+void bloom_stats(char *buf, int len) {
+    if (ncounters == 0) {
+        snprintf(buf, len, "bloom disabled");
+        return;
+    }
+
+    size_t used = 0;
+    for (size_t i = 0; i < ncounters; i++)
+        if (__atomic_load_n(&counters[i], __ATOMIC_RELAXED) != 0) used++;
+
+    // a missing key passes if all of its counters are in use
+    double fill = (double)used / ncounters;
+    double est_fp = 1.0;
+    for (int i = 0; i < BLOOM_HASHES; i++) est_fp *= fill;
+
+    unsigned long neg = __atomic_load_n(&negatives, __ATOMIC_RELAXED);
+    unsigned long fp = __atomic_load_n(&false_positives, __ATOMIC_RELAXED);
+    double observed = neg + fp ? (double)fp / (neg + fp) : 0.0;
+
+    snprintf(buf, len,
+             "bloom counters=%zu hashes=%d keys=%lu bytes=%zu fill=%.4f "
+             "est_fp=%.4f negatives=%lu false_positives=%lu observed_fp=%.4f",
+             ncounters, BLOOM_HASHES, __atomic_load_n(&keys, __ATOMIC_RELAXED),
+             ncounters, fill, est_fp, neg, fp, observed);
+}
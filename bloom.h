@@ -0,0 +1,66 @@
+#ifndef BLOOM_H_
+#define BLOOM_H_
+
+#include <stddef.h>
+
+/*
+ * A counting Bloom filter over the keys in the tree, so that `q`, `d` and the
+ * update commands can answer for absent keys without descending. Each key maps
+ * to BLOOM_HASHES one-byte counters; a key is possibly present only if all of
+ * them are non-zero. Counters are updated with atomic operations and never
+ * drop below the number of present keys hashing to them, so the filter has no
+ * false negatives: db_add() counts a key in before linking its node and
+ * db_remove() counts it out after unlinking it. A counter that saturates stays
+ * saturated.
+ */
+
+#define BLOOM_HASHES 4
+#define BLOOM_DEFAULT_COUNTERS (1 << 20)
+
+/**
+ * bloom_init() sizes the filter to the given number of counters, rounded up
+ * to a power of two. 0 disables the filter. Must be called before any client
+ * thread starts.
+ */
+void bloom_init(size_t size);
+
+/**
+ * bloom_add() counts key in. Call before the key becomes visible in the tree.
+ */
+void bloom_add(const char *key);
+
+/**
+ * bloom_remove() counts key out. Call after the key is gone from the tree.
+ */
+void bloom_remove(const char *key);
+
+/**
+ * bloom_may_contain() returns 0 if key is certainly not in the tree and 1 if
+ * it may be. A disabled filter always returns 1.
+ */
+int bloom_may_contain(const char *key);
+
+/**
+ * bloom_false_positive() records that a key bloom_may_contain() let through
+ * was not in the tree after all, for the statistics.
+ */
+void bloom_false_positive(void);
+
+/**
+ * bloom_reset() zeroes every counter, for when the whole tree is dropped. The
+ * caller must keep writers out of the tree until it returns.
+ */
+void bloom_reset(void);
+
+/**
+ * bloom_stats() writes a one-line summary of the filter's size, fill,
+ * estimated and observed false-positive rates into buf.
+ */
+void bloom_stats(char *buf, int len);
+
+/**
+ * bloom_cleanup() frees the counters.
+ */
+void bloom_cleanup(void);
+
+#endif  // BLOOM_H_
@@ -0,0 +1,264 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./cache.h"
+#include "./comm.h"
+#include "./hash.h"
+
+typedef struct cache_entry {
+    char *key;
+    char *value;
+    uint64_t hash;
+    size_t bytes;  // size of the single allocation holding entry, key, value
+    size_t slot;   // position in the shard's CLOCK ring
+    int ref;       // CLOCK reference bit, set on every hit
+    struct cache_entry *hnext;
+} cache_entry_t;
+
+typedef struct cache_shard {
+    pthread_mutex_t mutex;
+    cache_entry_t **buckets;  // hash chains, nbuckets is a power of two
+    size_t nbuckets;
+    cache_entry_t **slots;  // CLOCK ring, NULL slots are free
+    size_t nslots;
+    size_t hand;
+    size_t entries;
+    size_t bytes;
+    // Bumped by every invalidation so that a fill racing with a write to the
+    // same shard is dropped rather than caching a stale value.
+    unsigned long version;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long invalidations;
+} cache_shard_t;
+
+static cache_shard_t shards[CACHE_SHARDS];
+static size_t cache_capacity;
+
+static inline cache_shard_t *shard_of(uint64_t hash) {
+    return &shards[hash >> 60];
+}
+
+static cache_entry_t **find(cache_shard_t *s, const char *key,
+                            uint64_t hash) {
+    cache_entry_t **pp = &s->buckets[hash & (s->nbuckets - 1)];
+    while (*pp != NULL) {
+        if ((*pp)->hash == hash && strcmp((*pp)->key, key) == 0) break;
+        pp = &(*pp)->hnext;
+    }
+    return pp;
+}
+
+/* Unlinks the entry at *pp from its chain and the ring and frees it. */
+static void drop(cache_shard_t *s, cache_entry_t **pp) {
+    cache_entry_t *e = *pp;
+    *pp = e->hnext;
+    s->slots[e->slot] = NULL;
+    s->entries--;
+    s->bytes -= e->bytes;
+    free(e);
+}
+
+/* Advances the CLOCK hand until it finds a free or unreferenced slot. */
+static size_t clock_victim(cache_shard_t *s) {
+    while (1) {
+        size_t slot = s->hand;
+        cache_entry_t *e = s->slots[slot];
+        s->hand = (s->hand + 1) % s->nslots;
+        if (e == NULL) return slot;
+        if (e->ref) {
+            e->ref = 0;
+            continue;
+        }
+        drop(s, find(s, e->key, e->hash));
+        s->evictions++;
+        return slot;
+    }
+}
+
+//------------------------------------------------------------------------------------------------
+// Setup and teardown
+
+void cache_init(size_t capacity) {
+    int err;
+    size_t per_shard = (capacity + CACHE_SHARDS - 1) / CACHE_SHARDS;
+    cache_capacity = per_shard * CACHE_SHARDS;
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *s = &shards[i];
+        memset(s, 0, sizeof(*s));
+        if ((err = pthread_mutex_init(&s->mutex, 0)))
+            handle_error_en(err, "pthread_mutex_init");
+        if (per_shard == 0) continue;
+
+        s->nslots = per_shard;
+        s->nbuckets = 1;
+        while (s->nbuckets < 2 * per_shard) s->nbuckets <<= 1;
+        if ((s->slots = calloc(s->nslots, sizeof(cache_entry_t *))) == NULL ||
+            (s->buckets = calloc(s->nbuckets, sizeof(cache_entry_t *))) ==
+                NULL) {
+            perror("calloc");
+            exit(1);
+        }
+    }
+}
+
+void cache_cleanup(void) {
+    int err;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *s = &shards[i];
+        for (size_t j = 0; j < s->nslots; j++) free(s->slots[j]);
+        free(s->slots);
+        free(s->buckets);
+        if ((err = pthread_mutex_destroy(&s->mutex)))
+            handle_error_en(err, "pthread_mutex_destroy");
+        memset(s, 0, sizeof(*s));
+    }
+    cache_capacity = 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Lookup, fill and invalidation
+
+int cache_lookup(const char *key, char *result, int len,
+                 unsigned long *version) {
+    if (cache_capacity == 0) {
+        *version = 0;
+        return 0;
+    }
+
+    uint64_t hash = hash_key(key);
+    cache_shard_t *s = shard_of(hash);
+    int hit = 0;
+
+    pthread_mutex_lock(&s->mutex);
+    cache_entry_t *e = *find(s, key, hash);
+    if (e != NULL) {
+        e->ref = 1;
+        snprintf(result, len, "%s", e->value);
+        s->hits++;
+        hit = 1;
+    } else {
+        *version = s->version;
+        s->misses++;
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return hit;
+}
+
+void cache_fill(const char *key, const char *value, unsigned long version) {
+    if (cache_capacity == 0) return;
+
+    uint64_t hash = hash_key(key);
+    cache_shard_t *s = shard_of(hash);
+    size_t key_len = strlen(key);
+    size_t val_len = strlen(value);
+
+    pthread_mutex_lock(&s->mutex);
+    cache_entry_t **pp = find(s, key, hash);
+    if (s->version != version || *pp != NULL) {
+        // A write got in since our lookup, or another reader beat us to it.
+        pthread_mutex_unlock(&s->mutex);
+        return;
+    }
+
+    size_t bytes = sizeof(cache_entry_t) + key_len + val_len + 2;
+    cache_entry_t *e = malloc(bytes);
+    if (e == NULL) {
+        pthread_mutex_unlock(&s->mutex);
+        return;
+    }
+    e->key = (char *)(e + 1);
+    e->value = e->key + key_len + 1;
+    memcpy(e->key, key, key_len + 1);
+    memcpy(e->value, value, val_len + 1);
+    e->hash = hash;
+    e->bytes = bytes;
+    e->ref = 0;
+    e->slot = clock_victim(s);
+
+    // the victim may have shared our chain, so look the insertion point up
+    // again after evicting
+    pp = find(s, key, hash);
+    e->hnext = NULL;
+    *pp = e;
+    s->slots[e->slot] = e;
+    s->entries++;
+    s->bytes += bytes;
+    pthread_mutex_unlock(&s->mutex);
+}
+
+int cache_referenced(const char *key) {
+    if (cache_capacity == 0) return 0;
+
+    uint64_t hash = hash_key(key);
+    cache_shard_t *s = shard_of(hash);
+
+    pthread_mutex_lock(&s->mutex);
+    cache_entry_t *e = *find(s, key, hash);
+    int ref = e != NULL && e->ref;
+    pthread_mutex_unlock(&s->mutex);
+    return ref;
+}
+
+void cache_invalidate(const char *key) {
+    if (cache_capacity == 0) return;
+
+    uint64_t hash = hash_key(key);
+    cache_shard_t *s = shard_of(hash);
+
+    pthread_mutex_lock(&s->mutex);
+    s->version++;
+    cache_entry_t **pp = find(s, key, hash);
+    if (*pp != NULL) {
+        drop(s, pp);
+        s->invalidations++;
+    }
+    pthread_mutex_unlock(&s->mutex);
+}
+
+void cache_invalidate_all(void) {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *s = &shards[i];
+        pthread_mutex_lock(&s->mutex);
+        s->version++;
+        for (size_t j = 0; j < s->nslots; j++) {
+            if (s->slots[j] == NULL) continue;
+            cache_entry_t *e = s->slots[j];
+            drop(s, find(s, e->key, e->hash));
+            s->invalidations++;
+        }
+        pthread_mutex_unlock(&s->mutex);
+    }
+}
+
+//------------------------------------------------------------------------------------------------
+// Statistics
+
+void cache_stats(char *buf, int len) {
+    unsigned long hits = 0, misses = 0, evictions = 0, invalidations = 0;
+    size_t entries = 0, bytes = 0;
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *s = &shards[i];
+        pthread_mutex_lock(&s->mutex);
+        hits += s->hits;
+        misses += s->misses;
+        evictions += s->evictions;
+        invalidations += s->invalidations;
+        entries += s->entries;
+        bytes += s->bytes + (s->nslots + s->nbuckets) * sizeof(void *);
+        pthread_mutex_unlock(&s->mutex);
+    }
+
+    double ratio = hits + misses ? (double)hits / (hits + misses) : 0.0;
+    snprintf(buf, len,
+             "cache entries=%zu capacity=%zu hits=%lu misses=%lu "
+             "hit_ratio=%.3f evictions=%lu invalidations=%lu bytes=%zu",
+             entries, cache_capacity, hits, misses, ratio, evictions,
+             invalidations, bytes);
+}
@@ -0,0 +1,66 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <stddef.h>
+
+/*
+ * A sharded read cache that sits in front of the tree for `q` commands. Each
+ * shard is protected by its own mutex and evicts with the CLOCK algorithm.
+ * Only keys that are present in the tree are ever cached.
+ */
+
+#define CACHE_SHARDS 16
+#define CACHE_DEFAULT_ENTRIES 4096
+
+/**
+ * cache_init() sizes the cache to hold up to the given number of entries,
+ * spread evenly over the shards. A capacity of 0 disables the cache. Must be
+ * called before any client thread starts.
+ */
+void cache_init(size_t capacity);
+
+/**
+ * cache_lookup() copies the cached value for key into result (of size len) and
+ * returns 1 on a hit. On a miss it returns 0 and stores the shard's current
+ * version in *version, which must be handed back to cache_fill().
+ */
+int cache_lookup(const char *key, char *result, int len,
+                 unsigned long *version);
+
+/**
+ * cache_fill() caches value for key, unless the key's shard has been
+ * invalidated since the cache_lookup() that returned version.
+ */
+void cache_fill(const char *key, const char *value, unsigned long version);
+
+/**
+ * cache_referenced() returns 1 if key is cached and has been hit since the
+ * CLOCK hand last passed it. Reads served from the cache never reach the tree,
+ * so this is how the tree's eviction learns that a key is still being read.
+ */
+int cache_referenced(const char *key);
+
+/**
+ * cache_invalidate() drops any cached value for key. Called by every path that
+ * modifies the tree, after the modification is visible.
+ */
+void cache_invalidate(const char *key);
+
+/**
+ * cache_invalidate_all() drops every cached value, for when the whole tree is
+ * replaced at once.
+ */
+void cache_invalidate_all(void);
+
+/**
+ * cache_stats() writes a one-line summary of hits, misses, hit ratio, entries
+ * and bytes used into buf.
+ */
+void cache_stats(char *buf, int len);
+
+/**
+ * cache_cleanup() frees every entry and the shard tables.
+ */
+void cache_cleanup(void);
+
+#endif  // CACHE_H_
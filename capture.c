@@ -0,0 +1,49 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "./capture.h"
+
+static FILE *capture_file;
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t capture_start;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int capture_open(const char *filename) {
+    if ((capture_file = fopen(filename, "w")) == NULL) return -1;
+    // a large buffer keeps the mutex hold time down to a memcpy
+    setvbuf(capture_file, NULL, _IOFBF, 1 << 16);
+    capture_start = now_us();
+    return 0;
+}
+
+void capture_record(unsigned long conn, const char *command) {
+    int oldstate;
+    if (__atomic_load_n(&capture_file, __ATOMIC_ACQUIRE) == NULL) return;
+
+    int len = strcspn(command, "\n");
+    // never get cancelled holding the mutex, as a flush's write() would allow
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    pthread_mutex_lock(&capture_mutex);
+    // the timestamp is taken under the mutex so that lines stay in time
+    // order, and capture_close() may have run since the check above
+    if (capture_file != NULL)
+        fprintf(capture_file, "%lu %lu %.*s\n", conn,
+                (unsigned long)(now_us() - capture_start), len, command);
+    pthread_mutex_unlock(&capture_mutex);
+    pthread_setcancelstate(oldstate, NULL);
+}
+
+void capture_close(void) {
+    pthread_mutex_lock(&capture_mutex);
+    if (capture_file != NULL && fclose(capture_file) != 0) perror("fclose");
+    __atomic_store_n(&capture_file, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&capture_mutex);
+}
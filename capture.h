@@ -0,0 +1,32 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+/*
+ * Workload capture. With the server's -w option every command received from
+ * a client is appended to a capture file, one line each:
+ *
+ *   <connection id> <microseconds since the capture started> <command>
+ *
+ * Lines are written in the order commands arrived. The replay tool re-issues
+ * a capture against a server (see replay.c).
+ */
+
+/**
+ * capture_open() starts capturing to filename, replacing it. Returns 0 on
+ * success and -1 if the file cannot be opened. Must be called before any
+ * client thread starts.
+ */
+int capture_open(const char *filename);
+
+/**
+ * capture_record() appends command, as received from connection conn. It
+ * does nothing when no capture is open.
+ */
+void capture_record(unsigned long conn, const char *command);
+
+/**
+ * capture_close() flushes and closes the capture file, if any.
+ */
+void capture_close(void);
+
+#endif  // CAPTURE_H_
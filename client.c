@@ -1,60 +1,66 @@
-#include <arpa/inet.h>
-#include <fcntl.h>
-#include <netdb.h>
-#include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
-#include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "./dbclient.h"
+
 #define BUFSIZE 1024
+#define SCRIPT_WINDOW 32  // commands kept in flight when running a script
+#define SHM_PREFIX "shm:"  // servername prefix selecting the ring transport
 
 /*
- * Helper that opens a TCP socket representing the server.
- * Returns the file descriptor on success, -1 on failure.
+ * Completion callback that prints each response as it arrives. Responses come
+ * back in the order the commands were sent, so the output matches the script.
  */
-int get_socket(const char *server, const char *port) {
-    // setup for getaddrinfo
-    int sock;
-    struct addrinfo hints;
-    struct addrinfo *result;
-
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-
-    int err;
-    if ((err = getaddrinfo(server, port, &hints, &result)) != 0) {
-        fprintf(stderr, "Error in getaddrinfo: %s\n", gai_strerror(err));
-        return -1;
+static void print_response(void *arg, int status, const char *response) {
+    (void)arg;
+    if (status != DBC_OK) {
+        fprintf(stderr, "Connection terminated.\n");
+        exit(1);
     }
+    printf("%s\n", response);
+}
 
-    // find the right interface
-    struct addrinfo *res;
-    for (res = result; res != NULL; res = res->ai_next) {
-        if ((sock = socket(res->ai_family, res->ai_socktype,
-                           res->ai_protocol)) < 0) {
+/*
+ * Runs the commands in infile over the shared-memory transport to the server
+ * whose Unix socket is at path, keeping up to window commands in flight.
+ */
+void run_ring(const char *path, FILE *infile, int window) {
+    dbc_ring_t *ring;
+    if ((ring = dbc_ring_connect(path)) == NULL) {
+        fprintf(stderr, "Failed to connect to '%s'!\n", path);
+        exit(1);
+    }
+
+    char qbuf[BUFSIZE];
+    char rbuf[DBC_LINE];
+    int more = 1;
+    while (more || dbc_ring_pending(ring) > 0) {
+        if (more && dbc_ring_pending(ring) < window) {
+            if (fgets(qbuf, sizeof(qbuf), infile) == NULL) {
+                more = 0;
+                continue;
+            }
+            qbuf[strcspn(qbuf, "\n")] = '\0';
+            int err = dbc_ring_send(ring, qbuf);
+            if (err == DBC_EINVAL) {
+                fprintf(stderr, "Command too long: %.32s...\n", qbuf);
+            } else if (err < 0) {
+                fprintf(stderr, "No connection!\n");
+                exit(1);
+            }
             continue;
         }
-        if (connect(sock, res->ai_addr, res->ai_addrlen) >= 0) {
-            break;
+        if (dbc_ring_recv(ring, rbuf, sizeof(rbuf)) < 0) {
+            fprintf(stderr, "Connection terminated.\n");
+            exit(1);
         }
-        close(sock);
-    }
-
-    freeaddrinfo(result);
-
-    if (res == NULL) {
-        fprintf(stderr, "Failed to connect to '%s'!\n", server);
-        return -1;
+        printf("%s\n", rbuf);
     }
-
-    return sock;
+    dbc_ring_close(ring);
 }
 
 /*
@@ -79,43 +85,65 @@ pid_t create_occurence(const char *server, const char *port,
             infile = stdin;
         }
 
+        int window = script != NULL ? SCRIPT_WINDOW : 1;
+        if (strncmp(server, SHM_PREFIX, strlen(SHM_PREFIX)) == 0) {
+            run_ring(server + strlen(SHM_PREFIX), infile, window);
+            fclose(infile);
+            printf("Client terminated cleanly.\n");
+            exit(0);
+        }
+
         // Step 3: set up a new connection to the server
-        int sock;
-        if ((sock = get_socket(server, port)) == -1) {
+        dbc_conn_t *cxn;
+        if ((cxn = dbc_connect(server, port)) == NULL) {
+            fprintf(stderr, "Failed to connect to '%s'!\n", server);
             exit(1);
         }
 
-        // Step 4: loop, sending queries and printing responses
-        FILE *cxn = fdopen(sock, "w+");
-        char rbuf[BUFSIZE], qbuf[BUFSIZE];
-        rbuf[0] = '\0';
+        // Step 4: loop, sending queries and printing responses. A script is
+        // pipelined; interactive input waits for each response.
+        char qbuf[BUFSIZE];
 
-        while (1) {
-            // if there are no more commands, so we can clean up and exit
-            if (fgets(qbuf, sizeof(qbuf), infile) == NULL) {
-                qbuf[0] = EOF;
-                fputs(qbuf, cxn);
-                fflush(cxn);
-                fclose(cxn);
-                fclose(infile);
-                printf("Client terminated cleanly.\n");
-                exit(0);
-            } else {
-                // otherwise, send the command
-                if (fputs(qbuf, cxn) == EOF) {
+        while (fgets(qbuf, sizeof(qbuf), infile) != NULL) {
+            qbuf[strcspn(qbuf, "\n")] = '\0';
+            if (qbuf[0] == 'W') {
+                // a subscription: print what the server pushes until it goes
+                if (dbc_watch(cxn, &qbuf[1], print_response, NULL) < 0) {
                     fprintf(stderr, "No connection!\n");
                     exit(1);
                 }
-                fflush(cxn);
+                while (dbc_poll(cxn, -1) >= 0) fflush(stdout);
+                fprintf(stderr, "Connection terminated.\n");
+                exit(1);
             }
+            int err = dbc_send(cxn, qbuf, print_response, NULL);
+            if (err == DBC_EINVAL) {
+                fprintf(stderr, "Command too long: %.32s...\n", qbuf);
+                continue;
+            } else if (err < 0) {
+                fprintf(stderr, "No connection!\n");
+                exit(1);
+            }
+
+            while (dbc_pending(cxn) >= window) {
+                if (dbc_poll(cxn, -1) < 0) {
+                    fprintf(stderr, "Connection terminated.\n");
+                    exit(1);
+                }
+            }
+        }
 
-            // wait for the response and print it
-            if (fgets(rbuf, BUFSIZE, cxn) == NULL) {
+        // no more commands, so collect the remaining responses and clean up
+        while (dbc_pending(cxn) > 0) {
+            if (dbc_poll(cxn, -1) < 0) {
                 fprintf(stderr, "Connection terminated.\n");
                 exit(1);
             }
-            printf("%s", rbuf);
         }
+        dbc_close(cxn);
+        fclose(infile);
+        printf("Client terminated cleanly.\n");
+        exit(0);
     }
 
     // return pid of child
@@ -128,7 +156,9 @@ pid_t create_occurence(const char *server, const char *port,
 void usage_error(const char *cmd) {
     fprintf(stderr,
             "Usage: %s <servername> <port> "
-            "[<script> <occurences>]\n",
+            "[<script> <occurences>]\n"
+            "servername may be the path of the server's Unix socket, or "
+            "shm:<path> to talk to it through shared memory\n",
             cmd);
 }
 
@@ -140,10 +170,10 @@ void usage_error(const char *cmd) {
  *
  * Step 2: open the script-file
  *
- * Step 3: find the server address, set up socket for TCP and connect to server
+ * Step 3: connect to the server through libdbclient (see dbclient.h)
  *
- * Step 4: set up an infinite loop that sends queries from the
- *         script-file to the server and prints responses (if any exist)
+ * Step 4: set up a loop that sends queries from the script-file to the
+ *         server and prints responses (if any exist)
  */
 int main(int argc, const char *argv[]) {
     // parse args
@@ -1,6 +1,8 @@
 #include "./comm.h"
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,71 +10,250 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include "./ring.h"
+#include "./trace.h"
+
 /* Serverside I/O functions */
 
-int lsock;
+#define RING_POLL_MS 100  // how often a ring client is checked for hangup
+#define INBUF_LEN 8192    // bytes read from a client's socket at a time
 
-static void *listener(void (*server)(FILE *));
+static int unix_sock = -1;
 
-static int comm_port;
+typedef struct listener {
+    int sock;
+    pthread_t thread;
+    void (*server)(FILE *);
+} listener_t;
 
-/* Notice that this function takes in an argument `server`, which is a function
-   that takes in a file pointer. What function have you
-   implemented that has a file pointer as an argument? */
-pthread_t start_listener(int port, void (*server)(FILE *)) {
-    comm_port = port;
-    pthread_t tid;
-    int err;
+static listener_t listeners[COMM_MAX_LISTENERS];
+static int nlisteners;
+static listener_t unix_listener;
+static int accepting;  // the accept threads are running
 
-    if ((err = pthread_create(&tid, 0, (void *(*)(void *))listener,
-                              (void *)server)))
-        handle_error_en(err, "pthread_create");
+// Hand-offs come in over the Unix socket, so a server listening on one polls
+// handoff_wake alongside each connection it would otherwise block reading.
+// comm_handoff_begin() makes the pipe readable, waking every such poll.
+static int handoff_wake[2] = {-1, -1};
+static int handing_off;
+
+// What comm_serve() has read from a client's socket but not yet returned as
+// commands. The socket is read directly rather than through its stdio stream,
+// so what has been read ahead of the client is known. Every connection has a
+// client thread of its own, which makes the calling thread's buffer the
+// connection's.
+static __thread char inbuf[INBUF_LEN];
+static __thread size_t in_start;
+static __thread size_t in_end;
+
+static void *accept_loop(void *arg);
+
+struct comm_ring {
+    ring_pair_t *rings;
+    int sock;
+    int fd;  // the ring's memfd, kept so that the ring can be handed off
+};
 
-    return tid;
+static void start_accept_thread(listener_t *l, int sock,
+                                void (*server)(FILE *)) {
+    int err;
+    l->sock = sock;
+    l->server = server;
+    if ((err = pthread_create(&l->thread, 0, accept_loop, l)))
+        handle_error_en(err, "pthread_create");
 }
 
-void *listener(void (*server)(FILE *)) {
-    if ((lsock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+/* Binds a socket to port, with SO_REUSEPORT if reuseport is set. */
+static int bind_port(int port, int reuseport) {
+    int sock;
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("socket");
         exit(1);
     }
 
+    // replicas hold connections open, so a restarted primary must be able to
+    // rebind while the old ones are in TIME_WAIT
+    int one = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0)
+        perror("setsockopt");
+    if (reuseport &&
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("setsockopt");
+        exit(1);
+    }
+
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(comm_port);
+    addr.sin_port = htons(port);
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-    if (bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         perror("bind");
-        if (close(lsock) < 0) perror("close");
+        if (close(sock) < 0) perror("close");
         exit(1);
     }
+    return sock;
+}
 
-    if (listen(lsock, 100) < 0) {
+/* Binds one listening socket on port. Every socket carries SO_REUSEPORT, so
+   the kernel accepts the port being bound once per listener thread and hashes
+   incoming connections across them. */
+static int bind_listener(int port, int backlog) {
+    int sock = bind_port(port, 1);
+    if (listen(sock, backlog) < 0) {
         perror("listen");
-        if (close(lsock) < 0) perror("close");
+        if (close(sock) < 0) perror("close");
         exit(1);
     }
+    return sock;
+}
 
-    fprintf(stderr, "listening on port %d\n", comm_port);
+/* Notice that this function takes in an argument `server`, which is a function
+   that takes in a file pointer. What function have you
+   implemented that has a file pointer as an argument? */
+void start_listeners(int port, int count, int backlog,
+                     void (*server)(FILE *)) {
+    if (count <= 0) count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count <= 0) count = 1;
+    if (count > COMM_MAX_LISTENERS) count = COMM_MAX_LISTENERS;
+    if (backlog <= 0) backlog = SOMAXCONN;
+
+    // SO_REUSEPORT would let us join another server's listeners on the port
+    // and split its clients with it, so a plain bind checks that it is free
+    int probe = bind_port(port, 0);
+    if (close(probe) < 0) perror("close");
+
+    // bind them all before accepting on any, so that a bad port fails here
+    for (int i = 0; i < count; i++)
+        listeners[i].sock = bind_listener(port, backlog);
+    for (int i = 0; i < count; i++)
+        start_accept_thread(&listeners[i], listeners[i].sock, server);
+    nlisteners = count;
+    accepting = 1;
+
+    fprintf(stderr, "listening on port %d (%d listener%s, backlog %d)\n", port,
+            count, count == 1 ? "" : "s", backlog);
+}
+
+static void open_handoff_wake(void) {
+    if (pipe(handoff_wake) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+}
+
+/* Creates and binds the Unix socket at path, replacing any stale socket file
+   left there, and starts a thread accepting clients on it. */
+void start_unix_listener(const char *path, int backlog,
+                         void (*server)(FILE *)) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+    if (backlog <= 0) backlog = SOMAXCONN;
 
+    if ((unix_sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        exit(1);
+    }
+    unlink(path);
+    if (bind(unix_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    if (listen(unix_sock, backlog) < 0) {
+        perror("listen");
+        exit(1);
+    }
+    fprintf(stderr, "listening on %s\n", path);
+
+    open_handoff_wake();
+    start_accept_thread(&unix_listener, unix_sock, server);
+    accepting = 1;
+}
+
+void comm_adopt_listeners(const int *socks, int count, int unix_fd,
+                          void (*server)(FILE *)) {
+    if (count > COMM_MAX_LISTENERS) count = COMM_MAX_LISTENERS;
+    for (int i = 0; i < count; i++)
+        start_accept_thread(&listeners[i], socks[i], server);
+    nlisteners = count;
+    if ((unix_sock = unix_fd) >= 0) {
+        open_handoff_wake();
+        start_accept_thread(&unix_listener, unix_sock, server);
+    }
+    accepting = 1;
+}
+
+int comm_listener_fds(int *socks, int *unix_fd) {
+    for (int i = 0; i < nlisteners; i++) socks[i] = listeners[i].sock;
+    *unix_fd = unix_sock;
+    return nlisteners;
+}
+
+void comm_stop_accepting(void) {
+    int err;
+    if (!accepting) return;
+    for (int i = 0; i < nlisteners; i++) {
+        if ((err = pthread_cancel(listeners[i].thread)))
+            handle_error_en(err, "pthread_cancel");
+        if ((err = pthread_join(listeners[i].thread, 0)))
+            handle_error_en(err, "pthread_join");
+    }
+    if (unix_sock >= 0) {
+        if ((err = pthread_cancel(unix_listener.thread)))
+            handle_error_en(err, "pthread_cancel");
+        if ((err = pthread_join(unix_listener.thread, 0)))
+            handle_error_en(err, "pthread_join");
+    }
+    accepting = 0;
+}
+
+void comm_resume_accepting(void) {
+    if (accepting) return;
+    for (int i = 0; i < nlisteners; i++)
+        start_accept_thread(&listeners[i], listeners[i].sock,
+                            listeners[i].server);
+    if (unix_sock >= 0)
+        start_accept_thread(&unix_listener, unix_sock, unix_listener.server);
+    accepting = 1;
+}
+
+void stop_listeners(void) {
+    comm_stop_accepting();
+    for (int i = 0; i < nlisteners; i++)
+        if (close(listeners[i].sock) < 0) perror("close");
+    nlisteners = 0;
+    if (unix_sock >= 0) {
+        if (close(unix_sock) < 0) perror("close");
+        unix_sock = -1;
+    }
+    for (int i = 0; i < 2 && handoff_wake[i] >= 0; i++) {
+        if (close(handoff_wake[i]) < 0) perror("close");
+        handoff_wake[i] = -1;
+    }
+}
+
+/* Accepts connections on one listening socket and hands each to the server
+   callback. Nothing here formats or prints per connection; the client thread
+   logs its peer with comm_log_peer() once it is running. */
+void *accept_loop(void *arg) {
+    listener_t *l = arg;
     while (1) {
         int csock;
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-
-        if ((csock = accept(lsock, (struct sockaddr *)&client_addr,
-                            &client_len)) < 0) {
+        if ((csock = accept(l->sock, NULL, NULL)) < 0) {
             perror("accept");
             continue;
         }
 
-        fprintf(stderr, "received connection from %s#%hu\n",
-                inet_ntoa(client_addr.sin_addr), client_addr.sin_port);
-
         FILE *cxstr;
         if (!(cxstr = fdopen(csock, "w+"))) {
             perror("fdopen");
@@ -80,29 +261,258 @@ void *listener(void (*server)(FILE *)) {
             continue;
         }
 
-        server(cxstr);
+        l->server(cxstr);
     }
-
     return NULL;
 }
 
+void comm_log_peer(FILE *cxstr) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getpeername(fileno(cxstr), (struct sockaddr *)&addr, &len) < 0) {
+        perror("getpeername");
+        return;
+    }
+
+    if (addr.ss_family == AF_INET) {
+        struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+        char host[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+        fprintf(stderr, "received connection from %s#%hu\n", host,
+                in->sin_port);
+    } else {
+        fprintf(stderr, "received local connection\n");
+    }
+}
+
 void comm_shutdown(FILE *cxstr) {
     if (fclose(cxstr) < 0) perror("fclose");
 }
 
-int comm_serve(FILE *cxstr, char *response, char *command) {
+/* Writes response and a newline straight to the socket under cxstr, which
+   comm_serve() reads without stdio too. */
+static int write_response(FILE *cxstr, char *response) {
+    struct iovec iov[2];
+    iov[0].iov_base = response;
+    iov[0].iov_len = strlen(response);
+    iov[1].iov_base = "\n";
+    iov[1].iov_len = 1;
+
+    int i = 0;
+    while (i < 2) {
+        ssize_t n = writev(fileno(cxstr), &iov[i], 2 - i);
+        if (n < 0) return -1;
+        while (i < 2 && (size_t)n >= iov[i].iov_len) n -= iov[i++].iov_len;
+        if (i < 2) {
+            iov[i].iov_base = (char *)iov[i].iov_base + n;
+            iov[i].iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+void comm_handoff_begin(void) {
+    __atomic_store_n(&handing_off, 1, __ATOMIC_SEQ_CST);
+    if (handoff_wake[1] >= 0 && write(handoff_wake[1], "h", 1) != 1)
+        perror("write");
+}
+
+void comm_handoff_end(void) {
+    char byte;
+    __atomic_store_n(&handing_off, 0, __ATOMIC_SEQ_CST);
+    if (handoff_wake[0] >= 0 && read(handoff_wake[0], &byte, 1) != 1)
+        perror("read");
+}
+
+/* Reads the next command from the socket under cxstr into command, as
+   fgets() would with BUFLEN: up to and including a newline, at most
+   BUFLEN - 1 bytes. Returns 0, or -1 once the client is gone. */
+static int read_command(FILE *cxstr, char *command) {
+    while (1) {
+        size_t avail = in_end - in_start;
+        char *nl = memchr(&inbuf[in_start], '\n', avail);
+        size_t n = nl != NULL ? (size_t)(nl - &inbuf[in_start]) + 1 : avail;
+        ssize_t got = 0;
+        if (nl == NULL && n < BUFLEN - 1) {
+            memmove(inbuf, &inbuf[in_start], avail);
+            in_start = 0;
+            in_end = avail;
+            got = read(fileno(cxstr), &inbuf[in_end], INBUF_LEN - in_end);
+            if (got < 0 && errno == EINTR) continue;
+            if (got > 0) {
+                in_end += got;
+                continue;
+            }
+            // the client is gone, perhaps after a last line with no newline
+            if (n == 0) return -1;
+        }
+        if (n > BUFLEN - 1) n = BUFLEN - 1;
+        memcpy(command, &inbuf[in_start], n);
+        command[n] = '\0';
+        in_start += n;
+        return 0;
+    }
+}
+
+/* Waits until cxstr may have a command to read. Returns 0, or COMM_HANDOFF if
+   a hand-off is under way and everything the client sent so far is still in
+   the socket, where it will go along with the connection. */
+static int wait_command(FILE *cxstr) {
+    if (handoff_wake[0] < 0 || in_start < in_end) return 0;
+
+    struct pollfd fds[2] = {{fileno(cxstr), POLLIN, 0},
+                            {handoff_wake[0], POLLIN, 0}};
+    while (!__atomic_load_n(&handing_off, __ATOMIC_SEQ_CST)) {
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) return 0;
+        if (fds[0].revents != 0) return 0;
+    }
+    return COMM_HANDOFF;
+}
+
+int comm_serve(FILE *cxstr, char *response, char *command, int may_hand_off) {
     if (strlen(response) > 0) {
-        if (fputs(response, cxstr) == EOF || fputc('\n', cxstr) == EOF ||
-            fflush(cxstr) == EOF) {
+        uint64_t t = trace_start();
+        if (write_response(cxstr, response) < 0) {
             fprintf(stderr, "client connection terminated\n");
             return -1;
         }
+        trace_end("write", t);
     }
+    trace_request_end();
 
-    if (fgets(command, BUFLEN, cxstr) == NULL) {
+    trace_request_begin();
+    uint64_t t = trace_start();
+    if (may_hand_off && wait_command(cxstr) == COMM_HANDOFF)
+        return COMM_HANDOFF;
+    if (read_command(cxstr, command) < 0) {
         fprintf(stderr, "client connection terminated\n");
         return -1;
     }
+    trace_end("read", t);
 
     return 0;
 }
+
+/* Opens a TCP connection to host:port, for servers that talk to other servers.
+   Returns the socket on success and -1 on failure. */
+int comm_connect(const char *host, const char *port) {
+    int sock = -1;
+    struct addrinfo hints;
+    struct addrinfo *result;
+    struct addrinfo *res;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int err;
+    if ((err = getaddrinfo(host, port, &hints, &result)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+        return -1;
+    }
+
+    for (res = result; res != NULL; res = res->ai_next) {
+        if ((sock = socket(res->ai_family, res->ai_socktype,
+                           res->ai_protocol)) < 0)
+            continue;
+        if (connect(sock, res->ai_addr, res->ai_addrlen) >= 0) break;
+        if (close(sock) < 0) perror("close");
+        sock = -1;
+    }
+
+    freeaddrinfo(result);
+    return sock;
+}
+
+//------------------------------------------------------------------------------------------------
+// Shared-memory ring connections
+
+comm_ring_t *comm_ring_accept(FILE *cxstr) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    int sock = fileno(cxstr);
+    if (getsockname(sock, (struct sockaddr *)&addr, &len) < 0 ||
+        addr.ss_family != AF_UNIX)
+        return NULL;
+
+    comm_ring_t *ring;
+    if ((ring = malloc(sizeof(comm_ring_t))) == NULL) return NULL;
+    int fd;
+    if ((ring->rings = ring_create(&fd)) == NULL) {
+        free(ring);
+        return NULL;
+    }
+    ring->sock = sock;
+    ring->fd = fd;
+
+    if (ring_send_fd(sock, fd) < 0) {
+        comm_ring_shutdown(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+comm_ring_t *comm_ring_adopt(int sock, int fd) {
+    comm_ring_t *ring;
+    if ((ring = malloc(sizeof(comm_ring_t))) == NULL) return NULL;
+    if ((ring->rings = ring_map(fd)) == NULL) {
+        free(ring);
+        return NULL;
+    }
+    ring->sock = sock;
+    ring->fd = fd;
+    return ring;
+}
+
+int comm_ring_fd(comm_ring_t *ring) { return ring->fd; }
+
+/* Pushes response onto ring's response ring. The futex waits are not
+   cancellation points, so it waits in slices and checks for cancellation and
+   hangup in between. Returns 0, or -1 once the client is gone. */
+static int ring_respond(comm_ring_t *ring, const char *response) {
+    while (ring_push(&ring->rings->resp, response, RING_POLL_MS) != RING_OK) {
+        pthread_testcancel();
+        if (ring_peer_gone(ring->sock)) {
+            fprintf(stderr, "client connection terminated\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int comm_ring_serve(comm_ring_t *ring, char *response, char *command,
+                    int may_hand_off) {
+    uint64_t t = trace_start();
+    if (strlen(response) > 0) {
+        if (ring_respond(ring, response) < 0) return -1;
+        trace_end("write", t);
+    }
+    trace_request_end();
+
+    trace_request_begin();
+    t = trace_start();
+    while (1) {
+        // whatever the client queued stays in the ring for the new server
+        if (may_hand_off && __atomic_load_n(&handing_off, __ATOMIC_SEQ_CST))
+            return COMM_HANDOFF;
+        int ret = ring_pop(&ring->rings->req, command, BUFLEN, RING_POLL_MS);
+        if (ret == RING_OK) break;
+        if (ret == RING_ILLFORMED) {
+            if (ring_respond(ring, "ill-formed command") < 0) return -1;
+            continue;
+        }
+        pthread_testcancel();
+        if (ring_peer_gone(ring->sock)) {
+            fprintf(stderr, "client connection terminated\n");
+            return -1;
+        }
+    }
+    trace_end("read", t);
+    return 0;
+}
+
+void comm_ring_shutdown(comm_ring_t *ring) {
+    ring_unmap(ring->rings);
+    if (close(ring->fd) < 0) perror("close");
+    free(ring);
+}
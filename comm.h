@@ -13,8 +13,57 @@
         exit(EXIT_FAILURE);      \
     } while (0)
 
-pthread_t start_listener(int port, void (*serve_func)(FILE *));
+#define COMM_MAX_LISTENERS 64
+#define COMM_HANDOFF 1  // returned by comm_serve() to pass a client on
+
+/* start_listeners() binds count SO_REUSEPORT sockets on port, each with its own
+   accept thread, so that the kernel spreads incoming connections across them.
+   count 0 means one per online CPU and backlog 0 means SOMAXCONN. The Unix
+   socket gets a single accept thread. stop_listeners() cancels and joins every
+   accept thread and closes their sockets. */
+void start_listeners(int port, int count, int backlog,
+                     void (*serve_func)(FILE *));
+void start_unix_listener(const char *path, int backlog,
+                         void (*serve_func)(FILE *));
+void stop_listeners(void);
+/* For handing the server off (see handoff.h). comm_stop_accepting() cancels
+   and joins the accept threads but keeps their sockets open, and
+   comm_resume_accepting() starts them again. comm_listener_fds() stores the
+   listening TCP sockets in socks and returns how many there are, with the
+   Unix socket, or -1, in *unix_fd. comm_adopt_listeners() accepts on sockets
+   passed from another server, as start_listeners() and start_unix_listener()
+   would on their own. */
+void comm_stop_accepting(void);
+void comm_resume_accepting(void);
+int comm_listener_fds(int *socks, int *unix_fd);
+void comm_adopt_listeners(const int *socks, int count, int unix_fd,
+                          void (*serve_func)(FILE *));
+/* Logs where a connection came from; called by the client thread, so that the
+   accept threads do no per-connection formatting or output. */
+void comm_log_peer(FILE *cxstr);
 void comm_shutdown(FILE *cxstr);
-int comm_serve(FILE *cxstr, char *resp, char *cmd);
+/* comm_serve() writes resp, if any, and reads the next command into cmd.
+   Returns 0, -1 once the client is gone, or, if may_hand_off is set and
+   comm_handoff_begin() has been called, COMM_HANDOFF at the first boundary
+   where nothing the client sent has been read ahead of it.
+   comm_handoff_end() calls a hand-off off again. */
+int comm_serve(FILE *cxstr, char *resp, char *cmd, int may_hand_off);
+void comm_handoff_begin(void);
+void comm_handoff_end(void);
+int comm_connect(const char *host, const char *port);
+
+/* A client that switched to the shared-memory transport (see ring.h).
+   comm_ring_accept() sets it up on a Unix socket connection that sent `M` and
+   returns NULL if that is not possible; comm_ring_serve() then takes the place
+   of comm_serve(). comm_ring_shutdown() does not close the socket.
+   comm_ring_fd() is the ring's memfd, which comm_ring_adopt() maps again in
+   the server a client is handed off to. */
+typedef struct comm_ring comm_ring_t;
+comm_ring_t *comm_ring_accept(FILE *cxstr);
+comm_ring_t *comm_ring_adopt(int sock, int fd);
+int comm_ring_fd(comm_ring_t *ring);
+int comm_ring_serve(comm_ring_t *ring, char *resp, char *cmd,
+                    int may_hand_off);
+void comm_ring_shutdown(comm_ring_t *ring);
 
 #endif  // COMM_H_
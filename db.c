@@ -1,34 +1,429 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "./bloom.h"
+#include "./cache.h"
 #include "./comm.h"
 #include "./db.h"
+#include "./hash.h"
+#include "./hot.h"
+#include "./nodelock.h"
+#include "./part.h"
+#include "./repl.h"
+#include "./skiplist.h"
+#include "./trace.h"
+#include "./vindex.h"
+#include "./watch.h"
 
 #define MAXLEN 256
 
 // The root node of the binary tree, unlike all
 // other nodes in the tree, this one is never
 // freed (it's allocated in the data region).
-node_t head = {"", "", 0, 0, PTHREAD_RWLOCK_INITIALIZER};
+node_t head = {"", 0, "", 0, 0, 0, 0, 0, 0, NODELOCK_INITIALIZER};
 
-void lock(pthread_rwlock_t *rwlock, enum locktype lt) {
+// The tree the calling thread works on: head, or a partition's root (see
+// part.h). A thread that has its tree to itself, a partition's worker or a
+// transaction holding its partitions, takes no locks on it.
+static __thread node_t *root = &head;
+static __thread int tree_private;
+
+// The nodes whose sizes the calling thread's search_prefixed() has changed,
+// root first, until path_release(). On a shared tree each is pinned, so that
+// it outlives a concurrent remove of it until the change is settled; the
+// remover marks it NODE_UNLINKED and whoever lets go of it last frees it.
+// A deeper path than PATH_INLINE goes on the heap until path_release(), so
+// that a thread leaves nothing allocated behind when it exits.
+#define NODE_UNLINKED 0x80000000u
+#define PATH_INLINE 64
+static __thread node_t *path_inline[PATH_INLINE];
+static __thread node_t **path;
+static __thread size_t path_len;
+static __thread size_t path_cap;
+
+// Every single-key command holds its key's stripe shared; a transaction holds
+// the stripes of all of its keys exclusively.
+#define KEY_STRIPES 1024
+pthread_rwlock_t key_stripes[KEY_STRIPES] = {
+    [0 ... KEY_STRIPES - 1] = PTHREAD_RWLOCK_INITIALIZER};
+
+// db_add() and db_remove() hold their key's stripe here from their descent
+// until they have added or removed the key, so that nobody else adds or
+// removes it in between.
+pthread_mutex_t size_stripes[KEY_STRIPES] = {
+    [0 ... KEY_STRIPES - 1] = PTHREAD_MUTEX_INITIALIZER};
+
+// Running totals kept by node_constructor, node_destructor and every value
+// change, so that `i tree` needs no traversal.
+unsigned long tree_nodes;
+unsigned long tree_key_bytes;
+unsigned long tree_value_bytes;
+unsigned long tree_value_cap;  // bytes allocated for values
+unsigned long tree_mem_bytes;  // nodes, keys and values, as allocated
+
+// The memory limit (see db_mem_limit()). Writes in progress hold what they
+// have set aside for themselves in mem_reserved, on top of tree_mem_bytes.
+#define EVICT_ROUNDS 16  // evictions one write makes before giving up
+size_t mem_limit;
+int mem_evict;
+unsigned long mem_reserved;
+unsigned long mem_evictions;
+unsigned long mem_refusals;
+static __thread unsigned int evict_seed;
+// Set while a transaction applies what it reserved room for as a whole
+static __thread int mem_prepaid;
+
+// The type of every key in the tree (see db_key_type()). An int64 key is kept
+// only as its node's prefix, with a NULL key. A binary key lives in key_inline
+// bytes at the end of its node's allocation, and a string key in an
+// allocation of its own.
+static enum keytype key_type = KEY_STRING;
+static size_t key_binary_len;
+static size_t key_inline;
+
+// Set when a skip list holds the keys instead of the tree (see db_backend())
+static int skiplist;
+
+// Set when db_remove() leaves tombstones for the compactor (see
+// db_tombstones()). A tombstone is a node whose value is NULL.
+static int tombstones;
+
+// Set when values are stored relative to their keys (see db_compress()). A
+// compressed value is one byte holding 1 + the number of leading bytes it
+// shares with its key, then the rest of the value, so it is still a string.
+#define VALUE_SHARED_MAX 254
+static int compress_values;
+
+static inline size_t key_stripe(char *key) {
+    return hash_key(key) & (KEY_STRIPES - 1);
+}
+
+/* Returns an integer whose ordering matches the ordering of keys: key's value
+   with the sign bit flipped for an int64 key, and otherwise its first
+   KEY_PREFIX_LEN bytes, zero padded, whose ordering matches strcmp's. */
+static inline uint64_t key_prefix(const char *key) {
+    if (key_type == KEY_INT64 && *key != '\0')
+        return (uint64_t)strtoll(key, NULL, 10) ^ (1ULL << 63);
+    uint64_t prefix = 0;
+    for (int i = 0; i < KEY_PREFIX_LEN; i++) {
+        prefix <<= 8;
+        if (*key != '\0') prefix |= (unsigned char)*key++;
+    }
+    return prefix;
+}
+
+/* Compares key a, whose prefix is ap, with key b, whose prefix is bp. The
+   prefixes usually decide, so the keys themselves are only read when they
+   tie, and never for int64 keys, whose prefix is all of them. */
+static inline int compare_keys(const char *a, uint64_t ap, const char *b,
+                               uint64_t bp) {
+    if (ap != bp) return ap < bp ? -1 : 1;
+    switch (key_type) {
+        case KEY_INT64:
+            return 0;
+        case KEY_BINARY:
+            if (key_binary_len <= KEY_PREFIX_LEN) return 0;
+            return memcmp(a + KEY_PREFIX_LEN, b + KEY_PREFIX_LEN,
+                          key_binary_len - KEY_PREFIX_LEN);
+        default:
+            if ((ap & 0xff) == 0) return 0;  // both keys end inside the prefix
+            return strcmp(a + KEY_PREFIX_LEN, b + KEY_PREFIX_LEN);
+    }
+}
+
+/* Compares key, whose prefix is kp, with node's key. */
+static inline int key_compare(const char *key, uint64_t kp, node_t *node) {
+    return compare_keys(key, kp, node->key, node->key_prefix);
+}
+
+/* Bytes allocated for key in its node. */
+static inline size_t key_alloc(const char *key) {
+    if (key_type == KEY_INT64) return 0;
+    return key_inline > 0 ? key_inline : strlen(key) + 1;
+}
+
+static inline int key_is_inline(node_t *node) {
+    return node->key == (char *)(node + 1);
+}
+
+/* Returns node's key, formatting an int64 key into buf, which must hold
+   DB_INT64_KEY_LEN + 1 bytes. */
+static inline const char *node_key(node_t *node, char *buf) {
+    if (node->key != NULL) return node->key;
+    snprintf(buf, DB_INT64_KEY_LEN + 1, "%lld",
+             (long long)(node->key_prefix ^ (1ULL << 63)));
+    return buf;
+}
+
+/* How many leading bytes value shares with key, as far as a compressed value
+   can say. */
+static inline size_t value_shared(const char *key, const char *value) {
+    size_t n = 0;
+    while (n < VALUE_SHARED_MAX && key[n] != '\0' && key[n] == value[n]) n++;
+    return n;
+}
+
+/* Bytes allocated for value in key's node. */
+static inline size_t value_alloc(const char *key, const char *value) {
+    size_t len = strlen(value) + 1;
+    return compress_values ? len + 1 - value_shared(key, value) : len;
+}
+
+/* Stores value into buf, which must hold value_alloc(key, value) bytes. */
+static inline void value_store(char *buf, const char *key, const char *value) {
+    if (!compress_values) {
+        strcpy(buf, value);
+        return;
+    }
+    size_t shared = value_shared(key, value);
+    buf[0] = (char)(shared + 1);
+    strcpy(buf + 1, value + shared);
+}
+
+/* Writes node's value into buf, truncated to len bytes as snprintf would. */
+static inline void value_load(node_t *node, char *buf, int len) {
+    if (!compress_values) {
+        snprintf(buf, len, "%s", node->value);
+        return;
+    }
+    char name[DB_INT64_KEY_LEN + 1];
+    size_t shared = (unsigned char)node->value[0] - 1;
+    if (len <= 0) return;
+    if (shared >= (size_t)len) shared = len - 1;
+    memcpy(buf, node_key(node, name), shared);
+    snprintf(buf + shared, len - shared, "%s", node->value + 1);
+}
+
+/* Returns node's value, rebuilding a compressed one in buf, which must hold
+   MAXLEN + 1 bytes. */
+static inline const char *node_value(node_t *node, char *buf) {
+    if (!compress_values) return node->value;
+    value_load(node, buf, MAXLEN + 1);
+    return buf;
+}
+
+/* Whether node's value shares its key's allocation, as a compressed value
+   that came with a string key does. */
+static inline int value_is_inline(node_t *node) {
+    return node->value != NULL && node->key != NULL && !key_is_inline(node) &&
+           node->value == node->key + strlen(node->key) + 1;
+}
+
+static inline void value_free(node_t *node) {
+    if (node->value != NULL && !value_is_inline(node)) free(node->value);
+}
+
+/* value_free() for a value that is replaced or buried while its node stays.
+   A value in its key's allocation is given back by shrinking that to the key
+   alone, which may move the key; the caller holds node's write lock. */
+static inline void value_drop(node_t *node) {
+    if (!value_is_inline(node)) {
+        value_free(node);
+        return;
+    }
+    char *key = (char *)realloc(node->key, strlen(node->key) + 1);
+    if (key != NULL) node->key = key;
+}
+
+int db_key_type(enum keytype type, size_t len) {
+    switch (type) {
+        case KEY_INT64:
+            key_inline = 0;
+            break;
+        case KEY_BINARY:
+            if (len == 0 || len >= MAXLEN) return -1;
+            key_binary_len = len;
+            key_inline = len + 1;
+            break;
+        default:
+            key_inline = 0;
+    }
+    key_type = type;
+    return 0;
+}
+
+int db_key_normalize(char *key) {
+    switch (key_type) {
+        case KEY_INT64: {
+            char *end;
+            errno = 0;
+            long long v = strtoll(key, &end, 10);
+            if (end == key || *end != '\0' || errno != 0) return -1;
+            // never longer than what it was parsed from
+            snprintf(key, DB_INT64_KEY_LEN + 1, "%lld", v);
+            return 0;
+        }
+        case KEY_BINARY:
+            return strlen(key) == key_binary_len ? 0 : -1;
+        default:
+            return 0;
+    }
+}
+
+void db_backend(enum backend backend) {
+    skiplist = backend == DB_SKIPLIST;
+    if (skiplist) sl_init(compare_keys);
+}
+
+void db_compress(int on) { compress_values = on; }
+
+void lock(nodelock_t *rwlock, enum locktype lt) {
     // lt of 0 means l_read, while lt of 1 means l_write
-    int err;
     assert(lt == l_read || lt == l_write);
+    if (tree_private) return;
+    uint64_t t = trace_start();
+    if (lt == l_read) {
+        nodelock_rdlock(rwlock);
+        trace_end("read lock", t);
+    } else {
+        nodelock_wrlock(rwlock);
+        trace_end("write lock", t);
+    }
+}
+
+void unlock(nodelock_t *rwlock) {
+    if (tree_private) return;
+    nodelock_unlock(rwlock);
+}
+
+/* lock() and unlock() for key stripes, which are pthread rwlocks whatever the
+   node lock is, since a transaction may hold any number of them. */
+void stripe_lock(pthread_rwlock_t *rwlock, enum locktype lt) {
+    int err;
+    if (tree_private) return;
+    uint64_t t = trace_start();
     if (lt == l_read) {
         if ((err = pthread_rwlock_rdlock(rwlock)))
             handle_error_en(err, "pthread_rwlock_rdlock");
-    } else if ((err = pthread_rwlock_wrlock(rwlock)))
-        handle_error_en(err, "pthread_rwlock_wrlock");
+        trace_end("read lock", t);
+    } else {
+        if ((err = pthread_rwlock_wrlock(rwlock)))
+            handle_error_en(err, "pthread_rwlock_wrlock");
+        trace_end("write lock", t);
+    }
+}
+
+void stripe_unlock(pthread_rwlock_t *rwlock) {
+    int err;
+    if (tree_private) return;
+    if ((err = pthread_rwlock_unlock(rwlock)))
+        handle_error_en(err, "pthread_rwlock_unlock");
+}
+
+//------------------------------------------------------------------------------------------------
+// Partition routing
+
+void db_root_init(node_t *tree) {
+    memset(tree, 0, sizeof(node_t));
+    tree->key = "";
+    tree->value = "";
+    nodelock_init(&tree->rw_lock);
+}
+
+void db_use_tree(node_t *tree, int private) {
+    root = tree;
+    tree_private = private;
+}
+
+/* Whether the calling thread must ship its database calls to the owning
+   partition's worker. */
+static inline int routed(void) { return part_count > 0 && !tree_private; }
+
+// A database call shipped to the worker owning its key
+typedef struct db_call {
+    char op;
+    char *key;
+    char *value;
+    char *expected;
+    char *result;
+    int len;
+    int ret;
+} db_call_t;
+
+void db_call_run(void *arg) {
+    db_call_t *c = arg;
+    switch (c->op) {
+        case 'q':
+            db_query(c->key, c->result, c->len);
+            break;
+        case 'a':
+            c->ret = db_add(c->key, c->value);
+            break;
+        case 'u':
+            c->ret = db_update(c->key, c->value);
+            break;
+        case 'w':
+            c->ret = db_upsert(c->key, c->value);
+            break;
+        case 'c':
+            c->ret = db_cas(c->key, c->expected, c->value);
+            break;
+        case 'd':
+            c->ret = db_remove(c->key);
+            break;
+    }
+}
+
+int db_route(char op, char *key, char *value, char *expected, char *result,
+             int len) {
+    db_call_t c = {op, key, value, expected, result, len, 0};
+    part_run(part_of(key), db_call_run, &c);
+    return c.ret;
+}
+
+/* Runs fn(arg) against every tree in turn: on each partition's worker when
+   the tree is partitioned, and on the calling thread otherwise. */
+void for_each_tree(void (*fn)(void *), void *arg) {
+    if (!routed()) {
+        fn(arg);
+        return;
+    }
+    for (int i = 0; i < part_count; i++) part_run(i, fn, arg);
 }
 
 //------------------------------------------------------------------------------------------------
 // Constructor, destructor, and cleanup methods
 
+/* Adds (sign 1) or subtracts (sign -1) node from the running totals. */
+static inline void account_node(node_t *node, int sign) {
+    size_t bytes = sizeof(node_t);
+    __atomic_add_fetch(&tree_nodes, sign, __ATOMIC_RELAXED);
+    if (node->key != NULL) {
+        __atomic_add_fetch(&tree_key_bytes, sign * strlen(node->key),
+                           __ATOMIC_RELAXED);
+        bytes += key_alloc(node->key);
+    }
+    if (node->value != NULL) {
+        __atomic_add_fetch(&tree_value_bytes, sign * strlen(node->value),
+                           __ATOMIC_RELAXED);
+        __atomic_add_fetch(&tree_value_cap, sign * node->value_cap,
+                           __ATOMIC_RELAXED);
+        bytes += node->value_cap;
+    }
+    __atomic_add_fetch(&tree_mem_bytes, sign * bytes, __ATOMIC_SEQ_CST);
+}
+
+/* The clock node atimes are taken from, in milliseconds. Wraps after 49
+   days, which only matters to ages compared across the wrap. */
+static inline uint32_t mem_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Marks node as just used, when eviction is on. Readers holding only a read
+   lock do this too, hence the atomic store. */
+static inline void touch(node_t *node) {
+    if (mem_evict)
+        __atomic_store_n(&node->atime, mem_clock(), __ATOMIC_RELAXED);
+}
+
 node_t *node_constructor(char *arg_key, char *arg_value, node_t *arg_left,
                          node_t *arg_right) {
     size_t key_len = strlen(arg_key);
@@ -36,51 +431,55 @@ node_t *node_constructor(char *arg_key, char *arg_value, node_t *arg_left,
 
     if (key_len > MAXLEN || val_len > MAXLEN) return 0;
 
-    node_t *new_node = (node_t *)malloc(sizeof(node_t));
+    // a binary key goes right after the node, and a compressed value right
+    // after a string key
+    size_t val_bytes = value_alloc(arg_key, arg_value);
+    int together = compress_values && key_type == KEY_STRING;
+    node_t *new_node = (node_t *)malloc(sizeof(node_t) + key_inline);
 
     if (new_node == NULL) return 0;
 
-    if ((new_node->key = (char *)malloc(key_len + 1)) == NULL) {
+    if (key_type == KEY_INT64) {
+        new_node->key = NULL;  // all in the prefix
+    } else if (key_inline > 0) {
+        new_node->key = (char *)(new_node + 1);
+    } else if ((new_node->key = (char *)malloc(
+                    key_len + 1 + (together ? val_bytes : 0))) == NULL) {
         free(new_node);
         return 0;
     }
-    if ((new_node->value = (char *)malloc(val_len + 1)) == NULL) {
-        free(new_node->key);
+    if (together) {
+        new_node->value = new_node->key + key_len + 1;
+    } else if ((new_node->value = (char *)malloc(val_bytes)) == NULL) {
+        if (!key_is_inline(new_node)) free(new_node->key);
         free(new_node);
         return 0;
     }
 
-    if ((snprintf(new_node->key, MAXLEN, "%s", arg_key)) < 0) {
-        free(new_node->value);
-        free(new_node->key);
-        free(new_node);
-        return 0;
-    }
-    if ((snprintf(new_node->value, MAXLEN, "%s", arg_value)) < 0) {
-        free(new_node->value);
-        free(new_node->key);
-        free(new_node);
-        return 0;
-    }
-    int err;
-    if ((err = pthread_rwlock_init(&new_node->rw_lock, 0)) != 0) {
-        free(new_node->value);
-        free(new_node->key);
-        free(new_node);
-        handle_error_en(err, "pthread_rwlock_init");
-    }
+    if (new_node->key != NULL) memcpy(new_node->key, arg_key, key_len + 1);
+    new_node->key_prefix = key_prefix(arg_key);
+    value_store(new_node->value, arg_key, arg_value);
+    nodelock_init(&new_node->rw_lock);
+    new_node->value_cap = val_bytes;
     new_node->lchild = arg_left;
     new_node->rchild = arg_right;
+    new_node->size = 1;
+    new_node->atime = 0;
+    new_node->pins = 0;
+    touch(new_node);
+    account_node(new_node, 1);
     return new_node;
 }
 
+/* The node itself is freed by the last writer to unpin it, if any still has
+   it pinned (see path_release()). */
 void node_destructor(node_t *node) {
-    int err;
-    if ((err = pthread_rwlock_destroy(&node->rw_lock)) != 0)
-        handle_error_en(err, "pthread_rwlock_destroy");
-    if (node->key != NULL) free(node->key);
-    if (node->value != NULL) free(node->value);
-    free(node);
+    account_node(node, -1);
+    nodelock_destroy(&node->rw_lock);
+    value_free(node);
+    if (node->key != NULL && !key_is_inline(node)) free(node->key);
+    if (__atomic_fetch_or(&node->pins, NODE_UNLINKED, __ATOMIC_ACQ_REL) == 0)
+        free(node);
 }
 
 /* Recursively destroys node and all its children. */
@@ -92,251 +491,2375 @@ void db_cleanup_recurs(node_t *node) {
     db_cleanup_recurs(node->lchild);
     db_cleanup_recurs(node->rchild);
 
-    node_destructor(node);
+    node_destructor(node);
+}
+
+void db_cleanup() {
+    if (skiplist) {
+        sl_cleanup();
+        return;
+    }
+    db_cleanup_recurs(root->lchild);
+    db_cleanup_recurs(root->rchild);
+}
+
+/* Write-locks node before destroying its subtree, so that any reader or writer
+   still inside the subtree has moved below us (or left) before we free. */
+void db_clear_recurs(node_t *node) {
+    if (node == NULL) {
+        return;
+    }
+
+    lock(&node->rw_lock, l_write);
+    db_clear_recurs(node->lchild);
+    db_clear_recurs(node->rchild);
+    unlock(&node->rw_lock);
+
+    node_destructor(node);
+}
+
+void db_clear() {
+    if (skiplist) {
+        sl_clear();
+        bloom_reset();
+        return;
+    }
+    if (routed()) {
+        // every partition at once, or the filter reset below would drop the
+        // keys of partitions not cleared yet
+        size_t all[PART_MAX];
+        for (int i = 0; i < part_count; i++) all[i] = i;
+        part_holds_t *holds;
+        if ((holds = part_hold(all, part_count)) == NULL) {
+            perror("part_hold");
+            return;
+        }
+        for (int i = 0; i < part_count; i++) {
+            db_use_tree(part_root(i), 1);
+            db_clear();
+        }
+        db_use_tree(&head, 0);
+        part_release(holds);
+        return;
+    }
+
+    lock(&root->rw_lock, l_write);
+    node_t *left = root->lchild;
+    node_t *right = root->rchild;
+    root->lchild = NULL;
+    root->rchild = NULL;
+    root->size = 0;
+    bloom_reset();
+    vindex_reset();
+    unlock(&root->rw_lock);
+
+    cache_invalidate_all();
+    db_clear_recurs(left);
+    db_clear_recurs(right);
+}
+
+//------------------------------------------------------------------------------------------------
+// Order statistics
+
+static inline size_t subtree_size(node_t *node) {
+    return node == NULL ? 0 : __atomic_load_n(&node->size, __ATOMIC_RELAXED);
+}
+
+/* Returns the number of keys in the tree smaller than key, or no greater than
+   key with inclusive set, descending once with read locks hand over hand. */
+size_t tree_rank(char *key, int inclusive) {
+    uint64_t kp = key_prefix(key);
+    size_t rank = 0;
+    node_t *parent = root;
+    lock(&root->rw_lock, l_read);
+    node_t *next = root->rchild;  // every key sorts after the root's ""
+    while (next != NULL) {
+        lock(&next->rw_lock, l_read);
+        unlock(&parent->rw_lock);
+        parent = next;
+        int cmp = key_compare(key, kp, next);
+        if (cmp < 0) {
+            next = next->lchild;
+            continue;
+        }
+        rank += subtree_size(next->lchild);
+        if (cmp == 0) {
+            rank += inclusive;
+            break;
+        }
+        rank++;
+        next = next->rchild;
+    }
+    unlock(&parent->rw_lock);
+    return rank;
+}
+
+/* Returns the node holding the k'th smallest key of the tree, read-locked,
+   or NULL if there is none. */
+node_t *select_node(size_t k) {
+    node_t *parent = root;
+    lock(&root->rw_lock, l_read);
+    node_t *next = root->rchild;
+    while (next != NULL) {
+        lock(&next->rw_lock, l_read);
+        unlock(&parent->rw_lock);
+        parent = next;
+        size_t left = subtree_size(next->lchild);
+        if (k < left) {
+            next = next->lchild;
+        } else if (k == left) {
+            return next;
+        } else {
+            k -= left + 1;
+            next = next->rchild;
+        }
+    }
+    unlock(&parent->rw_lock);
+    return NULL;
+}
+
+/* Writes the k'th smallest key of the tree into key and its value into value
+   (each at most len bytes) and returns 0, or returns -1 if there is none. */
+int tree_select(size_t k, char *key, char *value, int len) {
+    char buf[DB_INT64_KEY_LEN + 1];
+    node_t *node = select_node(k);
+    if (node == NULL) return -1;
+    snprintf(key, len, "%s", node_key(node, buf));
+    if (value != NULL) value_load(node, value, len);
+    unlock(&node->rw_lock);
+    return 0;
+}
+
+// A rank or select shipped to each partition in turn, or to one of them
+typedef struct order_call {
+    char *key;
+    int inclusive;
+    size_t k;
+    char *value;
+    int len;
+    size_t ret;  // the rank, or tree_select()'s return
+} order_call_t;
+
+void rank_call(void *arg) {
+    order_call_t *c = arg;
+    c->ret += tree_rank(c->key, c->inclusive);
+}
+
+void select_call(void *arg) {
+    order_call_t *c = arg;
+    c->ret = tree_select(c->k, c->key, c->value, c->len);
+}
+
+void size_call(void *arg) { *(size_t *)arg = subtree_size(root->rchild); }
+
+/* Number of keys across all trees below key (or up to it, with inclusive). */
+size_t rank_all(char *key, int inclusive) {
+    order_call_t c = {key, inclusive, 0, NULL, 0, 0};
+    for_each_tree(rank_call, &c);
+    return c.ret;
+}
+
+size_t db_count(char *lo, char *hi) {
+    if (compare_keys(lo, key_prefix(lo), hi, key_prefix(hi)) > 0) return 0;
+    size_t below = rank_all(lo, 0);
+    size_t upto = rank_all(hi, 1);
+    return upto > below ? upto - below : 0;
+}
+
+size_t db_rank(char *key) { return rank_all(key, 0); }
+
+/*
+ * On a partitioned tree the k'th smallest key is found by narrowing down, in
+ * each partition, the window of ranks it can have there. Each round takes the
+ * middle key c of the widest window and asks every partition how many of its
+ * keys are smaller than c. If that makes k keys, c is the answer; if fewer, no
+ * partition's answer lies at or below its count, and if more, none lies at or
+ * above it. Every round halves the widest window, so it takes at most
+ * part_count times the log of the tree size rounds, each one call to every
+ * partition.
+ */
+int db_select(size_t k, char *result, int len) {
+    char key[MAXLEN];
+    char value[MAXLEN];
+    if (!routed()) {
+        if (tree_select(k, key, value, MAXLEN) < 0) return -1;
+        snprintf(result, len, "%s %s", key, value);
+        return 0;
+    }
+
+    size_t lo[PART_MAX], hi[PART_MAX], below[PART_MAX];
+    for (int i = 0; i < part_count; i++) {
+        lo[i] = 0;
+        part_run(i, size_call, &hi[i]);
+    }
+    while (1) {
+        int p = 0;
+        for (int i = 1; i < part_count; i++)
+            if (hi[i] - lo[i] > hi[p] - lo[p]) p = i;
+        if (lo[p] >= hi[p]) return -1;
+
+        size_t mid = lo[p] + (hi[p] - lo[p]) / 2;
+        order_call_t c = {key, 0, mid, value, MAXLEN, 0};
+        part_run(p, select_call, &c);
+        if (c.ret != 0) return -1;  // shrunk under us
+
+        size_t rank = 0;
+        for (int i = 0; i < part_count; i++) {
+            order_call_t r = {key, 0, 0, NULL, 0, 0};
+            if (i == p)
+                r.ret = mid;
+            else
+                part_run(i, rank_call, &r);
+            below[i] = r.ret;
+            rank += r.ret;
+        }
+        if (rank == k) {
+            snprintf(result, len, "%s %s", key, value);
+            return 0;
+        }
+        for (int i = 0; i < part_count; i++) {
+            if (rank < k) {
+                size_t floor = i == p ? mid + 1 : below[i];
+                if (lo[i] < floor) lo[i] = floor;
+            } else if (hi[i] > below[i]) {
+                hi[i] = below[i];
+            }
+        }
+    }
+}
+
+//------------------------------------------------------------------------------------------------
+// Memory limit
+
+void db_mem_limit(size_t limit, int evict) {
+    mem_limit = limit;
+    mem_evict = limit > 0 && evict;
+}
+
+/* Removes the least recently used of DB_EVICT_SAMPLES keys of the tree picked
+   at random, leaving out key, the one being written. Returns -1 if there was
+   nothing to pick from. */
+int evict_one(char *key) {
+    char victim[MAXLEN];
+    char buf[DB_INT64_KEY_LEN + 1];
+    uint32_t now = mem_clock();
+    uint32_t oldest = 0;
+    int found = 0;
+
+    size_t n = __atomic_load_n(&root->size, __ATOMIC_RELAXED);
+    if (n == 0) return -1;
+    if (evict_seed == 0) evict_seed = now ^ (uintptr_t)&evict_seed;
+    for (int i = 0; i < DB_EVICT_SAMPLES; i++) {
+        size_t k = (size_t)rand_r(&evict_seed) << 31 | rand_r(&evict_seed);
+        node_t *node = select_node(k % n);
+        if (node == NULL) continue;
+        uint32_t age = now - __atomic_load_n(&node->atime, __ATOMIC_RELAXED);
+        // reads answered by the cache never touch the node
+        const char *name = node_key(node, buf);
+        if (strcmp(name, key) == 0 || cache_referenced(name)) {
+            unlock(&node->rw_lock);
+            continue;
+        }
+        if (!found || age > oldest) {
+            snprintf(victim, MAXLEN, "%s", name);
+            oldest = age;
+            found = 1;
+        }
+        unlock(&node->rw_lock);
+    }
+    if (!found) return -1;
+
+    // Take the victim's stripe as a single-key command would, so no one sees
+    // a transaction half applied. A transaction may hold it already, maybe
+    // the one calling us, so never wait for it.
+    pthread_rwlock_t *stripe = &key_stripes[key_stripe(victim)];
+    if (!tree_private && pthread_rwlock_tryrdlock(stripe) != 0) return 0;
+    if (db_remove(victim) == 1)
+        __atomic_add_fetch(&mem_evictions, 1, __ATOMIC_RELAXED);
+    stripe_unlock(stripe);
+    return 0;
+}
+
+/* Sets aside need bytes under the memory limit for a write to key, evicting
+   other keys first when allowed. Returns 0, or DB_FULL if there is no room.
+   Everything reserved must be handed back with mem_release() once the write
+   has been accounted for. */
+int mem_reserve(char *key, size_t need) {
+    if (mem_limit == 0 || mem_prepaid) return 0;
+    for (int round = 0;;) {
+        unsigned long reserved =
+            __atomic_load_n(&mem_reserved, __ATOMIC_SEQ_CST);
+        unsigned long used = __atomic_load_n(&tree_mem_bytes, __ATOMIC_SEQ_CST);
+        if (used + reserved + need <= mem_limit) {
+            if (__atomic_compare_exchange_n(&mem_reserved, &reserved,
+                                            reserved + need, 0,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+                return 0;
+            continue;
+        }
+        if (!mem_evict || round++ == EVICT_ROUNDS || evict_one(key) < 0) {
+            __atomic_add_fetch(&mem_refusals, 1, __ATOMIC_RELAXED);
+            return DB_FULL;
+        }
+    }
+}
+
+void mem_release(size_t need) {
+    if (mem_limit > 0 && !mem_prepaid)
+        __atomic_sub_fetch(&mem_reserved, need, __ATOMIC_SEQ_CST);
+}
+
+void db_mem_stats(char *buf, int len) {
+    if (skiplist) {
+        snprintf(buf, len, "not supported");
+        return;
+    }
+    unsigned long nodes = __atomic_load_n(&tree_nodes, __ATOMIC_RELAXED);
+    size_t lock_bytes = nodes * sizeof(nodelock_t);
+    snprintf(buf, len, "mem used=%lu limit=%zu policy=%s node_bytes=%zu "
+             "lock=%s lock_bytes=%zu key_bytes=%lu value_bytes=%lu "
+             "evictions=%lu refused=%lu",
+             __atomic_load_n(&tree_mem_bytes, __ATOMIC_RELAXED), mem_limit,
+             mem_limit == 0 ? "none" : mem_evict ? "evict" : "reject",
+             nodes * sizeof(node_t) - lock_bytes, nodelock_name, lock_bytes,
+             key_type == KEY_INT64 ? 0
+             : key_inline > 0
+                 ? nodes * key_inline
+                 : __atomic_load_n(&tree_key_bytes, __ATOMIC_RELAXED) + nodes,
+             __atomic_load_n(&tree_value_cap, __ATOMIC_RELAXED),
+             __atomic_load_n(&mem_evictions, __ATOMIC_RELAXED),
+             __atomic_load_n(&mem_refusals, __ATOMIC_RELAXED));
+}
+
+//------------------------------------------------------------------------------------------------
+// Deferred deletion
+
+// The keys of tombstones not yet unlinked, oldest first, for the compactor
+#define COMPACT_BATCH 64         // tombstones unlinked per pass
+#define COMPACT_INTERVAL_MS 100  // longest a smaller batch waits
+typedef struct buried {
+    struct buried *next;
+    char key[];
+} buried_t;
+
+static pthread_mutex_t buried_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t buried_cond = PTHREAD_COND_INITIALIZER;
+static buried_t *buried_head;
+static buried_t *buried_tail;
+static unsigned long buried_count;
+static unsigned long buried_total;
+static unsigned long compacted;
+static unsigned long compact_passes;
+static pthread_t compactor;
+static int compact_stopping;
+
+/* Queues key for the compactor, waking it once a batch is waiting. */
+void bury_queue(char *key) {
+    buried_t *b;
+    if ((b = malloc(sizeof(buried_t) + strlen(key) + 1)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    b->next = NULL;
+    strcpy(b->key, key);
+    pthread_mutex_lock(&buried_mutex);
+    if (buried_tail != NULL)
+        buried_tail->next = b;
+    else
+        buried_head = b;
+    buried_tail = b;
+    buried_total++;
+    if (++buried_count == COMPACT_BATCH) pthread_cond_signal(&buried_cond);
+    pthread_mutex_unlock(&buried_mutex);
+}
+
+//------------------------------------------------------------------------------------------------
+// Database modifiers and accessors
+
+/* Records node, which the caller holds locked, as one whose size it has
+   changed. */
+static inline void path_push(node_t *node) {
+    if (path_len == path_cap) {
+        node_t **grown = path_inline;
+        if (path_cap > 0 &&
+            (grown = malloc(2 * path_cap * sizeof(node_t *))) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        if (path_len > 0) memcpy(grown, path, path_len * sizeof(node_t *));
+        if (path != path_inline) free(path);
+        path = grown;
+        path_cap = path_cap == 0 ? PATH_INLINE : 2 * path_cap;
+    }
+    if (!tree_private) __atomic_add_fetch(&node->pins, 1, __ATOMIC_RELAXED);
+    path[path_len++] = node;
+}
+
+/* Settles the size changes of the last search_prefixed() with a delta: adds
+   undo (minus that delta to take the change back, or 0 to keep it) to the
+   size of each node it passed and unpins them. The nodes are the same ones
+   however the tree has changed since, so sizes come out right without the
+   locks, and one unlinked meanwhile is out of every count but its own. */
+void path_release(long undo) {
+    for (size_t i = 0; i < path_len; i++) {
+        node_t *node = path[i];
+        if (undo != 0) __atomic_add_fetch(&node->size, undo, __ATOMIC_RELAXED);
+        if (!tree_private &&
+            __atomic_sub_fetch(&node->pins, 1, __ATOMIC_ACQ_REL) ==
+                NODE_UNLINKED)
+            free(node);
+    }
+    path_len = 0;
+    if (path_cap > PATH_INLINE) {
+        free(path);
+        path = path_inline;
+        path_cap = PATH_INLINE;
+    }
+}
+
+/* search(), with key's prefix computed once for the whole descent. Adds
+   delta to the subtree size of every node it passes on the way, the parent it
+   returns included, which makes them the ancestors of the target or of where
+   the target would go. Those are recorded until path_release(), which the
+   caller must call once it knows whether to keep the change. */
+node_t *search_prefixed(char *key, uint64_t kp, node_t *parent,
+                        node_t **parentpp, enum locktype lt, long delta) {
+    /*
+     * TODO:
+     * Part 2: Make this thread safe!
+     */
+    node_t *next;
+    if (delta != 0) {
+        __atomic_add_fetch(&parent->size, delta, __ATOMIC_RELAXED);
+        path_push(parent);
+    }
+    if (key_compare(key, kp, parent) < 0) {
+        next = parent->lchild;
+    } else {
+        next = parent->rchild;
+    }
+
+    node_t *result;
+    if (next == NULL) {
+        result = NULL;
+    } else {
+        lock(&next->rw_lock, lt);
+        if (key_compare(key, kp, next) == 0) {
+            result = next;
+        } else {
+            unlock(&parent->rw_lock);
+            return search_prefixed(key, kp, next, parentpp, lt, delta);
+        }
+    }
+
+    if (parentpp != NULL) {
+        *parentpp = parent;
+    } else {
+        unlock(&parent->rw_lock);
+        //        return result;
+    }
+    return result;
+}
+
+node_t *search(char *key, node_t *parent, node_t **parentpp, enum locktype lt) {
+    return search_prefixed(key, key_prefix(key), parent, parentpp, lt, 0);
+}
+
+/* Adds delta to the subtree size of every node above key, or above where key
+   would go, with read locks. Takes back a batch's count for a key that it
+   then did not add or remove; that only works while the path cannot have
+   changed in between. */
+void adjust_path(char *key, long delta) {
+    lock(&root->rw_lock, l_read);
+    node_t *found = search_prefixed(key, key_prefix(key), root, NULL, l_read,
+                                    delta);
+    if (found != NULL) unlock(&found->rw_lock);
+    path_release(0);
+}
+
+/* Locks (or unlocks) size stripe i. A private tree has nobody to race. */
+void size_lock_stripe(size_t i, int locked) {
+    int err;
+    if (tree_private) return;
+    pthread_mutex_t *m = &size_stripes[i];
+    if (locked && (err = pthread_mutex_lock(m)))
+        handle_error_en(err, "pthread_mutex_lock");
+    if (!locked && (err = pthread_mutex_unlock(m)))
+        handle_error_en(err, "pthread_mutex_unlock");
+}
+
+/* Locks (or unlocks) key's size stripe. */
+void size_lock(char *key, int locked) {
+    size_lock_stripe(key_stripe(key), locked);
+}
+
+void db_query(char *key, char *result, int len) {
+    /*
+     * TODO:
+     * Part 2: Make this thread safe!
+     */
+    if (routed()) {
+        db_route('q', key, NULL, NULL, result, len);
+        return;
+    }
+    if (!bloom_may_contain(key)) {
+        snprintf(result, len, "not found");
+        return;
+    }
+    if (skiplist) {
+        // the cache's locks would be the only ones left, so it is not used
+        if (!sl_query(key, key_prefix(key), result, len)) {
+            bloom_false_positive();
+            snprintf(result, len, "not found");
+        }
+        return;
+    }
+    unsigned long version;
+    if (cache_lookup(key, result, len, &version)) return;
+
+    lock(&root->rw_lock, l_read);
+    node_t *target = search(key, root, NULL, 0);
+    if (target != NULL && target->value == NULL) {
+        unlock(&target->rw_lock);  // a tombstone
+        target = NULL;
+    }
+    if (target == NULL) {
+        bloom_false_positive();
+        snprintf(result, len, "not found");
+    } else {
+        value_load(target, result, len);
+        cache_fill(key, compress_values ? result : target->value, version);
+        touch(target);
+        unlock(&target->rw_lock);
+    }
+}
+
+/*
+ * Descends from the root holding only read locks, hand over hand, and returns
+ * the node containing key write-locked, or NULL. The write lock on the target
+ * is taken while its parent is still read-locked, so the target cannot be
+ * unlinked in between. Its contents can still be replaced by a two-child
+ * remove of key, so the key is checked again; if it changed, the node now
+ * holds key's successor and the descent simply carries on below it. A
+ * tombstone is returned like any other node.
+ */
+node_t *search_for_write(char *key) {
+    uint64_t kp = key_prefix(key);
+    node_t *parent = root;
+    lock(&root->rw_lock, l_read);
+
+    while (1) {
+        node_t *next;
+        if (key_compare(key, kp, parent) < 0)
+            next = parent->lchild;
+        else
+            next = parent->rchild;
+
+        if (next == NULL) {
+            unlock(&parent->rw_lock);
+            return NULL;
+        }
+
+        lock(&next->rw_lock, l_read);
+        int cmp = key_compare(key, kp, next);
+        if (cmp == 0) {
+            unlock(&next->rw_lock);
+            lock(&next->rw_lock, l_write);
+            cmp = key_compare(key, kp, next);
+        }
+        unlock(&parent->rw_lock);
+
+        if (cmp == 0) return next;
+        parent = next;
+    }
+}
+
+/* search_for_write() for a key that must be live: a tombstone is not found. */
+node_t *search_for_update(char *key) {
+    if (!bloom_may_contain(key)) return NULL;
+    node_t *target = search_for_write(key);
+    if (target != NULL && target->value == NULL) {
+        unlock(&target->rw_lock);
+        target = NULL;
+    }
+    if (target == NULL) bloom_false_positive();
+    return target;
+}
+
+/* Replaces node's value, reusing its buffer when the new value fits, or
+   gives a tombstone its value back. The caller holds node's write lock.
+   Returns 1 on success and 0 on failure. */
+int node_set_value(node_t *node, char *value) {
+    size_t val_len = strlen(value);
+    if (val_len > MAXLEN) return 0;
+    size_t old_len = node->value != NULL ? strlen(node->value) : 0;
+    char name[DB_INT64_KEY_LEN + 1];
+    const char *key = node_key(node, name);
+    size_t bytes = value_alloc(key, value);
+
+    char *buf = NULL;
+    if (bytes > node->value_cap && (buf = (char *)malloc(bytes)) == NULL)
+        return 0;
+    if (node->value == NULL) {
+        vindex_add(value, key);
+    } else if (vindex_enabled()) {
+        char old[MAXLEN + 1];
+        vindex_move(key, node_value(node, old), value);
+    }
+    if (buf != NULL) {
+        __atomic_add_fetch(&tree_value_cap, bytes - node->value_cap,
+                           __ATOMIC_RELAXED);
+        __atomic_add_fetch(&tree_mem_bytes, bytes - node->value_cap,
+                           __ATOMIC_SEQ_CST);
+        value_drop(node);
+        node->value = buf;
+        node->value_cap = bytes;
+        key = node_key(node, name);
+    }
+    __atomic_add_fetch(&tree_value_bytes, bytes - 1 - old_len,
+                       __ATOMIC_RELAXED);
+    value_store(node->value, key, value);
+    return 1;
+}
+
+/* Hands a change to the replicas and the subscribers. Called with the lock
+   that orders it against other writers of key still held; a skip list has no
+   such lock, so there concurrent changes to one key may be logged out of
+   order. */
+static inline void log_change(char op, const char *key, const char *value) {
+    repl_log(op, key, value);
+    watch_log(op, key, value);
+}
+
+/* db_add(), once there is room for the node. */
+int tree_add(char *key, char *value) {
+    /*
+     * TODO:
+     * Part 2: Make this thread safe!
+     */
+    node_t *parent;
+    node_t *target;
+    // The new node is counted in on the way down and, if the key is there
+    // already, out again.
+    size_lock(key, 1);
+    lock(&root->rw_lock, 1);
+    if ((target = search_prefixed(key, key_prefix(key), root, &parent, 1, 1)) !=
+        NULL) {
+        // a tombstone is brought back without touching the tree's shape
+        int ret = 0;
+        unlock(&parent->rw_lock);
+        if (target->value == NULL) {
+            bloom_add(key);  // before the key can be found
+            if ((ret = node_set_value(target, value) ? 1 : DB_FULL) == 1)
+                log_change('a', key, value);
+            else
+                bloom_remove(key);
+        }
+        unlock(&target->rw_lock);
+        path_release(-1);
+        size_lock(key, 0);
+        if (ret == 1) cache_invalidate(key);
+        return ret;
+    }
+
+    node_t *newnode = node_constructor(key, value, NULL, NULL);
+    if (newnode == NULL) {
+        unlock(&parent->rw_lock);
+        path_release(-1);
+        size_lock(key, 0);
+        return DB_FULL;
+    }
+    bloom_add(key);  // before the key can be found
+
+    if (key_compare(key, key_prefix(key), parent) < 0)
+        parent->lchild = newnode;
+    else
+        parent->rchild = newnode;
+    vindex_add(value, key);
+    log_change('a', key, value);
+
+    unlock(&parent->rw_lock);
+    path_release(0);
+    size_lock(key, 0);
+
+    cache_invalidate(key);
+    return 1;
+}
+
+int db_add(char *key, char *value) {
+    if (routed()) return db_route('a', key, value, NULL, NULL, 0);
+    if (skiplist) {
+        bloom_add(key);  // before the key can be found
+        if (!sl_add(key, key_prefix(key), value)) {
+            bloom_remove(key);
+            return 0;
+        }
+        log_change('a', key, value);
+        return 1;
+    }
+    size_t need = sizeof(node_t) + key_alloc(key) + value_alloc(key, value);
+    if (mem_reserve(key, need) < 0) return DB_FULL;
+    int ret = tree_add(key, value);
+    mem_release(need);
+    return ret;
+}
+
+/* search_for_update(), making sure there is room under the memory limit to
+   give the target value. A value that fits the target's buffer needs none;
+   otherwise the room is reserved into *reserved with the target unlocked, as
+   eviction cannot run while it is held, and the search done again. Returns
+   DB_FULL if there is no room, and 0 otherwise with the target in *target. */
+int search_for_value(char *key, char *value, node_t **target,
+                     size_t *reserved) {
+    *reserved = 0;
+    while (1) {
+        if ((*target = search_for_update(key)) == NULL) return 0;
+        if (value_alloc(key, value) <= (*target)->value_cap || *reserved > 0 ||
+            mem_limit == 0) {
+            touch(*target);
+            return 0;
+        }
+        unlock(&(*target)->rw_lock);
+        if (mem_reserve(key, value_alloc(key, value)) < 0) return DB_FULL;
+        *reserved = value_alloc(key, value);
+    }
+}
+
+int db_update(char *key, char *value) {
+    node_t *target;
+    size_t reserved;
+    if (routed()) return db_route('u', key, value, NULL, NULL, 0);
+    if (skiplist) {
+        if (!bloom_may_contain(key) ||
+            sl_update(key, key_prefix(key), NULL, value) <= 0)
+            return 0;
+        log_change('w', key, value);
+        return 1;
+    }
+    if (search_for_value(key, value, &target, &reserved) < 0) return DB_FULL;
+    if (target == NULL) {
+        mem_release(reserved);
+        return 0;
+    }
+
+    // a key that is there but whose value could not be allocated is full,
+    // not missing, or db_upsert() would go on trying to add it
+    int ret = node_set_value(target, value) ? 1 : DB_FULL;
+    if (ret == 1) log_change('w', key, value);
+    unlock(&target->rw_lock);
+    mem_release(reserved);
+
+    if (ret == 1) cache_invalidate(key);
+    return ret;
+}
+
+int db_upsert(char *key, char *value) {
+    if (routed()) return db_route('w', key, value, NULL, NULL, 0);
+    // Updating is the common case and needs no write locks above the target.
+    // Fall back to an insert when the key is missing, and retry should
+    // another client add it first.
+    while (1) {
+        int ret;
+        if ((ret = db_update(key, value)) != 0) return ret == DB_FULL ? ret : 0;
+        if ((ret = db_add(key, value)) != 0) return ret;
+    }
+}
+
+int db_cas(char *key, char *expected, char *value) {
+    node_t *target;
+    size_t reserved;
+    if (routed()) return db_route('c', key, value, expected, NULL, 0);
+    if (skiplist) {
+        int ret = bloom_may_contain(key)
+                      ? sl_update(key, key_prefix(key), expected, value)
+                      : 0;
+        if (ret == 0) return DB_CAS_MISSING;
+        if (ret < 0) return DB_CAS_MISMATCH;
+        log_change('w', key, value);
+        return DB_CAS_SWAPPED;
+    }
+    if (search_for_value(key, value, &target, &reserved) < 0) return DB_FULL;
+    if (target == NULL) {
+        mem_release(reserved);
+        return DB_CAS_MISSING;
+    }
+
+    int ret = DB_CAS_MISMATCH;
+    char buf[MAXLEN + 1];
+    if (strcmp(node_value(target, buf), expected) == 0) {
+        ret = node_set_value(target, value) ? DB_CAS_SWAPPED : DB_FULL;
+        if (ret == DB_CAS_SWAPPED) log_change('w', key, value);
+    }
+    unlock(&target->rw_lock);
+    mem_release(reserved);
+
+    if (ret == DB_CAS_SWAPPED) cache_invalidate(key);
+    return ret;
+}
+
+/* Replaces the contents of dnode, which is write-locked and has two children,
+   with those of its successor, the smallest node in its right subtree, which
+   is unlinked and destroyed. Every node on the way down to the successor
+   loses it from its size; dnode's own size is left to the caller. */
+void take_successor(node_t *dnode) {
+    node_t *next = dnode->rchild;
+    lock(&next->rw_lock, 1);
+    node_t **pnext = &dnode->rchild;
+
+    while (next->lchild != NULL) {
+        // work our way down the lchild chain, finding the smallest node
+        // in the subtree.
+        __atomic_sub_fetch(&next->size, 1, __ATOMIC_RELAXED);
+        node_t *nextl = next->lchild;
+        lock(&nextl->rw_lock, 1);
+        pnext = &next->lchild;
+        unlock(&next->rw_lock);
+        next = nextl;
+    }
+
+    // replace next's position on right subtree with its right child
+    *pnext = next->rchild;
+
+    // replace dnode with the contents of next by swapping the two, so that
+    // next takes dnode's old key and value with it; the running totals hold
+    // as they are
+    if (key_is_inline(dnode)) {
+        memcpy(dnode->key, next->key, key_inline);
+    } else {
+        char *key = dnode->key;
+        dnode->key = next->key;
+        next->key = key;
+    }
+    char *value = dnode->value;  // NULL if dnode was a tombstone
+    size_t value_cap = dnode->value_cap;
+    dnode->value = next->value;
+    dnode->value_cap = next->value_cap;
+    next->value = value;
+    next->value_cap = value_cap;
+    dnode->key_prefix = next->key_prefix;
+
+    unlock(&next->rw_lock);
+
+    node_destructor(next);
+}
+
+/* Removes key from the calling thread's tree or, with buried set, unlinks
+   key's tombstone for the compactor if key is still one. */
+int tree_remove(char *key, int buried) {
+    /*
+     * TODO:
+     * Part 2: Make this thread safe!
+     */
+    node_t *parent;  // parent of the node to delete
+    node_t *dnode;   // node to delete
+
+    // As in db_add(), the node is counted out on the way down.
+    size_lock(key, 1);
+    lock(&root->rw_lock, 1);
+    // first, find the node to be removed
+    dnode = search_prefixed(key, key_prefix(key), root, &parent, 1, -1);
+    if (dnode == NULL || (dnode->value == NULL) != buried) {
+        // it's not there, or it is live when it should be buried or vice
+        // versa
+        if (dnode != NULL) unlock(&dnode->rw_lock);
+        unlock(&parent->rw_lock);
+        path_release(1);
+        size_lock(key, 0);
+        if (!buried) bloom_false_positive();
+        return 0;
+    }
+    if (!buried) {
+        char buf[MAXLEN + 1];
+        if (vindex_enabled()) vindex_remove(node_value(dnode, buf), key);
+        log_change('d', key, NULL);
+    }
+
+    // We found it. If the target has no right child, then we can simply replace
+    // its parent's pointer to the target with the target's own left child.
+
+    if (dnode->rchild == NULL) {
+        if (key_compare(dnode->key, dnode->key_prefix, parent) < 0)
+            parent->lchild = dnode->lchild;
+        else
+            parent->rchild = dnode->lchild;
+        unlock(&dnode->rw_lock);
+        unlock(&parent->rw_lock);
+        // done with dnode
+        node_destructor(dnode);
+    } else if (dnode->lchild == NULL) {
+        // ditto if the target has no left child
+        if (key_compare(dnode->key, dnode->key_prefix, parent) < 0)
+            parent->lchild = dnode->rchild;
+        else
+            parent->rchild = dnode->rchild;
+        unlock(&dnode->rw_lock);
+        unlock(&parent->rw_lock);
+        // done with dnode
+        node_destructor(dnode);
+    } else {
+        // Find the lexicographically smallest node in the right subtree and
+        // replace the node to be deleted with that node. This new node thus is
+        // lexicographically smaller than all nodes in its right subtree, and
+        // greater than all nodes in its left subtree
+        unlock(&parent->rw_lock);
+
+        __atomic_sub_fetch(&dnode->size, 1, __ATOMIC_RELAXED);
+        take_successor(dnode);
+        unlock(&dnode->rw_lock);
+    }
+
+    path_release(0);
+    size_lock(key, 0);
+    if (buried) return 1;
+    bloom_remove(key);  // only once the key can no longer be found
+    cache_invalidate(key);
+    return 1;
+}
+
+/* db_remove() with tombstones: the node keeps its place in the tree with its
+   value freed, write-locked alone as for an update, until the compactor
+   unlinks it. */
+int tree_bury(char *key) {
+    size_lock(key, 1);
+    node_t *target = search_for_update(key);
+    if (target == NULL) {
+        size_lock(key, 0);
+        return 0;
+    }
+    char buf[MAXLEN + 1];
+    if (vindex_enabled()) vindex_remove(node_value(target, buf), key);
+    log_change('d', key, NULL);
+    __atomic_sub_fetch(&tree_value_bytes, strlen(target->value),
+                       __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&tree_value_cap, target->value_cap, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&tree_mem_bytes, target->value_cap, __ATOMIC_SEQ_CST);
+    value_drop(target);
+    target->value = NULL;
+    target->value_cap = 0;
+    unlock(&target->rw_lock);
+    size_lock(key, 0);
+
+    bloom_remove(key);
+    cache_invalidate(key);
+    bury_queue(key);
+    return 1;
+}
+
+int db_remove(char *key) {
+    if (routed()) return db_route('d', key, NULL, NULL, NULL, 0);
+    if (!bloom_may_contain(key)) return 0;
+    if (skiplist) {
+        if (!sl_remove(key, key_prefix(key))) {
+            bloom_false_positive();
+            return 0;
+        }
+        log_change('d', key, NULL);
+        bloom_remove(key);
+        return 1;
+    }
+    return tombstones ? tree_bury(key) : tree_remove(key, 0);
+}
+
+//------------------------------------------------------------------------------------------------
+// Compaction
+
+// A tombstone shipped to the worker owning its key
+typedef struct compact_call {
+    char *key;
+    int ret;
+} compact_call_t;
+
+void compact_call_run(void *arg) {
+    compact_call_t *c = arg;
+    c->ret = tree_remove(c->key, 1);
+}
+
+/* Unlinks key's tombstone, on its partition's worker if need be. */
+int compact_key(char *key) {
+    if (!routed()) return tree_remove(key, 1);
+    compact_call_t c = {key, 0};
+    part_run(part_of(key), compact_call_run, &c);
+    return c.ret;
+}
+
+/* Unlinks queued tombstones COMPACT_BATCH at a time, waiting for a batch to
+   gather or COMPACT_INTERVAL_MS to pass. A key that was added again since it
+   was queued is left alone. */
+void *compact(void *arg) {
+    (void)arg;
+    buried_t *batch;
+    pthread_mutex_lock(&buried_mutex);
+    while (!compact_stopping) {
+        if (buried_count < COMPACT_BATCH) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += COMPACT_INTERVAL_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&buried_cond, &buried_mutex, &deadline);
+            if (buried_count == 0 || compact_stopping) continue;
+        }
+        batch = buried_head;
+        buried_t *last = batch;
+        int n = 1;
+        while (n < COMPACT_BATCH && last->next != NULL) {
+            last = last->next;
+            n++;
+        }
+        buried_head = last->next;
+        if (buried_head == NULL) buried_tail = NULL;
+        last->next = NULL;
+        buried_count -= n;
+        pthread_mutex_unlock(&buried_mutex);
+
+        int done = 0;
+        while (batch != NULL) {
+            buried_t *next = batch->next;
+            done += compact_key(batch->key);
+            free(batch);
+            batch = next;
+        }
+
+        pthread_mutex_lock(&buried_mutex);
+        compacted += done;
+        compact_passes++;
+    }
+    pthread_mutex_unlock(&buried_mutex);
+    return NULL;
+}
+
+void db_tombstones(int on) {
+    int err;
+    if (on == tombstones) return;
+    if (on) {
+        tombstones = 1;
+        compact_stopping = 0;
+        if ((err = pthread_create(&compactor, 0, compact, NULL)))
+            handle_error_en(err, "pthread_create");
+        return;
+    }
+    pthread_mutex_lock(&buried_mutex);
+    compact_stopping = 1;
+    pthread_cond_signal(&buried_cond);
+    pthread_mutex_unlock(&buried_mutex);
+    if ((err = pthread_join(compactor, 0)))
+        handle_error_en(err, "pthread_join");
+    tombstones = 0;
+    // whatever is still buried goes with the tree
+    while (buried_head != NULL) {
+        buried_t *next = buried_head->next;
+        free(buried_head);
+        buried_head = next;
+    }
+    buried_tail = NULL;
+    buried_count = 0;
+}
+
+void db_compact_stats(char *buf, int len) {
+    pthread_mutex_lock(&buried_mutex);
+    snprintf(buf, len,
+             "compact tombstones=%s queued=%lu buried=%lu compacted=%lu "
+             "passes=%lu",
+             tombstones ? "on" : "off", buried_count, buried_total, compacted,
+             compact_passes);
+    pthread_mutex_unlock(&buried_mutex);
+}
+
+//------------------------------------------------------------------------------------------------
+// Printing methods and their helpers
+
+static inline void print_spaces(int lvl, FILE *out) {
+    for (int i = 0; i < lvl; i++) {
+        fprintf(out, " ");
+    }
+}
+
+/* helper function for db_print */
+void db_print_recurs(node_t *node, int lvl, FILE *out) {
+    /*
+     * TODO:
+     * Part 2: Make this thread safe!
+     */
+    char buf[DB_INT64_KEY_LEN + 1];
+    char value[MAXLEN + 1];
+    print_spaces(lvl, out);  // print spaces to differentiate levels
+    // print node's key/value, or (root) if it's the root
+    if (node == NULL) {
+        fprintf(out, "(null)\n");
+        return;
+    }
+
+    lock(&node->rw_lock, 0);
+
+    if (node == root)
+        fprintf(out, "(root)\n");
+    else if (node->value == NULL)
+        fprintf(out, "%s (tombstone)\n", node_key(node, buf));
+    else
+        fprintf(out, "%s %s\n", node_key(node, buf), node_value(node, value));
+
+    db_print_recurs(node->lchild, lvl + 1, out);
+    db_print_recurs(node->rchild, lvl + 1, out);
+    unlock(&node->rw_lock);
+}
+
+/* helper function for db_snapshot, same traversal as db_print_recurs */
+void db_snapshot_recurs(node_t *node, FILE *out) {
+    char buf[DB_INT64_KEY_LEN + 1];
+    char value[MAXLEN + 1];
+    if (node == NULL) {
+        return;
+    }
+
+    lock(&node->rw_lock, l_read);
+    if (node != root && node->value != NULL)
+        fprintf(out, "a %s %s\n", node_key(node, buf), node_value(node, value));
+    db_snapshot_recurs(node->lchild, out);
+    db_snapshot_recurs(node->rchild, out);
+    unlock(&node->rw_lock);
+}
+
+/* sl_walk() callbacks, printing a skip list as a root with every key below
+   it, in order */
+void print_entry(const char *key, const char *value, void *out) {
+    fprintf(out, " %s %s\n", key, value);
+}
+
+void snapshot_entry(const char *key, const char *value, void *out) {
+    fprintf(out, "a %s %s\n", key, value);
+}
+
+void snapshot_tree(void *out) {
+    if (skiplist)
+        sl_walk(snapshot_entry, out);
+    else
+        db_snapshot_recurs(root, out);
+}
+
+void db_snapshot(FILE *out) { for_each_tree(snapshot_tree, out); }
+
+/* Prints the calling thread's tree; a partitioned tree prints as one tree per
+   partition. */
+void print_tree(void *out) {
+    if (skiplist) {
+        fprintf(out, "(root)\n");
+        sl_walk(print_entry, out);
+        return;
+    }
+    db_print_recurs(root, 0, out);
+}
+
+int db_print(char *filename) {
+    FILE *out;
+    if (filename == NULL) {
+        for_each_tree(print_tree, stdout);
+        return 0;
+    }
+
+    // skip over leading whitespace
+    while (isspace(*filename)) {
+        filename++;
+    }
+
+    if (*filename == '\0') {
+        for_each_tree(print_tree, stdout);
+        return 0;
+    }
+
+    if ((out = fopen(filename, "w+")) == NULL) {
+        return -1;
+    }
+
+    for_each_tree(print_tree, out);
+    fclose(out);
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Tree statistics
+
+#define SHAPE_CHUNK 256  // nodes visited per pass before every lock is dropped
+#define SHAPE_BUCKETS 32
+
+// A node on the path being walked, read-locked
+typedef struct shape_frame {
+    node_t *node;
+    int depth;
+} shape_frame_t;
+
+// A node whose subtree heights are not known yet, see shape_visit()
+typedef struct shape_open {
+    int depth;
+    int lmax;  // deepest depth in its left subtree, or its own depth
+    int rmax;  // deepest depth in its right subtree so far
+} shape_open_t;
+
+typedef struct shape {
+    unsigned long nodes;
+    unsigned long depth_sum;
+    int height;
+    unsigned long hist[SHAPE_BUCKETS];  // nodes by floor(log2(depth))
+    int root_left;                      // heights of the root's subtrees
+    int root_right;
+    int max_imbalance;
+    unsigned long unbalanced;  // nodes whose subtree heights differ by > 1
+
+    shape_open_t *open;
+    int nopen;
+    int open_cap;
+    int failed;  // a walk ran out of memory
+} shape_t;
+
+/* Finishes an open node once its right subtree is complete. */
+void shape_close(shape_t *s, shape_open_t *o) {
+    int lh = o->lmax - o->depth;
+    int rh = o->rmax - o->depth;
+    int imbalance = lh > rh ? lh - rh : rh - lh;
+    if (imbalance > s->max_imbalance) s->max_imbalance = imbalance;
+    if (imbalance > 1) s->unbalanced++;
+    if (o->depth == 1) {
+        s->root_left = lh;
+        s->root_right = rh;
+    }
+}
+
+/*
+ * Takes the depth of the next node in key order. The depths of an in-order
+ * sequence determine the tree: a node's left subtree is the run of deeper
+ * nodes just before it and its right subtree the run just after it. Nodes
+ * stay open on a stack until a shallower (or, if the tree changed under the
+ * walk, equally deep) node shows that their right subtree has ended. Returns
+ * -1 if the stack cannot grow.
+ */
+int shape_visit(shape_t *s, int depth) {
+    int deepest = 0;  // deepest node closed so far, all inside one subtree
+    while (s->nopen > 0 && s->open[s->nopen - 1].depth >= depth) {
+        shape_open_t *o = &s->open[--s->nopen];
+        if (deepest > o->rmax) o->rmax = deepest;
+        shape_close(s, o);
+        if (o->lmax > deepest) deepest = o->lmax;
+        if (o->rmax > deepest) deepest = o->rmax;
+    }
+    if (depth == 0) return 0;  // the final flush
+
+    s->nodes++;
+    s->depth_sum += depth;
+    if (depth > s->height) s->height = depth;
+    int bucket = 0;
+    while (bucket < SHAPE_BUCKETS - 1 && (2 << bucket) <= depth) bucket++;
+    s->hist[bucket]++;
+
+    if (s->nopen == s->open_cap) {
+        int cap = s->open_cap ? 2 * s->open_cap : 64;
+        shape_open_t *open = realloc(s->open, cap * sizeof(shape_open_t));
+        if (open == NULL) return -1;
+        s->open = open;
+        s->open_cap = cap;
+    }
+    shape_open_t *o = &s->open[s->nopen++];
+    o->depth = depth;
+    o->lmax = deepest > depth ? deepest : depth;
+    o->rmax = depth;
+    return 0;
+}
+
+/* Pushes node, which the caller has read-locked, onto the walk's path. */
+int shape_push(shape_frame_t **path, int *npath, int *cap, node_t *node,
+               int depth) {
+    if (*npath == *cap) {
+        int newcap = *cap ? 2 * *cap : 64;
+        shape_frame_t *p = realloc(*path, newcap * sizeof(shape_frame_t));
+        if (p == NULL) return -1;
+        *path = p;
+        *cap = newcap;
+    }
+    (*path)[*npath].node = node;
+    (*path)[*npath].depth = depth;
+    (*npath)++;
+    return 0;
+}
+
+/* Pushes node and the chain of left children below it, locking each. */
+int shape_push_left(shape_frame_t **path, int *npath, int *cap, node_t *node,
+                    int depth) {
+    while (node != NULL) {
+        if (shape_push(path, npath, cap, node, depth++) < 0) {
+            unlock(&node->rw_lock);
+            return -1;
+        }
+        node_t *next = node->lchild;
+        if (next != NULL) lock(&next->rw_lock, l_read);
+        node = next;
+    }
+    return 0;
+}
+
+/*
+ * Visits every node in key order and feeds its depth to shape_visit(). The
+ * walk goes SHAPE_CHUNK nodes at a time, read-locking only the nodes on its
+ * path; between chunks it drops every lock and finds its place again by key,
+ * so writers are held up for one chunk at most. Nodes added or removed during
+ * the walk may or may not be counted. Returns -1 if it runs out of memory.
+ */
+int shape_walk(shape_t *s) {
+    char last[MAXLEN] = "";  // key of the last node visited
+    char buf[DB_INT64_KEY_LEN + 1];
+    int started = 0;
+    int more;  // whether the last chunk stopped short of the end
+    int ret = 0;
+    shape_frame_t *path = NULL;
+    int npath = 0;
+    int cap = 0;
+
+    do {
+        // Descend to the first key after last. Nodes we turn left at are
+        // still to be visited, so they stay locked on the path.
+        uint64_t lp = key_prefix(last);
+        node_t *node = root;
+        int depth = 0;
+        lock(&root->rw_lock, l_read);
+        while (node != NULL) {
+            int left = node != root &&
+                       (!started || key_compare(last, lp, node) < 0);
+            node_t *next = left ? node->lchild : node->rchild;
+            if (next != NULL) lock(&next->rw_lock, l_read);
+            if (!left) {
+                unlock(&node->rw_lock);
+            } else if (shape_push(&path, &npath, &cap, node, depth) < 0) {
+                unlock(&node->rw_lock);
+                if (next != NULL) unlock(&next->rw_lock);
+                ret = -1;
+                break;
+            }
+            node = next;
+            depth++;
+        }
+
+        for (int i = 0; ret == 0 && i < SHAPE_CHUNK && npath > 0; i++) {
+            shape_frame_t f = path[--npath];
+            if (shape_visit(s, f.depth) < 0) {
+                unlock(&f.node->rw_lock);
+                ret = -1;
+                break;
+            }
+            snprintf(last, MAXLEN, "%s", node_key(f.node, buf));
+            started = 1;
+
+            node_t *right = f.node->rchild;
+            if (right != NULL) lock(&right->rw_lock, l_read);
+            unlock(&f.node->rw_lock);
+            if (shape_push_left(&path, &npath, &cap, right, f.depth + 1) < 0)
+                ret = -1;
+        }
+
+        // drop the path and give writers a turn before the next chunk
+        more = npath > 0;
+        while (npath > 0) unlock(&path[--npath].node->rw_lock);
+        if (more) sched_yield();
+    } while (ret == 0 && more);
+
+    free(path);
+    if (ret == 0) ret = shape_visit(s, 0);
+    return ret;
+}
+
+/* shape_walk() for for_each_tree(). */
+void shape_walk_tree(void *arg) {
+    shape_t *s = arg;
+    if (!s->failed && shape_walk(s) < 0) s->failed = 1;
+}
+
+/* Walks every tree into s; the partitions of a partitioned tree are walked one
+   after another, as a forest. Returns -1 if it runs out of memory. */
+int shape_walk_all(shape_t *s) {
+    for_each_tree(shape_walk_tree, s);
+    free(s->open);
+    return s->failed ? -1 : 0;
+}
+
+void db_tree_stats(char *buf, int len) {
+    if (skiplist) {
+        sl_stats(buf, len);
+        return;
+    }
+    unsigned long nodes = __atomic_load_n(&tree_nodes, __ATOMIC_RELAXED);
+    int min_height = 0;
+    while (min_height < 64 && (1UL << min_height) - 1 < nodes) min_height++;
+    snprintf(buf, len, "tree nodes=%lu key_bytes=%lu value_bytes=%lu "
+             "min_height=%d",
+             nodes, __atomic_load_n(&tree_key_bytes, __ATOMIC_RELAXED),
+             __atomic_load_n(&tree_value_bytes, __ATOMIC_RELAXED), min_height);
+}
+
+void db_shape_stats(char *buf, int len) {
+    shape_t s;
+    if (skiplist) {
+        snprintf(buf, len, "not supported");
+        return;
+    }
+    memset(&s, 0, sizeof(s));
+    if (shape_walk_all(&s) < 0) {
+        snprintf(buf, len, "out of memory");
+        return;
+    }
+    snprintf(buf, len,
+             "shape nodes=%lu height=%d avg_depth=%.2f root_left=%d "
+             "root_right=%d max_imbalance=%d unbalanced=%lu",
+             s.nodes, s.height, s.nodes ? (double)s.depth_sum / s.nodes : 0.0,
+             s.root_left, s.root_right, s.max_imbalance, s.unbalanced);
+}
+
+void db_depth_stats(char *buf, int len) {
+    shape_t s;
+    if (skiplist) {
+        snprintf(buf, len, "not supported");
+        return;
+    }
+    memset(&s, 0, sizeof(s));
+    if (shape_walk_all(&s) < 0) {
+        snprintf(buf, len, "out of memory");
+        return;
+    }
+    int pos = snprintf(buf, len, "depths");
+    for (int b = 0; b < SHAPE_BUCKETS && pos < len; b++) {
+        if (s.hist[b] == 0) continue;
+        if (b == 0)
+            pos += snprintf(buf + pos, len - pos, " 1:%lu", s.hist[b]);
+        else
+            pos += snprintf(buf + pos, len - pos, " %lu-%lu:%lu", 1UL << b,
+                            (2UL << b) - 1, s.hist[b]);
+    }
+}
+
+/* Rewrites the key of a single-key command in its canonical form (see
+   db_key_normalize()), in place. Returns -1 if the key is not valid; a missing
+   key is left for the command to report. */
+int normalize_command_key(char *command) {
+    char key[MAXLEN];
+    if (key_type == KEY_STRING) return 0;
+    char *start = command + 1;
+    while (isspace(*start)) start++;
+    size_t n = 0;
+    while (start[n] != '\0' && !isspace(start[n])) n++;
+    if (n == 0) return 0;
+    if (n >= MAXLEN) return -1;
+
+    memcpy(key, start, n);
+    key[n] = '\0';
+    if (db_key_normalize(key) < 0) return -1;
+    size_t m = strlen(key);  // no longer than n
+    memcpy(start, key, m);
+    memmove(start + m, start + n, strlen(start + n) + 1);
+    return 0;
+}
+
+/* How many arguments a single-key command takes: its key, then its value or
+   its expected value and value. Returns 0 if op is not one. */
+static int key_command_args(char op) {
+    if (op == '\0' || strchr("qadwuc", op) == NULL) return 0;
+    return op == 'c' ? 3 : op == 'a' || op == 'u' || op == 'w' ? 2 : 1;
+}
+
+/* Splits a single-key command into its key, expected value and value, leaving
+   out what it does not take. Returns 0, or -1 if it is not well formed. */
+static int parse_key_command(char *command, char *name, char *expected,
+                             char *value) {
+    int args = key_command_args(command[0]);
+    int n = command[0] == 'c'
+                ? sscanf(&command[1], "%255s %255s %255s", name, expected, value)
+                : sscanf(&command[1], "%255s %255s", name, value);
+    return args > 0 && n >= args ? 0 : -1;
+}
+
+/* Runs the single-key command op, parsed, and writes its result into
+   response. */
+static void run_key_command(char op, char *name, char *expected, char *value,
+                            char *response, int len) {
+    if (op != 'q' && repl_is_replica()) {
+        snprintf(response, len, "read-only replica");
+        return;
+    }
+    switch (op) {
+        case 'q':
+            // Query
+            db_query(name, response, len);
+            if (strlen(response) == 0) {
+                snprintf(response, len, "not found");
+            }
+            return;
+
+        case 'a':
+            // Add to the database
+            switch (db_add(name, value)) {
+                case 1:
+                    snprintf(response, len, "added");
+                    break;
+                case DB_FULL:
+                    snprintf(response, len, "out of memory");
+                    break;
+                default:
+                    snprintf(response, len, "already in database");
+            }
+            return;
+
+        case 'd':
+            // Delete from the database
+            if (db_remove(name)) {
+                snprintf(response, len, "removed");
+            } else {
+                snprintf(response, len, "not in database");
+            }
+            return;
+
+        case 'u':
+            // Update the value of an existing key
+            switch (db_update(name, value)) {
+                case 1:
+                    snprintf(response, len, "updated");
+                    break;
+                case DB_FULL:
+                    snprintf(response, len, "out of memory");
+                    break;
+                default:
+                    snprintf(response, len, "not in database");
+            }
+            return;
+
+        case 'w':
+            // Write a key, adding it or updating it as needed
+            switch (db_upsert(name, value)) {
+                case 1:
+                    snprintf(response, len, "added");
+                    break;
+                case DB_FULL:
+                    snprintf(response, len, "out of memory");
+                    break;
+                default:
+                    snprintf(response, len, "updated");
+            }
+            return;
+
+        case 'c':
+            // Compare-and-swap: set a key only if it holds the expected value
+            switch (db_cas(name, expected, value)) {
+                case DB_CAS_SWAPPED:
+                    snprintf(response, len, "swapped");
+                    break;
+                case DB_CAS_MISMATCH:
+                    snprintf(response, len, "value mismatch");
+                    break;
+                case DB_FULL:
+                    snprintf(response, len, "out of memory");
+                    break;
+                default:
+                    snprintf(response, len, "not in database");
+            }
+            return;
+    }
+}
+
+/*
+ * Executes a single-key command (q, a, d, u, w or c). The caller holds the
+ * key's stripe lock.
+ */
+void execute_key_command(char *command, char *response, int len) {
+    char value[MAXLEN];
+    char expected[MAXLEN];
+    char name[MAXLEN];
+
+    if (parse_key_command(command, name, expected, value) < 0) {
+        snprintf(response, len, "ill-formed command");
+        return;
+    }
+    run_key_command(command[0], name, expected, value, response, len);
+}
+
+//------------------------------------------------------------------------------------------------
+// Transactions
+
+// A queued single-key command, parsed as it was queued
+typedef struct txn_op {
+    char op;
+    char key[MAXLEN];
+    char expected[MAXLEN];
+    char value[MAXLEN];
+} txn_op_t;
+
+struct db_txn {
+    int nops;
+    int cap;
+    txn_op_t *ops;  // in order
+};
+
+db_txn_t *txn_new(void) { return calloc(1, sizeof(db_txn_t)); }
+
+void db_txn_free(db_txn_t *txn) {
+    if (txn == NULL) return;
+    free(txn->ops);
+    free(txn);
+}
+
+/* Queues a single-key command. Returns 0 on success, -1 if the command is not
+   one a transaction can hold or lacks an argument, -2 if the transaction is
+   full and -3 if its key is not valid. */
+int txn_queue(db_txn_t *txn, char *command) {
+    txn_op_t op;
+    if (key_command_args(command[0]) == 0) return -1;
+    if (normalize_command_key(command) < 0) return -3;
+    if (parse_key_command(command, op.key, op.expected, op.value) < 0)
+        return -1;
+    if (txn->nops == DB_TXN_MAX_OPS) return -2;
+
+    if (txn->nops == txn->cap) {
+        int cap = txn->cap ? 2 * txn->cap : 8;
+        txn_op_t *ops = realloc(txn->ops, cap * sizeof(*ops));
+        if (ops == NULL) return -2;
+        txn->ops = ops;
+        txn->cap = cap;
+    }
+    op.op = command[0];
+    txn->ops[txn->nops++] = op;
+    return 0;
+}
+
+int compare_stripes(const void *a, const void *b) {
+    size_t x = *(const size_t *)a;
+    size_t y = *(const size_t *)b;
+    return (x > y) - (x < y);
+}
+
+// A key as a transaction's commands leave it, while the transaction is
+// checked before any of it is applied
+typedef struct txn_key {
+    const char *name;
+    int present;
+    char value[MAXLEN];
+} txn_key_t;
+
+/* Points the calling thread at the tree of key, when the transaction holds
+   the partitions. */
+static inline void txn_use_tree(const char *key, int partitioned) {
+    if (partitioned) db_use_tree(part_root(part_of(key)), 1);
+}
+
+/* Sets aside room under the memory limit for everything txn may add, before
+   anything is checked, so that evictions made for it happen first. Returns
+   the bytes reserved, or -1 if there was no room. */
+static long txn_reserve(db_txn_t *txn, int partitioned) {
+    long reserved = 0;
+    if (mem_limit == 0) return 0;
+    for (txn_op_t *op = txn->ops; op < txn->ops + txn->nops; op++) {
+        if (op->op == 'q' || op->op == 'd') continue;
+        size_t need = value_alloc(op->key, op->value);
+        if (op->op == 'a' || op->op == 'w')
+            need += sizeof(node_t) + key_alloc(op->key);
+        txn_use_tree(op->key, partitioned);
+        if (mem_reserve(op->key, need) < 0) {
+            mem_release(reserved);
+            return -1;
+        }
+        reserved += need;
+    }
+    return reserved;
+}
+
+/* Whether a command of txn from the i'th on uses key and can fail because of
+   the key's state, as all but q and w can. */
+static int txn_key_checked(db_txn_t *txn, int i, const char *key) {
+    for (; i < txn->nops; i++)
+        if (strchr("aduc", txn->ops[i].op) != NULL &&
+            strcmp(txn->ops[i].key, key) == 0)
+            return 1;
+    return 0;
+}
+
+/*
+ * Works out whether each of txn's commands will succeed, in order, from the
+ * keys as they are and as the commands before it leave them. Nothing changes:
+ * the caller holds the keys, so what is found here is what the commands will
+ * find. Only keys that a command which can fail uses are looked up, unless
+ * list is given; then every key is, and the results up to the first failure
+ * are listed in list. Returns the index of the first write that would fail,
+ * or -1 if all of them would succeed.
+ */
+static int txn_check(db_txn_t *txn, txn_key_t *keys, int partitioned,
+                     char *list, int len) {
+    int nkeys = 0;
+    int pos = 0;
+
+    for (int i = 0; i < txn->nops; i++) {
+        txn_op_t *op = &txn->ops[i];
+        txn_key_t *k = keys;
+        while (k < keys + nkeys && strcmp(k->name, op->key) != 0) k++;
+        if (k == keys + nkeys) {
+            nkeys++;
+            k->name = op->key;
+            k->present = -1;  // not looked up, as nothing needs it
+            if (list != NULL || txn_key_checked(txn, i, op->key)) {
+                txn_use_tree(op->key, partitioned);
+                db_query(op->key, k->value, MAXLEN);
+                // a value never holds a space, so this is no value
+                k->present = strcmp(k->value, "not found") != 0;
+            }
+        }
+
+        const char *result;
+        int ok = 1;
+        if (op->op != 'q' && repl_is_replica()) {
+            result = "read-only replica";
+            ok = 0;
+        } else if (op->op == 'q') {
+            result = k->present == 1 ? k->value : "not found";
+        } else if (op->op == 'a') {
+            result = k->present ? "already in database" : "added";
+            ok = !k->present;
+        } else if (op->op == 'w') {
+            result = k->present ? "updated" : "added";
+        } else if (!k->present) {
+            result = "not in database";  // d, u or c
+            ok = 0;
+        } else if (op->op == 'd') {
+            result = "removed";
+        } else if (op->op == 'u') {
+            result = "updated";
+        } else if (strcmp(k->value, op->expected) == 0) {
+            result = "swapped";
+        } else {
+            result = "value mismatch";
+            ok = 0;
+        }
+        if (list != NULL && pos < len)
+            pos += snprintf(list + pos, len - pos, "%s%s", i == 0 ? "" : "; ",
+                            result);
+        if (!ok) return i;
+
+        if (op->op == 'd') {
+            k->present = 0;
+        } else if (op->op != 'q') {
+            k->present = 1;
+            snprintf(k->value, MAXLEN, "%s", op->value);
+        }
+    }
+    return -1;
 }
 
-void db_cleanup() {
-    db_cleanup_recurs(head.lchild);
-    db_cleanup_recurs(head.rchild);
+/* Applies a checked transaction, out of the room txn_reserve() set aside for
+   it, and lists each command's result in list. */
+static void txn_apply(db_txn_t *txn, int partitioned, char *list, int len) {
+    char result[BUFLEN];
+    int pos = 0;
+
+    mem_prepaid = 1;
+    for (int i = 0; i < txn->nops; i++) {
+        txn_op_t *op = &txn->ops[i];
+        txn_use_tree(op->key, partitioned);
+        run_key_command(op->op, op->key, op->expected, op->value, result,
+                        sizeof(result));
+        if (pos < len)
+            pos += snprintf(list + pos, len - pos, "%s%s", i == 0 ? "" : "; ",
+                            result);
+    }
+    mem_prepaid = 0;
 }
 
-//------------------------------------------------------------------------------------------------
-// Database modifiers and accessors
+/*
+ * Applies every queued command while holding the stripes of all their keys
+ * exclusively, so other clients see either none or all of the transaction.
+ * Stripes are locked in ascending order, which keeps transactions from
+ * deadlocking with each other. A partitioned tree has no stripes; the
+ * transaction holds the partitions of its keys instead, in the same order, and
+ * applies the commands to their trees itself.
+ *
+ * Nothing is applied until the whole transaction is known to succeed: room is
+ * reserved for what it adds, and every command is checked against the keys
+ * as the ones before it leave them. If a write would fail, the response is
+ * `aborted: ` with the results up to that write, and nothing changes.
+ * Otherwise it is `committed: ` with each command's result.
+ */
+void txn_commit(db_txn_t *txn, char *response, int len) {
+    char list[BUFLEN];
+    size_t stripes[DB_TXN_MAX_OPS];
+    int nstripes = 0;
+    int partitioned = routed();
+    part_holds_t *holds = NULL;
+    txn_key_t *keys;
 
-node_t *search(char *key, node_t *parent, node_t **parentpp, enum locktype lt) {
-    /*
-     * TODO:
-     * Part 2: Make this thread safe!
-     */
-    int err;
-    node_t *next;
-    if (strcmp(key, parent->key) < 0) {
-        next = parent->lchild;
-    } else {
-        next = parent->rchild;
+    if (skiplist) {
+        // a skip list has no locks to hold the keys with
+        snprintf(response, len, "not supported");
+        return;
+    }
+    if (txn->nops == 0) {
+        snprintf(response, len, "committed");
+        return;
     }
+    if ((keys = malloc(txn->nops * sizeof(*keys))) == NULL) {
+        snprintf(response, len, "out of memory");
+        return;
+    }
+    for (int i = 0; i < txn->nops; i++)
+        stripes[nstripes++] = partitioned ? (size_t)part_of(txn->ops[i].key)
+                                          : key_stripe(txn->ops[i].key);
+    qsort(stripes, nstripes, sizeof(size_t), compare_stripes);
+    int unique = 0;
+    for (int i = 0; i < nstripes; i++)
+        if (unique == 0 || stripes[unique - 1] != stripes[i])
+            stripes[unique++] = stripes[i];
 
-    node_t *result;
-    if (next == NULL) {
-        result = NULL;
-    } else {
-        lock(&next->rw_lock, lt);
-        if (strcmp(key, next->key) == 0) {
-            result = next;
-        } else {
-            if ((err = pthread_rwlock_unlock(&parent->rw_lock)))
-                handle_error_en(err, "pthread_rwlock_unlock");
-            return search(key, next, parentpp, lt);
-        }
+    if (!partitioned) {
+        for (int i = 0; i < unique; i++)
+            stripe_lock(&key_stripes[stripes[i]], l_write);
+    } else if ((holds = part_hold(stripes, unique)) == NULL) {
+        free(keys);
+        snprintf(response, len, "out of memory");
+        return;
     }
 
-    if (parentpp != NULL) {
-        *parentpp = parent;
+    long reserved = txn_reserve(txn, partitioned);
+    if (reserved < 0) {
+        snprintf(response, len, "aborted: out of memory");
+    } else if (txn_check(txn, keys, partitioned, NULL, 0) >= 0) {
+        // failing is the slow path: look everything up to say why
+        txn_check(txn, keys, partitioned, list, sizeof(list));
+        snprintf(response, len, "aborted: %s", list);
+        mem_release(reserved);
     } else {
-        if ((err = pthread_rwlock_unlock(&parent->rw_lock)))
-            handle_error_en(err, "pthread_rwlock_unlock");
-        //        return result;
+        txn_apply(txn, partitioned, list, sizeof(list));
+        snprintf(response, len, "committed: %s", list);
+        mem_release(reserved);
     }
-    return result;
-}
 
-void db_query(char *key, char *result, int len) {
-    /*
-     * TODO:
-     * Part 2: Make this thread safe!
-     */
-    lock(&head.rw_lock, l_read);
-    node_t *target = search(key, &head, NULL, 0);
-    if (target == NULL) {
-        snprintf(result, len, "not found");
+    if (partitioned) {
+        db_use_tree(&head, 0);
+        part_release(holds);
     } else {
-        snprintf(result, len, "%s", target->value);
-        int err;
-        if ((err = pthread_rwlock_unlock(&target->rw_lock)))
-            handle_error_en(err, "pthread_rwlock_unlock");
+        for (int i = unique - 1; i >= 0; i--)
+            stripe_unlock(&key_stripes[stripes[i]]);
     }
+    free(keys);
 }
 
-int db_add(char *key, char *value) {
-    /*
-     * TODO:
-     * Part 2: Make this thread safe!
-     */
-    int err;
-    node_t *parent;
-    node_t *target;
-    lock(&head.rw_lock, 1);
-    if ((target = search(key, &head, &parent, 1)) != NULL) {
-        if ((err = pthread_rwlock_unlock(&target->rw_lock)))
-            handle_error_en(err, "pthread_rwlock_unlock");
-        if ((err = pthread_rwlock_unlock(&parent->rw_lock)))
-            handle_error_en(err, "pthread_rwlock_unlock");
-        return 0;
+void interpret_txn_command(db_txn_t **txn, char *command, char *response,
+                           int len) {
+    if (*txn == NULL) {
+        // only B gets here without an open transaction
+        if ((*txn = txn_new()) == NULL)
+            snprintf(response, len, "out of memory");
+        else
+            snprintf(response, len, "transaction started");
+        return;
     }
 
-    node_t *newnode = node_constructor(key, value, NULL, NULL);
+    switch (command[0]) {
+        case 'C':
+            txn_commit(*txn, response, len);
+            db_txn_free(*txn);
+            *txn = NULL;
+            return;
 
-    if (strcmp(key, parent->key) < 0)
-        parent->lchild = newnode;
-    else
-        parent->rchild = newnode;
+        case 'A':
+            db_txn_free(*txn);
+            *txn = NULL;
+            snprintf(response, len, "transaction aborted");
+            return;
 
-    if ((err = pthread_rwlock_unlock(&parent->rw_lock)))
-        handle_error_en(err, "pthread_rwlock_unlock");
+        case 'B':
+            snprintf(response, len, "transaction already open");
+            return;
 
-    return 1;
+        default:
+            switch (txn_queue(*txn, command)) {
+                case 0:
+                    snprintf(response, len, "queued");
+                    break;
+                case -2:
+                    snprintf(response, len, "transaction too large");
+                    break;
+                case -3:
+                    snprintf(response, len, "invalid key");
+                    break;
+                default:
+                    snprintf(response, len, "ill-formed command");
+            }
+            return;
+    }
 }
 
-int db_remove(char *key) {
-    /*
-     * TODO:
-     * Part 2: Make this thread safe!
-     */
-    int err;
-    node_t *parent;  // parent of the node to delete
-    node_t *dnode;   // node to delete
+/* Runs `t cmd; cmd; ...` as one transaction. */
+void interpret_txn_line(char *line, char *response, int len) {
+    char buf[BUFLEN];
+    char *save;
+    db_txn_t *txn;
 
-    lock(&head.rw_lock, 1);
-    // first, find the node to be removed
-    if ((dnode = search(key, &head, &parent, 1)) == NULL) {
-        // it's not there
-        if ((err = pthread_rwlock_unlock(&parent->rw_lock)))
-            handle_error_en(err, "pthread_rwlock_unlock");
-        return 0;
+    if ((txn = txn_new()) == NULL) {
+        snprintf(response, len, "out of memory");
+        return;
+    }
+    snprintf(buf, sizeof(buf), "%s", line);
+    for (char *op = strtok_r(buf, ";\n", &save); op != NULL;
+         op = strtok_r(NULL, ";\n", &save)) {
+        while (isspace(*op)) op++;
+        if (*op == '\0') continue;
+        int ret;
+        if ((ret = txn_queue(txn, op)) < 0) {
+            snprintf(response, len, ret == -3 ? "invalid key"
+                                              : "ill-formed command");
+            db_txn_free(txn);
+            return;
+        }
     }
+    txn_commit(txn, response, len);
+    db_txn_free(txn);
+}
 
-    // We found it. If the target has no right child, then we can simply replace
-    // its parent's pointer to the target with the target's own left child.
+//------------------------------------------------------------------------------------------------
+// Batches
 
-    if (dnode->rchild == NULL) {
-        if (strcmp(dnode->key, parent->key) < 0)
-            parent->lchild = dnode->lchild;
-        else
-            parent->rchild = dnode->lchild;
-        if ((err = pthread_rwlock_unlock(&dnode->rw_lock)))
-            handle_error_en(err, "pthread_rwlock_unlock");
-        if ((err = pthread_rwlock_unlock(&parent->rw_lock)))
-            handle_error_en(err, "pthread_rwlock_unlock");
-        // done with dnode
-        node_destructor(dnode);
-    } else if (dnode->lchild == NULL) {
-        // ditto if the target has no left child
-        if (strcmp(dnode->key, parent->key) < 0)
-            parent->lchild = dnode->rchild;
-        else
-            parent->rchild = dnode->rchild;
-        if ((err = pthread_rwlock_unlock(&dnode->rw_lock)))
-            handle_error_en(err, "pthread_rwlock_unlock");
-        if ((err = pthread_rwlock_unlock(&parent->rw_lock)))
-            handle_error_en(err, "pthread_rwlock_unlock");
-        // done with dnode
-        node_destructor(dnode);
-    } else {
-        // Find the lexicographically smallest node in the right subtree and
-        // replace the node to be deleted with that node. This new node thus is
-        // lexicographically smaller than all nodes in its right subtree, and
-        // greater than all nodes in its left subtree
-        if ((err = pthread_rwlock_unlock(&parent->rw_lock)))
-            handle_error_en(err, "pthread_rwlock_unlock");
+// One key of a batch (see db_add_batch())
+typedef struct batch_op {
+    char *key;
+    uint64_t kp;
+    char *value;  // to add
+    int index;    // its place in the batch
+    int present;  // found in the tree by batch_find()
+    int retry;    // not applied after all, so its size changes are taken back
+    int result;
+} batch_op_t;
 
-        node_t *next = dnode->rchild;
-        lock(&next->rw_lock, 1);
-        node_t **pnext = &dnode->rchild;
+int compare_ops(const void *a, const void *b) {
+    const batch_op_t *x = *(batch_op_t *const *)a;
+    const batch_op_t *y = *(batch_op_t *const *)b;
+    int cmp = compare_keys(x->key, x->kp, y->key, y->kp);
+    if (cmp != 0) return cmp;
+    return (x->index > y->index) - (x->index < y->index);
+}
 
-        while (next->lchild != NULL) {
-            // work our way down the lchild chain, finding the smallest node
-            // in the subtree.
-            node_t *nextl = next->lchild;
-            lock(&nextl->rw_lock, 1);
-            pnext = &next->lchild;
-            if ((err = pthread_rwlock_unlock(&next->rw_lock)))
-                handle_error_en(err, "pthread_rwlock_unlock");
-            next = nextl;
-        }
+/* Returns how many of ops[0..n), sorted, have keys below node's. */
+int ops_below(node_t *node, batch_op_t **ops, int n) {
+    int lo = 0;
+    int hi = n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (key_compare(ops[mid]->key, ops[mid]->kp, node) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Whether ops[i] exists and holds node's key. The root holds no key. */
+static inline int op_at(node_t *node, batch_op_t **ops, int i, int n) {
+    return node != root && i < n &&
+           key_compare(ops[i]->key, ops[i]->kp, node) == 0;
+}
 
-        // replace next's position on right subtree with its right child
-        *pnext = next->rchild;
+/*
+ * Marks the ops of ops[0..n), sorted, whose keys are in the subtree at node,
+ * descending once for all of them. node is read-locked. Before node is let
+ * go, the children that keys go on to are locked, so the walk holds the path
+ * it is on and the unvisited right-hand subtrees beside it. node is unlocked
+ * on return.
+ */
+void batch_find(node_t *node, batch_op_t **ops, int n) {
+    while (1) {
+        int lo = ops_below(node, ops, n);
+        int hi = lo;
+        if (op_at(node, ops, hi, n)) ops[hi++]->present = 1;
+        node_t *left = lo > 0 ? node->lchild : NULL;
+        node_t *right = hi < n ? node->rchild : NULL;
+        if (left != NULL) lock(&left->rw_lock, l_read);
+        if (right != NULL) lock(&right->rw_lock, l_read);
+        unlock(&node->rw_lock);
 
-        // replace dnode with the contents of next
-        dnode->key = realloc(dnode->key, strlen(next->key) + 1);
-        dnode->value = realloc(dnode->value, strlen(next->value) + 1);
+        if (left != NULL) batch_find(left, ops, lo);
+        if (right == NULL) return;
+        node = right;
+        ops += hi;
+        n -= hi;
+    }
+}
 
-        snprintf(dnode->key, MAXLEN, "%s", next->key);
-        snprintf(dnode->value, MAXLEN, "%s", next->value);
+/* Links nodes[0..n), sorted, into a balanced subtree and returns its root. */
+node_t *batch_link(node_t **nodes, int n) {
+    if (n == 0) return NULL;
+    int mid = n / 2;
+    node_t *node = nodes[mid];
+    node->lchild = batch_link(nodes, mid);
+    node->rchild = batch_link(nodes + mid + 1, n - mid - 1);
+    node->size = n;
+    return node;
+}
 
-        if ((err = pthread_rwlock_unlock(&next->rw_lock)))
-            handle_error_en(err, "pthread_rwlock_unlock");
+/* Makes a balanced subtree of new nodes for ops[0..n), sorted, and returns its
+   root, for the caller to put in an empty spot below the node it holds
+   write-locked. A key that cannot be made into a node is left for retry. */
+node_t *batch_build(batch_op_t **ops, int n) {
+    node_t *nodes[DB_BATCH_MAX];
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        batch_op_t *op = ops[i];
+        if ((nodes[m] = node_constructor(op->key, op->value, NULL, NULL)) ==
+            NULL) {
+            op->retry = 1;
+            continue;
+        }
+        bloom_add(op->key);  // before the key can be found
+        vindex_add(op->value, op->key);
+        log_change('a', op->key, op->value);
+        op->result = 1;
+        m++;
+    }
+    return batch_link(nodes, m);
+}
 
-        node_destructor(next);
+/*
+ * Adds the keys of ops[0..n), sorted and all missing from the tree, below
+ * node, which is write-locked and whose size counts them already. As in
+ * batch_find(), every node on the way is locked once for all the keys below
+ * it. Keys that meet at the same empty spot go there as one balanced subtree.
+ * node is unlocked on return.
+ */
+void batch_add(node_t *node, batch_op_t **ops, int n) {
+    while (1) {
+        int lo = ops_below(node, ops, n);
+        int hi = lo;
+        if (op_at(node, ops, hi, n)) {
+            // added since it was looked for, which the size stripe prevents
+            __atomic_sub_fetch(&node->size, 1, __ATOMIC_RELAXED);
+            ops[hi++]->retry = 1;
+        }
+        node_t *left = NULL;
+        node_t *right = NULL;
+        if (lo > 0 && node->lchild == NULL) {
+            node->lchild = batch_build(ops, lo);
+        } else if (lo > 0) {
+            left = node->lchild;
+            lock(&left->rw_lock, l_write);
+            __atomic_add_fetch(&left->size, lo, __ATOMIC_RELAXED);
+        }
+        if (hi < n && node->rchild == NULL) {
+            node->rchild = batch_build(ops + hi, n - hi);
+        } else if (hi < n) {
+            right = node->rchild;
+            lock(&right->rw_lock, l_write);
+            __atomic_add_fetch(&right->size, n - hi, __ATOMIC_RELAXED);
+        }
+        unlock(&node->rw_lock);
 
-        if ((err = pthread_rwlock_unlock(&dnode->rw_lock)))
-            handle_error_en(err, "pthread_rwlock_unlock");
+        if (left != NULL) batch_add(left, ops, lo);
+        if (right == NULL) return;
+        node = right;
+        ops += hi;
+        n -= hi;
     }
+}
 
-    return 1;
+/*
+ * Removes nodes from the top of the subtree at *link for as long as the node
+ * there holds the key of one of ops[0..n), sorted. The caller holds the node
+ * *link is in and the node at *link write-locked, and that node's size leaves
+ * out all of ops already. The ops removed are moved to the front of ops and
+ * their number returned; the node left on top, still write-locked, goes into
+ * *top, or NULL if the subtree ran out.
+ */
+int batch_settle(node_t **link, batch_op_t **ops, int n, node_t **top) {
+    node_t *node = *link;
+    int taken = 0;
+    while (1) {
+        int lo = ops_below(node, ops + taken, n - taken);
+        if (!op_at(node, ops + taken, lo, n - taken)) break;
+        batch_op_t *op = ops[taken + lo];
+        memmove(&ops[taken + 1], &ops[taken], lo * sizeof(*ops));
+        ops[taken++] = op;
+        char buf[MAXLEN + 1];
+        if (vindex_enabled()) vindex_remove(node_value(node, buf), op->key);
+        log_change('d', op->key, NULL);
+        op->result = 1;
+
+        if (node->lchild != NULL && node->rchild != NULL) {
+            take_successor(node);
+            continue;
+        }
+        node_t *child = node->lchild != NULL ? node->lchild : node->rchild;
+        *link = child;
+        unlock(&node->rw_lock);
+        node_destructor(node);
+        if ((node = child) == NULL) break;
+        lock(&node->rw_lock, l_write);
+        __atomic_sub_fetch(&node->size, n - taken, __ATOMIC_RELAXED);
+    }
+    *top = node;
+    return taken;
 }
 
-//------------------------------------------------------------------------------------------------
-// Printing methods and their helpers
+/*
+ * Removes the keys of ops[0..n), sorted and all found in the tree, from below
+ * node, which is write-locked, holds none of them and whose size leaves them
+ * out already. Each child is cleared of the keys at its top while node is
+ * still held, since unlinking a node needs its parent; the walk then goes on
+ * below as batch_add() does. Keys that are not there after all are left for
+ * retry. node is unlocked on return.
+ */
+void batch_remove(node_t *node, batch_op_t **ops, int n) {
+    while (1) {
+        int lo = ops_below(node, ops, n);
+        batch_op_t **rops = ops + lo;
+        int rn = n - lo;
+        node_t *left = NULL;
+        node_t *right = NULL;
+        if (lo > 0 && (left = node->lchild) != NULL) {
+            lock(&left->rw_lock, l_write);
+            __atomic_sub_fetch(&left->size, lo, __ATOMIC_RELAXED);
+            int taken = batch_settle(&node->lchild, ops, lo, &left);
+            ops += taken;
+            lo -= taken;
+        }
+        if (rn > 0 && (right = node->rchild) != NULL) {
+            lock(&right->rw_lock, l_write);
+            __atomic_sub_fetch(&right->size, rn, __ATOMIC_RELAXED);
+            int taken = batch_settle(&node->rchild, rops, rn, &right);
+            rops += taken;
+            rn -= taken;
+        }
+        if (left == NULL)
+            for (int i = 0; i < lo; i++) ops[i]->retry = 1;
+        if (right == NULL)
+            for (int i = 0; i < rn; i++) rops[i]->retry = 1;
+        unlock(&node->rw_lock);
 
-static inline void print_spaces(int lvl, FILE *out) {
-    for (int i = 0; i < lvl; i++) {
-        fprintf(out, " ");
+        if (left != NULL) batch_remove(left, ops, lo);
+        if (right == NULL) return;
+        node = right;
+        ops = rops;
+        n = rn;
     }
 }
 
-/* helper function for db_print */
-void db_print_recurs(node_t *node, int lvl, FILE *out) {
-    /*
-     * TODO:
-     * Part 2: Make this thread safe!
-     */
-    int err;
-    print_spaces(lvl, out);  // print spaces to differentiate levels
-    // print node's key/value, or (root) if it's the root
-    if (node == NULL) {
-        fprintf(out, "(null)\n");
-        return;
+/* db_add_batch() (op 'a') or db_remove_batch() (op 'd') on the calling
+   thread's tree. */
+int batch_apply(char op, char **keys, char **values, int n, int *results) {
+    batch_op_t ops[DB_BATCH_MAX];
+    batch_op_t *sorted[DB_BATCH_MAX];
+    batch_op_t *work[DB_BATCH_MAX];
+    size_t stripes[DB_BATCH_MAX];
+    size_t reserved = 0;
+    int done = 0;
+
+    if (n > DB_BATCH_MAX) n = DB_BATCH_MAX;
+    for (int i = 0; i < n; i++) {
+        ops[i] = (batch_op_t){keys[i], key_prefix(keys[i]),
+                              values != NULL ? values[i] : NULL, i, 0, 0, 0};
+        sorted[i] = &ops[i];
+    }
+    // Room for the new nodes comes first, since eviction takes size stripes
+    for (int i = 0; op == 'a' && i < n; i++) {
+        size_t need = sizeof(node_t) + key_alloc(keys[i]) +
+                      value_alloc(keys[i], values[i]);
+        if (mem_reserve(keys[i], need) < 0)
+            ops[i].result = DB_FULL;
+        else
+            reserved += need;
     }
 
-    lock(&node->rw_lock, 0);
+    // Sorted, with only the first of any repeated key applied: the others
+    // find it added or removed already
+    qsort(sorted, n, sizeof(batch_op_t *), compare_ops);
+    int unique = 0;
+    for (int i = 0; i < n; i++)
+        if (unique == 0 || compare_keys(sorted[unique - 1]->key,
+                                        sorted[unique - 1]->kp, sorted[i]->key,
+                                        sorted[i]->kp) != 0)
+            sorted[unique++] = sorted[i];
 
-    if (node == &head)
-        fprintf(out, "(root)\n");
-    else
-        fprintf(out, "%s %s\n", node->key, node->value);
+    // As in db_add() and db_remove(), the size stripes keep the keys found or
+    // missing until the sizes have been changed for them
+    int nstripes = 0;
+    for (int i = 0; i < unique; i++)
+        stripes[nstripes++] = key_stripe(sorted[i]->key);
+    qsort(stripes, nstripes, sizeof(size_t), compare_stripes);
+    int locked = 0;
+    for (int i = 0; i < nstripes; i++)
+        if (locked == 0 || stripes[locked - 1] != stripes[i])
+            stripes[locked++] = stripes[i];
+    for (int i = 0; i < locked; i++) size_lock_stripe(stripes[i], 1);
 
-    db_print_recurs(node->lchild, lvl + 1, out);
-    db_print_recurs(node->rchild, lvl + 1, out);
-    if ((err = pthread_rwlock_unlock(&node->rw_lock)))
-        handle_error_en(err, "pthread_rwlock_unlock");
-}
+    lock(&root->rw_lock, l_read);
+    batch_find(root, sorted, unique);
+    int nwork = 0;
+    for (int i = 0; i < unique; i++)
+        if (op == 'a' ? !sorted[i]->present && sorted[i]->result != DB_FULL
+                      : sorted[i]->present)
+            work[nwork++] = sorted[i];
 
-int db_print(char *filename) {
-    FILE *out;
-    if (filename == NULL) {
-        db_print_recurs(&head, 0, stdout);
-        return 0;
+    if (nwork > 0) {
+        lock(&root->rw_lock, l_write);
+        if (op == 'a') {
+            __atomic_add_fetch(&root->size, nwork, __ATOMIC_RELAXED);
+            batch_add(root, work, nwork);
+        } else {
+            __atomic_sub_fetch(&root->size, nwork, __ATOMIC_RELAXED);
+            batch_remove(root, work, nwork);
+        }
     }
+    for (int i = 0; i < nwork; i++)
+        if (work[i]->retry) adjust_path(work[i]->key, op == 'a' ? -1 : 1);
+    for (int i = locked - 1; i >= 0; i--) size_lock_stripe(stripes[i], 0);
 
-    // skip over leading whitespace
-    while (isspace(*filename)) {
-        filename++;
+    for (int i = 0; i < nwork; i++) {
+        if (work[i]->result != 1) continue;
+        if (op == 'd') bloom_remove(work[i]->key);
+        cache_invalidate(work[i]->key);
+    }
+    mem_release(reserved);
+    for (int i = 0; i < n; i++) {
+        results[i] = ops[i].result;
+        if (ops[i].result == 1) done++;
     }
+    return done;
+}
 
-    if (*filename == '\0') {
-        db_print_recurs(&head, 0, stdout);
-        return 0;
+// A batch shipped to the worker owning its keys
+typedef struct batch_call {
+    char op;
+    char **keys;
+    char **values;
+    int n;
+    int *results;
+    int done;
+} batch_call_t;
+
+void batch_call_run(void *arg) {
+    batch_call_t *c = arg;
+    c->done = batch_apply(c->op, c->keys, c->values, c->n, c->results);
+}
+
+/* Runs a batch on the calling thread's tree, or splits it up among the
+   partitions owning its keys, one partition after the other. */
+int db_batch(char op, char **keys, char **values, int n, int *results) {
+    char *pkeys[DB_BATCH_MAX];
+    char *pvalues[DB_BATCH_MAX];
+    int presults[DB_BATCH_MAX];
+    int parts[DB_BATCH_MAX];
+    int where[DB_BATCH_MAX];
+    int done = 0;
+
+    if (n > DB_BATCH_MAX) n = DB_BATCH_MAX;
+    if (skiplist || tombstones) {
+        // no tree to share a pass over, or tombstones to leave behind, so
+        // one key at a time
+        for (int i = 0; i < n; i++) {
+            results[i] = op == 'a' ? db_add(keys[i], values[i])
+                                   : db_remove(keys[i]);
+            if (results[i] == 1) done++;
+        }
+        return done;
     }
+    if (!routed()) return batch_apply(op, keys, values, n, results);
+    for (int i = 0; i < n; i++) parts[i] = part_of(keys[i]);
+    for (int p = 0; p < part_count; p++) {
+        int m = 0;
+        for (int i = 0; i < n; i++) {
+            if (parts[i] != p) continue;
+            pkeys[m] = keys[i];
+            pvalues[m] = values != NULL ? values[i] : NULL;
+            where[m++] = i;
+        }
+        if (m == 0) continue;
+        batch_call_t c = {op, pkeys, values != NULL ? pvalues : NULL, m,
+                          presults, 0};
+        part_run(p, batch_call_run, &c);
+        for (int i = 0; i < m; i++) results[where[i]] = presults[i];
+        done += c.done;
+    }
+    return done;
+}
 
-    if ((out = fopen(filename, "w+")) == NULL) {
-        return -1;
+int db_add_batch(char **keys, char **values, int n, int *results) {
+    return db_batch('a', keys, values, n, results);
+}
+
+int db_remove_batch(char **keys, int n, int *results) {
+    return db_batch('d', keys, NULL, n, results);
+}
+
+/*
+ * Runs `m a key value [key value ...]` or `m d key [key ...]`. Like a
+ * single-key command, the batch holds its keys' stripes shared, taken in
+ * ascending order as a transaction takes them. The response counts the keys
+ * added or removed and then gives each key's outcome in order: + done,
+ * - already there (a) or not found (d), ! out of memory.
+ */
+void interpret_batch(char *line, char *response, int len) {
+    char buf[BUFLEN];
+    char *keys[DB_BATCH_MAX];
+    char *values[DB_BATCH_MAX];
+    int results[DB_BATCH_MAX];
+    size_t stripes[DB_BATCH_MAX];
+    char *save;
+    int n = 0;
+
+    if (repl_is_replica()) {
+        snprintf(response, len, "read-only replica");
+        return;
+    }
+    snprintf(buf, sizeof(buf), "%s", line);
+    char *op = strtok_r(buf, " \t\n", &save);
+    if (op == NULL || (strcmp(op, "a") != 0 && strcmp(op, "d") != 0)) {
+        snprintf(response, len, "ill-formed command");
+        return;
+    }
+    int add = op[0] == 'a';
+    char *key;
+    while ((key = strtok_r(NULL, " \t\n", &save)) != NULL) {
+        if (n == DB_BATCH_MAX) {
+            snprintf(response, len, "batch too large");
+            return;
+        }
+        if (db_key_normalize(key) < 0) {
+            snprintf(response, len, "invalid key");
+            return;
+        }
+        keys[n] = key;
+        if (add && (values[n] = strtok_r(NULL, " \t\n", &save)) == NULL) {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+        n++;
     }
+    if (n == 0) {
+        snprintf(response, len, "ill-formed command");
+        return;
+    }
+    for (int i = 0; i < n; i++) hot_record(keys[i]);
 
-    db_print_recurs(&head, 0, out);
-    fclose(out);
+    int locked = 0;
+    if (part_count == 0 && !skiplist) {
+        // transactions on a partitioned tree hold whole partitions instead,
+        // and a skip list has none
+        for (int i = 0; i < n; i++) stripes[i] = key_stripe(keys[i]);
+        qsort(stripes, n, sizeof(size_t), compare_stripes);
+        for (int i = 0; i < n; i++)
+            if (locked == 0 || stripes[locked - 1] != stripes[i])
+                stripes[locked++] = stripes[i];
+        for (int i = 0; i < locked; i++)
+            stripe_lock(&key_stripes[stripes[i]], l_read);
+    }
+    int done = add ? db_add_batch(keys, values, n, results)
+                   : db_remove_batch(keys, n, results);
+    for (int i = locked - 1; i >= 0; i--)
+        stripe_unlock(&key_stripes[stripes[i]]);
 
-    return 0;
+    int pos = snprintf(response, len, "%d of %d %s: ", done, n,
+                       add ? "added" : "removed");
+    for (int i = 0; i < n && pos < len - 1; i++)
+        response[pos++] = results[i] == 1         ? '+'
+                          : results[i] == DB_FULL ? '!'
+                                                  : '-';
+    if (pos < len) response[pos] = '\0';
 }
 
 //------------------------------------------------------------------------------------------------
@@ -347,9 +2870,9 @@ int db_print(char *filename) {
  * where len is the buffer size.
  */
 void interpret_command(char *command, char *response, int len) {
-    char value[MAXLEN];
     char ibuf[MAXLEN];
     char name[MAXLEN];
+    char value[MAXLEN];
     int sscanf_ret;
 
     if (strlen(command) <= 1) {
@@ -360,46 +2883,87 @@ void interpret_command(char *command, char *response, int len) {
     // which command is it?
     switch (command[0]) {
         case 'q':
-            // Query
+        case 'a':
+        case 'd':
+        case 'u':
+        case 'w':
+        case 'c':
+            // Single-key commands hold their key's stripe shared, so that
+            // they never see a transaction half applied
             sscanf_ret = sscanf(&command[1], "%255s", name);
             if (sscanf_ret < 1) {
                 snprintf(response, len, "ill-formed command");
                 return;
             }
-            db_query(name, response, len);
-            if (strlen(response) == 0) {
-                snprintf(response, len, "not found");
-            }
-            return;
-
-        case 'a':
-            // Add to the database
-            sscanf_ret = sscanf(&command[1], "%255s %255s", name, value);
-            if (sscanf_ret < 2) {
-                snprintf(response, len, "ill-formed command");
+            if (normalize_command_key(command) < 0) {
+                snprintf(response, len, "invalid key");
                 return;
             }
-            if (db_add(name, value)) {
-                snprintf(response, len, "added");
-            } else {
-                snprintf(response, len, "already in database");
+            sscanf(&command[1], "%255s", name);
+            hot_record(name);
+            if (part_count > 0 || skiplist) {
+                // transactions hold whole partitions instead, or there are
+                // none on a skip list
+                execute_key_command(command, response, len);
+                return;
             }
+            pthread_rwlock_t *stripe = &key_stripes[key_stripe(name)];
+            stripe_lock(stripe, l_read);
+            execute_key_command(command, response, len);
+            stripe_unlock(stripe);
             return;
 
-        case 'd':
-            // Delete from the database
-            sscanf_ret = sscanf(&command[1], "%255s", name);
+        case 'v':
+            // Keys holding a value, optionally from the offset'th on
+            sscanf_ret = sscanf(&command[1], "%255s %255s", value, name);
             if (sscanf_ret < 1) {
                 snprintf(response, len, "ill-formed command");
                 return;
             }
-            if (db_remove(name)) {
-                snprintf(response, len, "removed");
+            vindex_lookup(value, sscanf_ret == 2 ? strtoul(name, 0, 10) : 0,
+                          response, len);
+            return;
+
+        case 'h':
+            // The hottest keys, optionally only the first n
+            sscanf_ret = sscanf(&command[1], "%255s", name);
+            hot_report(sscanf_ret == 1 ? atoi(name) : 0, response, len);
+            return;
+
+        case 'o':
+            // Order statistics: o count <lo> <hi>, o rank <key>, o select <k>
+            sscanf_ret = sscanf(&command[1], "%255s %255s %255s", ibuf, name,
+                                value);
+            if (skiplist || tombstones) {
+                // a skip list keeps no subtree sizes to count with, and
+                // tombstones are counted in them
+                snprintf(response, len, "not supported");
+            } else if (strcmp(ibuf, "select") != 0 &&
+                ((sscanf_ret >= 2 && db_key_normalize(name) < 0) ||
+                 (sscanf_ret == 3 && db_key_normalize(value) < 0))) {
+                snprintf(response, len, "invalid key");
+            } else if (sscanf_ret == 3 && strcmp(ibuf, "count") == 0) {
+                snprintf(response, len, "count %zu", db_count(name, value));
+            } else if (sscanf_ret == 2 && strcmp(ibuf, "rank") == 0) {
+                snprintf(response, len, "rank %zu", db_rank(name));
+            } else if (sscanf_ret == 2 && strcmp(ibuf, "select") == 0) {
+                if (db_select(strtoul(name, 0, 10), response, len) < 0)
+                    snprintf(response, len, "out of range");
             } else {
-                snprintf(response, len, "not in database");
+                snprintf(response, len, "ill-formed command");
             }
             return;
 
+        case 'm':
+            // Several keys added or removed in one pass over the tree
+            interpret_batch(&command[1], response, len);
+            return;
+
+        case 't':
+            // Several commands applied as one transaction
+            interpret_txn_line(&command[1], response, len);
+            return;
+
         case 'f':
             // process the commands in a file (silently)
             sscanf_ret = sscanf(&command[1], "%255s", name);
@@ -421,6 +2985,42 @@ void interpret_command(char *command, char *response, int len) {
             snprintf(response, len, "file processed");
             return;
 
+        case 'i':
+            // Report statistics for one subsystem
+            sscanf_ret = sscanf(&command[1], "%255s", name);
+            if (sscanf_ret < 1) {
+                snprintf(response, len, "ill-formed command");
+                return;
+            }
+            if (strcmp(name, "cache") == 0) {
+                cache_stats(response, len);
+            } else if (strcmp(name, "repl") == 0) {
+                repl_stats(response, len);
+            } else if (strcmp(name, "bloom") == 0) {
+                bloom_stats(response, len);
+            } else if (strcmp(name, "tree") == 0) {
+                db_tree_stats(response, len);
+            } else if (strcmp(name, "shape") == 0) {
+                db_shape_stats(response, len);
+            } else if (strcmp(name, "depths") == 0) {
+                db_depth_stats(response, len);
+            } else if (strcmp(name, "parts") == 0) {
+                part_stats(response, len);
+            } else if (strcmp(name, "vindex") == 0) {
+                vindex_stats(response, len);
+            } else if (strcmp(name, "mem") == 0) {
+                db_mem_stats(response, len);
+            } else if (strcmp(name, "hot") == 0) {
+                hot_stats(response, len);
+            } else if (strcmp(name, "watch") == 0) {
+                watch_stats(response, len);
+            } else if (strcmp(name, "compact") == 0) {
+                db_compact_stats(response, len);
+            } else {
+                snprintf(response, len, "ill-formed command");
+            }
+            return;
+
         default:
             snprintf(response, len, "ill-formed command");
             return;
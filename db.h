@@ -2,17 +2,93 @@
 #define DB_H_
 
 #include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "./nodelock.h"
+
+#define KEY_PREFIX_LEN 8  // leading key bytes kept inline in node_t
 
 typedef struct node {
     char *key;
+    uint64_t key_prefix;  // first KEY_PREFIX_LEN bytes of key, big-endian
     char *value;
+    size_t value_cap;  // bytes allocated for value, reused by updates
     struct node *lchild;
     struct node *rchild;
-    pthread_rwlock_t rw_lock;
+    size_t size;  // nodes in this subtree, for the root all nodes in the tree
+    uint32_t atime;  // last use, in milliseconds, for eviction (db_mem_limit)
+    uint32_t pins;   // writers that may still take back a change to size
+    nodelock_t rw_lock;  // see nodelock.h
 } node_t;
 
 extern node_t head;
 
+enum keytype { KEY_STRING, KEY_INT64, KEY_BINARY };
+
+#define DB_INT64_KEY_LEN 20  // characters in the longest int64, with its sign
+
+/**
+ * db_key_type() sets the type of every key in the database, and must be
+ * called before any key is added. KEY_STRING keys (the default) order as
+ * strcmp orders them. KEY_INT64 keys are decimal integers that order by value
+ * and are compared as one integer. KEY_BINARY keys are exactly len bytes,
+ * compared as memcmp would. Keys of either fixed size type are stored in the
+ * node's own allocation. Returns -1 if len does not fit a key.
+ */
+int db_key_type(enum keytype type, size_t len);
+
+/**
+ * db_key_normalize() checks that key is a key of the database's type and
+ * rewrites it in place in its canonical form, which for an int64 key is plain
+ * decimal. Every key must be normalized before it reaches the db_*()
+ * functions, since keys are also hashed as strings (for the bloom filter,
+ * cache and partitions). Returns 0, or -1 if key is not valid.
+ */
+int db_key_normalize(char *key);
+
+enum backend { DB_TREE, DB_SKIPLIST };
+
+/**
+ * db_backend() picks what holds the keys, and must be called before any key
+ * is added. DB_TREE (the default) is the lock-coupled tree; DB_SKIPLIST is a
+ * lock-free skip list (see skiplist.h), on which no command ever waits for a
+ * lock. The skip list serves the single-key commands, batches, printing,
+ * snapshots and clearing, and bypasses the read cache; order statistics,
+ * transactions, the memory limit and the tree's shape statistics need the
+ * tree, as do partitions and the value index.
+ */
+void db_backend(enum backend backend);
+
+/**
+ * db_tombstones() turns deferred deletion on (on set) or off. With it on,
+ * db_remove() only frees the value of the key's node and leaves the node in
+ * the tree as a tombstone, taking the write lock of that node alone, and a
+ * compactor thread unlinks tombstones in the background, in batches. Adding
+ * the key again before then brings its node back. Order statistics answer
+ * nothing while it is on, since tombstones count in the subtree sizes, and
+ * it does not go with the memory limit. Turning it off stops the compactor;
+ * it must be done before the partitions are cleaned up.
+ */
+void db_tombstones(int on);
+
+/**
+ * db_compress() turns value compression on (on set) or off, and must be
+ * called before any key is added. With it on, a value is stored as the
+ * length of what it shares with the start of its key and the rest of it, so
+ * that values derived from their keys cost only their suffix; a value that
+ * belongs to a string key is stored in the key's allocation. Values are
+ * rebuilt as they are read, straight into the caller's buffer. Memory
+ * statistics and the memory limit count values as stored. Needs the tree.
+ */
+void db_compress(int on);
+
+/**
+ * db_compact_stats() writes whether tombstones are on, how many wait to be
+ * unlinked and how many were made, unlinked and in how many passes into buf.
+ */
+void db_compact_stats(char *buf, int len);
+
 enum locktype { l_read = 0, l_write = 1 };
 
 /**
@@ -31,7 +107,8 @@ node_t *search(char *key, node_t *parent, node_t **parentp, enum locktype lt);
  * The db_query() function calls search() to retrieve the node associated with
  * the given key. If such a node is found, the function retrieves the value
  * stored in that node, and returns it in the given result buffer of the given
- * size. Otherwise, result is filled with "not found".
+ * size. Otherwise, result is filled with "not found". Keys found in the read
+ * cache (see cache.h) are answered without touching the tree.
  */
 void db_query(char *key, char *result, int len);
 
@@ -39,11 +116,42 @@ void db_query(char *key, char *result, int len);
  * db_add() uses search() to determine if the given key is already in the
  * database. If the key is not in the database, the function creates a new node
  * with the given key and value and inserts this node into the database as a
- * child of the parent node returned by search(). Returns 1 on success and 0 on
- * failure.
+ * child of the parent node returned by search(). Returns 1 on success, 0 on
+ * failure and DB_FULL if the memory limit leaves no room for the node, or it
+ * cannot be allocated.
  */
 int db_add(char *key, char *value);
 
+/**
+ * The db_update() function replaces the value of an existing key in place.
+ * It descends with read locks and write-locks only the target node, reusing
+ * the value buffer when the new value fits. Returns 1 on success, 0 if the
+ * key is not in the database and DB_FULL as db_add() does, for the value.
+ */
+int db_update(char *key, char *value);
+
+/**
+ * The db_upsert() function sets key to value whether or not it is present. An
+ * existing key is updated as in db_update(); a missing one is inserted as in
+ * db_add(). Returns 1 if the key was added, 0 if it was updated and DB_FULL
+ * as db_add() does.
+ */
+int db_upsert(char *key, char *value);
+
+#define DB_CAS_SWAPPED 1
+#define DB_CAS_MISMATCH 0
+#define DB_CAS_MISSING -1
+
+#define DB_FULL -2  // a write refused under the memory limit, or out of memory
+
+/**
+ * The db_cas() function sets key to value only if its current value equals
+ * expected, with the comparison and the write done under one write lock as in
+ * db_update(). Returns DB_CAS_SWAPPED, DB_CAS_MISMATCH, DB_CAS_MISSING or
+ * DB_FULL.
+ */
+int db_cas(char *key, char *expected, char *value);
+
 /**
  * The db_remove() function calls search() to retrieve the node associated with
  * the given key. If such a node is found, the function must delete it while
@@ -62,6 +170,38 @@ int db_add(char *key, char *value);
  */
 int db_remove(char *key);
 
+#define DB_BATCH_MAX 128  // keys in one batch, more than a command line holds
+
+/**
+ * db_add_batch() adds keys[i] with values[i], and db_remove_batch() removes
+ * keys[i], for each of n (at most DB_BATCH_MAX) keys, in one pass over the
+ * tree. The keys are sorted, and every node on the way is locked once for all
+ * the keys below it; new keys that meet at an empty spot go there as one
+ * balanced subtree. results[i] is set to what db_add() or db_remove() would
+ * have returned for keys[i] had the keys been applied one by one, in order.
+ * Returns the number of keys added or removed.
+ */
+int db_add_batch(char **keys, char **values, int n, int *results);
+int db_remove_batch(char **keys, int n, int *results);
+
+#define DB_TXN_MAX_OPS 1024
+
+typedef struct db_txn db_txn_t;
+
+/**
+ * The interpret_txn_command() function handles a command on a connection that
+ * is building a transaction: `B` opens it (*txn must be NULL), single-key
+ * commands are queued, `C` applies them atomically and `A` discards them.
+ * *txn is updated as the transaction is opened and closed.
+ */
+void interpret_txn_command(db_txn_t **txn, char *command, char *response,
+                           int len);
+
+/**
+ * The db_txn_free() function discards an open transaction.
+ */
+void db_txn_free(db_txn_t *txn);
+
 /**
  * The interpret_command() function gets called by the server to interpret a
  * command from a client, call database functions, and store the response.
@@ -77,6 +217,82 @@ void interpret_command(char *command, char *response, int resp_capacity);
  */
 int db_print(char *filename);
 
+/**
+ * The db_snapshot() function writes every key in the tree to out as an
+ * `a key value` command, in pre-order so that replaying the output rebuilds
+ * the same shape. It holds read locks only on the path it is visiting, so
+ * concurrent writers may or may not be reflected.
+ */
+void db_snapshot(FILE *out);
+
+/**
+ * The db_tree_stats() function writes the node count and key and value byte
+ * totals into buf. They are kept up to date by every change to the tree, so
+ * this is constant time.
+ */
+void db_tree_stats(char *buf, int len);
+
+/**
+ * db_mem_limit() caps the bytes the tree allocates for its nodes (lock
+ * included), keys and values at limit, or lifts the cap for 0. Writes that
+ * need memory reserve it up front, so the cap is never exceeded. Without
+ * evict, a write that does not fit fails with DB_FULL. With evict it first
+ * removes keys that have not been used for a while: each round samples
+ * DB_EVICT_SAMPLES random keys and removes the one used least recently, in
+ * the manner of an approximate LRU. Must be called before any client thread
+ * starts.
+ */
+#define DB_EVICT_SAMPLES 5
+void db_mem_limit(size_t limit, int evict);
+
+/**
+ * db_mem_stats() writes the bytes in use, broken down into node structures,
+ * node locks (naming the lock type), keys and values, with the limit and the
+ * number of evictions and refused writes into buf.
+ */
+void db_mem_stats(char *buf, int len);
+
+/**
+ * The db_shape_stats() function walks the tree and writes its height, average
+ * node depth, the heights of the root's two subtrees, the largest difference
+ * between the subtree heights of any node and the number of nodes where it
+ * exceeds one. db_depth_stats() writes the number of nodes at each depth,
+ * grouped by powers of two. The walk never holds more than one root-to-node
+ * path of read locks and drops them every few hundred nodes, so results are
+ * approximate while the tree is being written.
+ */
+void db_shape_stats(char *buf, int len);
+void db_depth_stats(char *buf, int len);
+
+/**
+ * The order-statistic functions work from the subtree sizes kept in every
+ * node. db_count() returns the number of keys from lo to hi inclusive,
+ * db_rank() the number of keys smaller than key, and db_select() writes the
+ * k'th smallest key (counting from 0) and its value into result, returning 0,
+ * or returns -1 if there are no more than k keys. Each is one descent from
+ * the root (a few per partition on a partitioned tree), read-locking one path
+ * hand over hand.
+ */
+size_t db_count(char *lo, char *hi);
+size_t db_rank(char *key);
+int db_select(size_t k, char *result, int len);
+
+/**
+ * The db_clear() function empties the tree while other threads may still be
+ * using it. Unlike db_cleanup(), it waits for every thread inside the tree to
+ * leave a node before freeing it.
+ */
+void db_clear(void);
+
+/**
+ * The db_root_init() function initializes tree as an empty tree's root, like
+ * head. db_use_tree() makes the calling thread's database calls work on tree,
+ * head by default; if private is set, the caller has tree to itself and no
+ * locks are taken on it. Both are used by partitioning (see part.h).
+ */
+void db_root_init(node_t *tree);
+void db_use_tree(node_t *tree, int private);
+
 /**
  * The db_cleanup() function frees all dynamically-allocated nodes in the
  * database. This function should be used in server.c to clean up the database
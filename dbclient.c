@@ -0,0 +1,578 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./dbclient.h"
+#include "./ring.h"
+
+#define DBC_MAX_POLL 64  // connections handled by one dbc_poll_many() wait
+#define DBC_RING_POLL_MS 100  // how often a ring waiter checks the socket
+
+typedef struct dbc_request {
+    dbc_callback_t cb;
+    void *arg;
+} dbc_request_t;
+
+enum conn_state { c_connecting, c_ready, c_failed };
+
+struct dbc_conn {
+    int fd;
+    enum conn_state state;
+    struct addrinfo *addrs;  // everything getaddrinfo returned, or NULL
+    struct addrinfo *addr;   // the address currently being tried
+
+    // the address of a Unix socket, which getaddrinfo cannot produce
+    struct addrinfo unix_ai;
+    struct sockaddr_un unix_addr;
+
+    // bytes of queued commands not yet written to the socket
+    char *out;
+    size_t out_off;
+    size_t out_len;
+    size_t out_cap;
+
+    // bytes read from the socket that do not form a full line yet
+    char in[4 * DBC_LINE];
+    size_t in_len;
+
+    // outstanding commands in the order they were sent, as a ring
+    dbc_request_t *reqs;
+    size_t req_head;
+    size_t req_count;
+    size_t req_cap;
+
+    // where unsolicited lines go once the connection is a subscription
+    dbc_callback_t watch_cb;
+    void *watch_arg;
+};
+
+struct dbc_future {
+    int done;
+    int freed;  // dbc_future_free() was called before completion
+    int status;
+    dbc_conn_t *conn;
+    char response[DBC_LINE];
+};
+
+struct dbc_ring {
+    int sock;
+    ring_pair_t *rings;
+    int pending;
+};
+
+struct dbc_pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    char *host;
+    char *port;
+    int size;
+    dbc_conn_t **conns;
+    int *busy;
+};
+
+//------------------------------------------------------------------------------------------------
+// Connection setup and failure
+
+/* Tries the remaining addresses until a connect succeeds or is in progress. */
+static int start_connect(dbc_conn_t *c) {
+    for (; c->addr != NULL; c->addr = c->addr->ai_next) {
+        int fd = socket(c->addr->ai_family, c->addr->ai_socktype,
+                        c->addr->ai_protocol);
+        if (fd < 0) continue;
+        if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+            close(fd);
+            continue;
+        }
+        if (connect(fd, c->addr->ai_addr, c->addr->ai_addrlen) == 0) {
+            c->fd = fd;
+            c->state = c_ready;
+            return 0;
+        }
+        if (errno == EINPROGRESS) {
+            c->fd = fd;
+            c->state = c_connecting;
+            return 0;
+        }
+        close(fd);
+    }
+    return -1;
+}
+
+/* Marks the connection failed and completes every outstanding command. */
+static void fail(dbc_conn_t *c) {
+    if (c->fd >= 0) close(c->fd);
+    c->fd = -1;
+    c->state = c_failed;
+    c->out_off = c->out_len = 0;
+    while (c->req_count > 0) {
+        dbc_request_t r = c->reqs[c->req_head];
+        c->req_head = (c->req_head + 1) % c->req_cap;
+        c->req_count--;
+        r.cb(r.arg, DBC_ECLOSED, NULL);
+    }
+    if (c->watch_cb != NULL) {
+        dbc_callback_t cb = c->watch_cb;
+        c->watch_cb = NULL;
+        cb(c->watch_arg, DBC_ECLOSED, NULL);
+    }
+}
+
+dbc_conn_t *dbc_connect(const char *host, const char *port) {
+    struct addrinfo hints;
+    dbc_conn_t *c;
+    int err;
+
+    if ((c = calloc(1, sizeof(dbc_conn_t))) == NULL) return NULL;
+    c->fd = -1;
+
+    if (strchr(host, '/') != NULL) {
+        // a Unix socket path; the port is not used
+        if (strlen(host) >= sizeof(c->unix_addr.sun_path)) {
+            free(c);
+            return NULL;
+        }
+        c->unix_addr.sun_family = AF_UNIX;
+        strcpy(c->unix_addr.sun_path, host);
+        c->unix_ai.ai_family = AF_UNIX;
+        c->unix_ai.ai_socktype = SOCK_STREAM;
+        c->unix_ai.ai_addr = (struct sockaddr *)&c->unix_addr;
+        c->unix_ai.ai_addrlen = sizeof(c->unix_addr);
+        c->addr = &c->unix_ai;
+        if (start_connect(c) < 0) {
+            free(c);
+            return NULL;
+        }
+        return c;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((err = getaddrinfo(host, port, &hints, &c->addrs)) != 0) {
+        fprintf(stderr, "Error in getaddrinfo: %s\n", gai_strerror(err));
+        free(c);
+        return NULL;
+    }
+    c->addr = c->addrs;
+    if (start_connect(c) < 0) {
+        freeaddrinfo(c->addrs);
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+void dbc_close(dbc_conn_t *conn) {
+    fail(conn);
+    if (conn->addrs != NULL) freeaddrinfo(conn->addrs);
+    free(conn->out);
+    free(conn->reqs);
+    free(conn);
+}
+
+int dbc_fd(dbc_conn_t *conn) { return conn->fd; }
+
+int dbc_pending(dbc_conn_t *conn) { return (int)conn->req_count; }
+
+//------------------------------------------------------------------------------------------------
+// Sending and receiving
+
+int dbc_send(dbc_conn_t *conn, const char *command, dbc_callback_t cb,
+             void *arg) {
+    size_t len = strlen(command);
+    if (len >= DBC_LINE - 1 || strchr(command, '\n') != NULL ||
+        conn->watch_cb != NULL)
+        return DBC_EINVAL;
+    if (conn->state == c_failed) return DBC_ECLOSED;
+
+    if (conn->req_count == conn->req_cap) {
+        // grow the ring, unrolling it so that it starts at index 0
+        size_t cap = conn->req_cap ? 2 * conn->req_cap : 16;
+        dbc_request_t *reqs = malloc(cap * sizeof(dbc_request_t));
+        if (reqs == NULL) return DBC_ECLOSED;
+        for (size_t i = 0; i < conn->req_count; i++)
+            reqs[i] = conn->reqs[(conn->req_head + i) % conn->req_cap];
+        free(conn->reqs);
+        conn->reqs = reqs;
+        conn->req_head = 0;
+        conn->req_cap = cap;
+    }
+
+    if (conn->out_len + len + 1 > conn->out_cap) {
+        // compact before growing
+        memmove(conn->out, conn->out + conn->out_off,
+                conn->out_len - conn->out_off);
+        conn->out_len -= conn->out_off;
+        conn->out_off = 0;
+        if (conn->out_len + len + 1 > conn->out_cap) {
+            size_t cap = 2 * (conn->out_len + len + 1);
+            char *out = realloc(conn->out, cap);
+            if (out == NULL) return DBC_ECLOSED;
+            conn->out = out;
+            conn->out_cap = cap;
+        }
+    }
+
+    memcpy(conn->out + conn->out_len, command, len);
+    conn->out[conn->out_len + len] = '\n';
+    conn->out_len += len + 1;
+
+    conn->reqs[(conn->req_head + conn->req_count) % conn->req_cap] =
+        (dbc_request_t){cb, arg};
+    conn->req_count++;
+    return 0;
+}
+
+/* Writes as much queued output as the socket takes. Returns -1 on error. */
+static int flush(dbc_conn_t *c) {
+    while (c->out_off < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+                         MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        c->out_off += n;
+    }
+    c->out_off = c->out_len = 0;
+    return 0;
+}
+
+/* Reads what is available and completes every full response line. Returns
+   the number completed, or -1 once the connection is closed or broken. */
+static int receive(dbc_conn_t *c) {
+    int completed = 0;
+    while (1) {
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len,
+                         0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return completed;
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) return -1;
+        c->in_len += n;
+
+        char *line = c->in;
+        char *nl;
+        while ((nl = memchr(line, '\n', c->in + c->in_len - line)) != NULL) {
+            *nl = '\0';
+            if (c->req_count > 0) {
+                dbc_request_t r = c->reqs[c->req_head];
+                c->req_head = (c->req_head + 1) % c->req_cap;
+                c->req_count--;
+                r.cb(r.arg, DBC_OK, line);
+                completed++;
+            } else if (c->watch_cb != NULL) {
+                c->watch_cb(c->watch_arg, DBC_OK, line);
+                completed++;
+            }
+            line = nl + 1;
+        }
+        c->in_len -= line - c->in;
+        memmove(c->in, line, c->in_len);
+        // a full buffer without a newline is not a response we understand
+        if (c->in_len == sizeof(c->in)) return -1;
+    }
+}
+
+static short wanted_events(dbc_conn_t *c) {
+    if (c->state == c_connecting) return POLLOUT;
+    short events = 0;
+    if (c->out_off < c->out_len) events |= POLLOUT;
+    if (c->req_count > 0 || c->watch_cb != NULL) events |= POLLIN;
+    return events;
+}
+
+/* Advances one connection after poll reported revents on it. */
+static int progress(dbc_conn_t *c, short revents) {
+    if (c->state == c_failed) return DBC_ECLOSED;
+
+    if (c->state == c_connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (!(revents & (POLLOUT | POLLERR | POLLHUP))) return 0;
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+            err != 0) {
+            // try the next address, if any
+            close(c->fd);
+            c->fd = -1;
+            c->addr = c->addr->ai_next;
+            if (start_connect(c) < 0) {
+                fail(c);
+                return DBC_ECLOSED;
+            }
+            return 0;
+        }
+        c->state = c_ready;
+    }
+
+    if (flush(c) < 0) {
+        fail(c);
+        return DBC_ECLOSED;
+    }
+    if (!(revents & (POLLIN | POLLERR | POLLHUP))) return 0;
+
+    int completed = receive(c);
+    if (completed < 0) {
+        fail(c);
+        return DBC_ECLOSED;
+    }
+    return completed;
+}
+
+int dbc_poll_many(dbc_conn_t **conns, int n, int timeout_ms) {
+    struct pollfd fds[DBC_MAX_POLL];
+    int completed = 0;
+    int waiting = 0;
+
+    if (n > DBC_MAX_POLL) n = DBC_MAX_POLL;
+    for (int i = 0; i < n; i++) {
+        fds[i].fd = conns[i]->state == c_failed ? -1 : conns[i]->fd;
+        fds[i].events = wanted_events(conns[i]);
+        fds[i].revents = 0;
+        if (fds[i].events) waiting = 1;
+    }
+    // with nothing to send or wait for, blocking would never end
+    if (!waiting) return 0;
+
+    if (poll(fds, n, timeout_ms) < 0 && errno != EINTR) return 0;
+    for (int i = 0; i < n; i++) {
+        int ret = progress(conns[i], fds[i].revents);
+        if (ret > 0) completed += ret;
+    }
+    return completed;
+}
+
+int dbc_poll(dbc_conn_t *conn, int timeout_ms) {
+    if (conn->state == c_failed) return DBC_ECLOSED;
+    int completed = dbc_poll_many(&conn, 1, timeout_ms);
+    if (conn->state == c_failed) return DBC_ECLOSED;
+    return completed;
+}
+
+int dbc_watch(dbc_conn_t *conn, const char *patterns, dbc_callback_t cb,
+              void *arg) {
+    char command[DBC_LINE];
+    if (snprintf(command, sizeof(command), "W %s", patterns) >=
+        (int)sizeof(command))
+        return DBC_EINVAL;
+    int err = dbc_send(conn, command, cb, arg);
+    if (err == 0) {
+        conn->watch_cb = cb;
+        conn->watch_arg = arg;
+    }
+    return err;
+}
+
+//------------------------------------------------------------------------------------------------
+// Futures and the synchronous wrapper
+
+static void complete_future(void *arg, int status, const char *response) {
+    dbc_future_t *f = arg;
+    if (f->freed) {
+        free(f);
+        return;
+    }
+    f->done = 1;
+    f->status = status;
+    if (status == DBC_OK)
+        snprintf(f->response, sizeof(f->response), "%s", response);
+}
+
+dbc_future_t *dbc_send_future(dbc_conn_t *conn, const char *command) {
+    dbc_future_t *f = calloc(1, sizeof(dbc_future_t));
+    if (f == NULL) return NULL;
+    f->conn = conn;
+    if (dbc_send(conn, command, complete_future, f) < 0) {
+        free(f);
+        return NULL;
+    }
+    return f;
+}
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+int dbc_future_wait(dbc_future_t *future, char *response, size_t len,
+                    int timeout_ms) {
+    long deadline = now_ms() + timeout_ms;
+    while (!future->done) {
+        int wait = -1;
+        if (timeout_ms >= 0) {
+            long left = deadline - now_ms();
+            if (left <= 0) return DBC_ETIMEOUT;
+            wait = (int)left;
+        }
+        // a failure completes the future, so the loop ends either way
+        dbc_poll(future->conn, wait);
+    }
+    if (future->status == DBC_OK && response != NULL)
+        snprintf(response, len, "%s", future->response);
+    return future->status;
+}
+
+void dbc_future_free(dbc_future_t *future) {
+    if (future->done)
+        free(future);
+    else
+        future->freed = 1;
+}
+
+int dbc_request(dbc_conn_t *conn, const char *command, char *response,
+                size_t len) {
+    dbc_future_t f;
+    int ret;
+    memset(&f, 0, sizeof(f));
+    f.conn = conn;
+    if ((ret = dbc_send(conn, command, complete_future, &f)) < 0) return ret;
+    return dbc_future_wait(&f, response, len, -1);
+}
+
+//------------------------------------------------------------------------------------------------
+// Connection pool
+
+dbc_pool_t *dbc_pool_create(const char *host, const char *port, int size) {
+    dbc_pool_t *pool = calloc(1, sizeof(dbc_pool_t));
+    if (pool == NULL) return NULL;
+    pthread_mutex_init(&pool->mutex, 0);
+    pthread_cond_init(&pool->cond, 0);
+    pool->size = size;
+    pool->host = strdup(host);
+    pool->port = strdup(port);
+    pool->conns = calloc(size, sizeof(dbc_conn_t *));
+    pool->busy = calloc(size, sizeof(int));
+    if (pool->host == NULL || pool->port == NULL || pool->conns == NULL ||
+        pool->busy == NULL) {
+        dbc_pool_destroy(pool);
+        return NULL;
+    }
+    for (int i = 0; i < size; i++) {
+        if ((pool->conns[i] = dbc_connect(host, port)) == NULL) {
+            dbc_pool_destroy(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+dbc_conn_t *dbc_pool_acquire(dbc_pool_t *pool) {
+    int i;
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+        for (i = 0; i < pool->size; i++)
+            if (!pool->busy[i]) break;
+        if (i < pool->size) break;
+        pthread_cond_wait(&pool->cond, &pool->mutex);
+    }
+    pool->busy[i] = 1;
+    pthread_mutex_unlock(&pool->mutex);
+
+    // replace a connection that broke while it sat in the pool
+    if (pool->conns[i]->state == c_failed) {
+        dbc_conn_t *fresh = dbc_connect(pool->host, pool->port);
+        if (fresh != NULL) {
+            dbc_close(pool->conns[i]);
+            pool->conns[i] = fresh;
+        }
+    }
+    return pool->conns[i];
+}
+
+void dbc_pool_release(dbc_pool_t *pool, dbc_conn_t *conn) {
+    while (dbc_pending(conn) > 0 && dbc_poll(conn, -1) >= 0) continue;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (int i = 0; i < pool->size; i++) {
+        if (pool->conns[i] == conn) {
+            pool->busy[i] = 0;
+            pthread_cond_signal(&pool->cond);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void dbc_pool_destroy(dbc_pool_t *pool) {
+    for (int i = 0; pool->conns != NULL && i < pool->size; i++)
+        if (pool->conns[i] != NULL) dbc_close(pool->conns[i]);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->conns);
+    free(pool->busy);
+    free(pool->host);
+    free(pool->port);
+    free(pool);
+}
+
+//------------------------------------------------------------------------------------------------
+// Shared-memory rings
+
+dbc_ring_t *dbc_ring_connect(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) return NULL;
+    strcpy(addr.sun_path, path);
+
+    dbc_ring_t *r;
+    if ((r = calloc(1, sizeof(dbc_ring_t))) == NULL) return NULL;
+    if ((r->sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        free(r);
+        return NULL;
+    }
+    int fd = -1;
+    if (connect(r->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        send(r->sock, "M\n", 2, MSG_NOSIGNAL) != 2 ||
+        (fd = ring_recv_fd(r->sock)) < 0 ||
+        (r->rings = ring_map(fd)) == NULL) {
+        if (fd >= 0) close(fd);
+        close(r->sock);
+        free(r);
+        return NULL;
+    }
+    close(fd);
+    return r;
+}
+
+void dbc_ring_close(dbc_ring_t *ring) {
+    ring_unmap(ring->rings);
+    close(ring->sock);
+    free(ring);
+}
+
+int dbc_ring_pending(dbc_ring_t *ring) { return ring->pending; }
+
+int dbc_ring_send(dbc_ring_t *ring, const char *command) {
+    if (strlen(command) >= DBC_LINE || strchr(command, '\n') != NULL ||
+        ring->pending == RING_SLOTS)
+        return DBC_EINVAL;
+    while (ring_push(&ring->rings->req, command, DBC_RING_POLL_MS) !=
+           RING_OK)
+        if (ring_peer_gone(ring->sock)) return DBC_ECLOSED;
+    ring->pending++;
+    return DBC_OK;
+}
+
+int dbc_ring_recv(dbc_ring_t *ring, char *response, size_t len) {
+    if (ring->pending == 0) return DBC_EINVAL;
+    while (ring_pop(&ring->rings->resp, response, len, DBC_RING_POLL_MS) !=
+           RING_OK)
+        if (ring_peer_gone(ring->sock)) return DBC_ECLOSED;
+    ring->pending--;
+    return DBC_OK;
+}
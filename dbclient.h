@@ -0,0 +1,197 @@
+#ifndef DBCLIENT_H_
+#define DBCLIENT_H_
+
+#include <stddef.h>
+
+/*
+ * libdbclient: a client library for the database server.
+ *
+ * A connection is non-blocking and pipelined: any number of commands may be
+ * queued with dbc_send() before the first response arrives, and the server
+ * answers them in order. Completions are delivered through callbacks (or
+ * futures built on them) from inside dbc_poll()/dbc_poll_many(), which drive
+ * the socket I/O. A connection must only be driven by one thread at a time;
+ * dbc_pool_t hands connections out to threads exclusively.
+ */
+
+#define DBC_LINE 256  // longest command or response, matching the server
+
+// status passed to callbacks and returned by the blocking calls
+#define DBC_OK 0
+#define DBC_ECLOSED -1   // connection failed or closed before the response
+#define DBC_EINVAL -2    // command too long or contains a newline
+#define DBC_ETIMEOUT -3  // the response did not arrive in time
+
+typedef struct dbc_conn dbc_conn_t;
+typedef struct dbc_future dbc_future_t;
+typedef struct dbc_pool dbc_pool_t;
+typedef struct dbc_ring dbc_ring_t;
+
+/*
+ * Called once per command with its status and, on DBC_OK, the response line
+ * without its trailing newline. response is only valid during the call.
+ */
+typedef void (*dbc_callback_t)(void *arg, int status, const char *response);
+
+//------------------------------------------------------------------------------------------------
+// Connections
+
+/**
+ * dbc_connect() starts a non-blocking connection to host:port and returns
+ * immediately. Commands may be queued right away; they are sent once the
+ * connection completes. A host containing a '/' is the path of the server's
+ * Unix socket (see the server's -u option) and port is ignored. Returns NULL
+ * if the address cannot be resolved or no socket can be created.
+ */
+dbc_conn_t *dbc_connect(const char *host, const char *port);
+
+/**
+ * dbc_close() closes the connection and completes every outstanding command
+ * with DBC_ECLOSED before freeing it.
+ */
+void dbc_close(dbc_conn_t *conn);
+
+/**
+ * dbc_fd() returns the connection's socket, for callers that run their own
+ * event loop and call dbc_poll(conn, 0) when it is ready.
+ */
+int dbc_fd(dbc_conn_t *conn);
+
+/**
+ * dbc_pending() returns the number of commands sent or queued that have not
+ * completed yet.
+ */
+int dbc_pending(dbc_conn_t *conn);
+
+/**
+ * dbc_send() queues command (without a trailing newline) and arranges for cb
+ * to be called with its response. Returns 0 on success, or DBC_EINVAL or
+ * DBC_ECLOSED without calling cb.
+ */
+int dbc_send(dbc_conn_t *conn, const char *command, dbc_callback_t cb,
+             void *arg);
+
+/**
+ * dbc_poll() waits up to timeout_ms (-1 waits forever, 0 not at all) for the
+ * connection to make progress, then flushes queued commands and completes any
+ * responses that arrived. Returns the number of commands completed, or
+ * DBC_ECLOSED once the connection has failed.
+ */
+int dbc_poll(dbc_conn_t *conn, int timeout_ms);
+
+/**
+ * dbc_poll_many() is dbc_poll() over several connections with a single wait.
+ * Returns the total number of commands completed.
+ */
+int dbc_poll_many(dbc_conn_t **conns, int n, int timeout_ms);
+
+/**
+ * dbc_watch() subscribes the connection to changes to the keys matching
+ * patterns, separated by spaces, each a key or a prefix followed by `*` (see
+ * the server's watch.h). cb gets the acknowledgement and then every line the
+ * server pushes, from inside dbc_poll(), until it is called with DBC_ECLOSED.
+ * The connection takes no further commands. Returns 0, or DBC_EINVAL or
+ * DBC_ECLOSED without calling cb.
+ */
+int dbc_watch(dbc_conn_t *conn, const char *patterns, dbc_callback_t cb,
+              void *arg);
+
+//------------------------------------------------------------------------------------------------
+// Futures and the synchronous wrapper
+
+/**
+ * dbc_send_future() is dbc_send() with the response delivered to a future.
+ * Returns NULL on the same errors as dbc_send().
+ */
+dbc_future_t *dbc_send_future(dbc_conn_t *conn, const char *command);
+
+/**
+ * dbc_future_wait() drives the future's connection until the response
+ * arrives or timeout_ms passes (-1 waits forever), then copies it into
+ * response. Returns the command's status or DBC_ETIMEOUT.
+ */
+int dbc_future_wait(dbc_future_t *future, char *response, size_t len,
+                    int timeout_ms);
+
+/**
+ * dbc_future_free() releases a future. A future that has not completed yet is
+ * released when it does.
+ */
+void dbc_future_free(dbc_future_t *future);
+
+/**
+ * dbc_request() sends command and blocks until its response is copied into
+ * response. Returns the command's status.
+ */
+int dbc_request(dbc_conn_t *conn, const char *command, char *response,
+                size_t len);
+
+//------------------------------------------------------------------------------------------------
+// Connection pool
+
+/**
+ * dbc_pool_create() opens size connections to host:port. Returns NULL if any
+ * of them cannot be started.
+ */
+dbc_pool_t *dbc_pool_create(const char *host, const char *port, int size);
+
+/**
+ * dbc_pool_acquire() blocks until a connection is free and hands it to the
+ * calling thread. Connections that failed while idle are replaced.
+ */
+dbc_conn_t *dbc_pool_acquire(dbc_pool_t *pool);
+
+/**
+ * dbc_pool_release() returns a connection to the pool. Any commands still
+ * outstanding on it are completed first.
+ */
+void dbc_pool_release(dbc_pool_t *pool, dbc_conn_t *conn);
+
+/**
+ * dbc_pool_destroy() closes every connection. No connection may be acquired.
+ */
+void dbc_pool_destroy(dbc_pool_t *pool);
+
+//------------------------------------------------------------------------------------------------
+// Shared-memory transport
+
+/*
+ * A dbc_ring_t talks to a server on the same host through shared memory (see
+ * ring.h) rather than a socket. It is blocking and not thread safe: commands
+ * are sent with dbc_ring_send() and their responses collected, in order, with
+ * dbc_ring_recv(). At most RING_SLOTS (64) commands may be outstanding.
+ */
+
+/**
+ * dbc_ring_connect() connects to the server's Unix socket at path and
+ * switches the connection to the shared-memory transport. Returns NULL on
+ * failure.
+ */
+dbc_ring_t *dbc_ring_connect(const char *path);
+
+/**
+ * dbc_ring_close() disconnects. Outstanding responses are discarded.
+ */
+void dbc_ring_close(dbc_ring_t *ring);
+
+/**
+ * dbc_ring_pending() returns the number of commands whose responses have not
+ * been received yet.
+ */
+int dbc_ring_pending(dbc_ring_t *ring);
+
+/**
+ * dbc_ring_send() sends command (without a trailing newline). Returns DBC_OK,
+ * DBC_EINVAL if the command is too long or too many are outstanding, or
+ * DBC_ECLOSED if the server went away.
+ */
+int dbc_ring_send(dbc_ring_t *ring, const char *command);
+
+/**
+ * dbc_ring_recv() waits for the response to the oldest outstanding command
+ * and copies it into response. Returns DBC_OK, DBC_EINVAL if nothing is
+ * outstanding, or DBC_ECLOSED.
+ */
+int dbc_ring_recv(dbc_ring_t *ring, char *response, size_t len);
+
+#endif  // DBCLIENT_H_
@@ -0,0 +1,154 @@
+#define _GNU_SOURCE  // memfd_create, struct ucred
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "./comm.h"
+#include "./db.h"
+#include "./handoff.h"
+
+//------------------------------------------------------------------------------------------------
+// The connection between the two servers
+
+int handoff_connect(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sock;
+    if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) return -1;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        send(sock, HANDOFF_REQUEST, strlen(HANDOFF_REQUEST), MSG_NOSIGNAL) !=
+            (ssize_t)strlen(HANDOFF_REQUEST)) {
+        int saved = errno;
+        if (close(sock) < 0) perror("close");
+        errno = saved;
+        return -1;
+    }
+    return sock;
+}
+
+int handoff_peer_ok(int sock) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(sock, (struct sockaddr *)&addr, &len) < 0 ||
+        addr.ss_family != AF_UNIX)
+        return 0;
+
+    struct ucred cred;
+    len = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        perror("getsockopt");
+        return 0;
+    }
+    return cred.uid == geteuid();
+}
+
+int handoff_send(int sock, char type, const int *fds, int nfds) {
+    struct iovec iov = {&type, 1};
+    char control[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds > 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+
+    ssize_t n;
+    while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    return n == 1 ? 0 : -1;
+}
+
+int handoff_recv(int sock, char *type, int *fds, int *nfds) {
+    struct iovec iov = {type, 1};
+    char control[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    if (n != 1) return -1;
+
+    *nfds = 0;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS) {
+        *nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Moving the data
+
+int handoff_snapshot(void) {
+    int fd;
+    if ((fd = memfd_create("db-handoff", MFD_CLOEXEC)) < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+
+    // the new server gets the same open file, offset included
+    int copy;
+    FILE *out = NULL;
+    if ((copy = dup(fd)) < 0 || (out = fdopen(copy, "w")) == NULL) {
+        perror("fdopen");
+        if (copy >= 0 && close(copy) < 0) perror("close");
+        if (close(fd) < 0) perror("close");
+        return -1;
+    }
+    db_snapshot(out);
+    if (fclose(out) == EOF || lseek(fd, 0, SEEK_SET) < 0) {
+        perror("handoff_snapshot");
+        if (close(fd) < 0) perror("close");
+        return -1;
+    }
+    return fd;
+}
+
+long handoff_load(int fd, long *total) {
+    char line[2 * BUFLEN];
+    char key[BUFLEN];
+    char value[BUFLEN];
+    long added = 0;
+    FILE *in;
+
+    *total = 0;
+    if ((in = fdopen(fd, "r")) == NULL) {
+        perror("fdopen");
+        if (close(fd) < 0) perror("close");
+        return 0;
+    }
+    while (fgets(line, sizeof(line), in) != NULL) {
+        if (sscanf(line, "a %255s %255s", key, value) != 2) continue;
+        (*total)++;
+        if (db_add(key, value) == 1) added++;
+    }
+    if (fclose(in) == EOF) perror("fclose");
+    return added;
+}
@@ -0,0 +1,71 @@
+#ifndef HANDOFF_H_
+#define HANDOFF_H_
+
+/*
+ * Zero-downtime restart. A new server started with `-T path` connects to the
+ * Unix socket of the running server at path and sends HANDOFF_REQUEST, which
+ * no client sends by accident. The old server then stops accepting, passes
+ * its listening sockets over with SCM_RIGHTS, and has every client thread
+ * pass its own connection at its next command boundary, when nothing the
+ * client sent is left unread in the old process. Once no client thread is
+ * left to run a command, it writes a snapshot of the tree into a memfd and
+ * passes that too. The new server loads the snapshot before it accepts or
+ * reads a command, so clients see one pause and then carry on over the same
+ * connection. The old server shuts down once the new one acknowledges that it
+ * has everything; should the new one go away first, the old one keeps its
+ * data and carries on.
+ *
+ * Wire format, old server to new, one byte each with the descriptors attached:
+ *  L   a listening TCP socket
+ *  U   the listening Unix socket
+ *  C   a client connection
+ *  M   a shared-memory client: its socket and its ring's memfd (see ring.h)
+ *  D   a memfd holding the snapshot, as `a key value` lines from the start
+ *  E   end; everything has been passed
+ * Anything else is the first byte of a line saying why the old server refused.
+ * The new server answers E with the single byte A.
+ */
+
+#define HANDOFF_REQUEST "U hand-off 1\n"
+#define HANDOFF_TIMEOUT_MS 2000  // how long clients get to reach a boundary
+#define HANDOFF_MAX_FDS 2
+
+/**
+ * handoff_connect() connects to the server whose Unix socket is at path and
+ * asks it to hand off. Returns the connection, or -1 with errno set.
+ */
+int handoff_connect(const char *path);
+
+/**
+ * handoff_peer_ok() returns 1 if sock is a Unix socket connection from a
+ * process running as our own user, who alone may take the server over.
+ */
+int handoff_peer_ok(int sock);
+
+/**
+ * handoff_send() sends type with nfds (at most HANDOFF_MAX_FDS) descriptors
+ * over sock. Returns 0 on success and -1 on failure.
+ */
+int handoff_send(int sock, char type, const int *fds, int nfds);
+
+/**
+ * handoff_recv() receives what handoff_send() sent into *type and fds, and
+ * the number of descriptors into *nfds. Returns 0 on success and -1 if the
+ * connection failed or closed.
+ */
+int handoff_recv(int sock, char *type, int *fds, int *nfds);
+
+/**
+ * handoff_snapshot() writes db_snapshot() into a new memfd and returns it,
+ * positioned at the start, or -1 on failure.
+ */
+int handoff_snapshot(void);
+
+/**
+ * handoff_load() adds every key in a snapshot from handoff_snapshot() and
+ * closes fd. Returns how many keys were added and stores how many the
+ * snapshot held in *total.
+ */
+long handoff_load(int fd, long *total);
+
+#endif  // HANDOFF_H_
@@ -0,0 +1,19 @@
+#ifndef HASH_H_
+#define HASH_H_
+
+#include <stdint.h>
+
+/*
+ * 64-bit FNV-1a hash of a NUL-terminated key. Shared by the modules that need
+ * to spread keys over shards or filter slots.
+ */
+static inline uint64_t hash_key(const char *key) {
+    uint64_t h = 14695981039346656037ULL;
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+#endif  // HASH_H_
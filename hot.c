@@ -0,0 +1,273 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "./comm.h"
+#include "./hash.h"
+#include "./hot.h"
+
+#define HOT_KEY_LEN 256
+
+typedef struct hot_entry {
+    uint64_t hash;
+    uint32_t count;
+    char key[HOT_KEY_LEN];
+} hot_entry_t;
+
+// One thread's counts since the last merge
+typedef struct hot_local {
+    pthread_mutex_t mutex;
+    uint32_t cms[HOT_DEPTH][HOT_WIDTH];
+    hot_entry_t top[HOT_K];  // unordered
+    int ntop;
+    unsigned long records;
+    int dead;  // its thread has exited, free it after the next merge
+    struct hot_local *next;
+} hot_local_t;
+
+static int enabled;
+static int interval;
+
+// The thread list, the global sketch and the global top keys, all under
+// merge_mutex
+static pthread_mutex_t merge_mutex = PTHREAD_MUTEX_INITIALIZER;
+static hot_local_t *locals;
+static int nlocals;
+static uint32_t cms[HOT_DEPTH][HOT_WIDTH];
+static hot_entry_t top[HOT_K];  // hottest first
+static int ntop;
+static unsigned long records;
+static unsigned long merges;
+
+static pthread_t merger;
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
+static int stopping;
+
+static pthread_key_t local_key;
+static __thread hot_local_t *local;
+
+/* Row i's counter for hash h; rows are combined from the hash's two halves. */
+static inline size_t slot(uint64_t h, int i) {
+    return ((h & 0xffffffff) + i * ((h >> 32) | 1)) & (HOT_WIDTH - 1);
+}
+
+static uint32_t estimate(uint32_t sketch[HOT_DEPTH][HOT_WIDTH], uint64_t h) {
+    uint32_t est = UINT32_MAX;
+    for (int i = 0; i < HOT_DEPTH; i++)
+        if (sketch[i][slot(h, i)] < est) est = sketch[i][slot(h, i)];
+    return est;
+}
+
+/* Runs when a thread that recorded exits. */
+static void detach(void *arg) {
+    hot_local_t *l = arg;
+    pthread_mutex_lock(&l->mutex);
+    l->dead = 1;
+    pthread_mutex_unlock(&l->mutex);
+}
+
+static hot_local_t *attach(void) {
+    hot_local_t *l;
+    if ((l = calloc(1, sizeof(hot_local_t))) == NULL) return NULL;
+    pthread_mutex_init(&l->mutex, 0);
+    pthread_setspecific(local_key, l);
+    pthread_mutex_lock(&merge_mutex);
+    l->next = locals;
+    locals = l;
+    nlocals++;
+    pthread_mutex_unlock(&merge_mutex);
+    return local = l;
+}
+
+void hot_record(const char *key) {
+    if (!enabled) return;
+    hot_local_t *l = local != NULL ? local : attach();
+    if (l == NULL) return;
+    uint64_t h = hash_key(key);
+
+    pthread_mutex_lock(&l->mutex);
+    uint32_t est = UINT32_MAX;
+    for (int i = 0; i < HOT_DEPTH; i++) {
+        uint32_t c = ++l->cms[i][slot(h, i)];
+        if (c < est) est = c;
+    }
+    l->records++;
+
+    // keep the key if it is tracked already or beats the coldest one
+    int min = 0;
+    int j;
+    for (j = 0; j < l->ntop; j++) {
+        if (l->top[j].hash == h && strcmp(l->top[j].key, key) == 0) break;
+        if (l->top[j].count < l->top[min].count) min = j;
+    }
+    if (j == l->ntop) {
+        if (l->ntop < HOT_K)
+            l->ntop++;
+        else if (est > l->top[min].count)
+            j = min;
+        else
+            j = -1;
+        if (j >= 0) {
+            l->top[j].hash = h;
+            snprintf(l->top[j].key, HOT_KEY_LEN, "%s", key);
+        }
+    }
+    if (j >= 0) l->top[j].count = est;
+    pthread_mutex_unlock(&l->mutex);
+}
+
+//------------------------------------------------------------------------------------------------
+// Merging
+
+/* Adds e to the candidates in list (of n, at most cap) unless it is there. */
+static void add_candidate(hot_entry_t *list, int *n, int cap, hot_entry_t *e) {
+    for (int i = 0; i < *n; i++)
+        if (list[i].hash == e->hash && strcmp(list[i].key, e->key) == 0)
+            return;
+    if (*n < cap) list[(*n)++] = *e;
+}
+
+static int compare_count(const void *a, const void *b) {
+    uint32_t x = ((const hot_entry_t *)a)->count;
+    uint32_t y = ((const hot_entry_t *)b)->count;
+    return (x < y) - (x > y);
+}
+
+/* Folds every thread's counts into the global sketch and reranks the top
+   keys. The caller holds merge_mutex. */
+static void merge(void) {
+    static hot_entry_t candidates[HOT_K * 2];
+    int n = 0;
+
+    for (int i = 0; i < HOT_DEPTH; i++)
+        for (int j = 0; j < HOT_WIDTH; j++) cms[i][j] >>= 1;
+    for (int i = 0; i < ntop; i++)
+        add_candidate(candidates, &n, HOT_K * 2, &top[i]);
+
+    hot_local_t **pp = &locals;
+    while (*pp != NULL) {
+        hot_local_t *l = *pp;
+        pthread_mutex_lock(&l->mutex);
+        for (int i = 0; i < HOT_DEPTH; i++)
+            for (int j = 0; j < HOT_WIDTH; j++) {
+                uint32_t sum = cms[i][j] + l->cms[i][j];
+                cms[i][j] = sum < cms[i][j] ? UINT32_MAX : sum;
+            }
+        memset(l->cms, 0, sizeof(l->cms));
+        records += l->records;
+        l->records = 0;
+
+        // the list only grows to twice HOT_K: keep each thread's hottest
+        qsort(l->top, l->ntop, sizeof(hot_entry_t), compare_count);
+        for (int i = 0; i < l->ntop; i++) {
+            if (n == HOT_K * 2) {
+                qsort(candidates, n, sizeof(hot_entry_t), compare_count);
+                n = HOT_K;
+            }
+            add_candidate(candidates, &n, HOT_K * 2, &l->top[i]);
+        }
+        l->ntop = 0;
+        int dead = l->dead;
+        pthread_mutex_unlock(&l->mutex);
+
+        if (dead) {
+            *pp = l->next;
+            nlocals--;
+            pthread_mutex_destroy(&l->mutex);
+            free(l);
+        } else {
+            pp = &l->next;
+        }
+    }
+
+    for (int i = 0; i < n; i++)
+        candidates[i].count = estimate(cms, candidates[i].hash);
+    qsort(candidates, n, sizeof(hot_entry_t), compare_count);
+    ntop = n < HOT_K ? n : HOT_K;
+    while (ntop > 0 && candidates[ntop - 1].count == 0) ntop--;
+    memcpy(top, candidates, ntop * sizeof(hot_entry_t));
+    merges++;
+}
+
+static void *merge_loop(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&merge_mutex);
+    while (!stopping) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += interval / 1000;
+        until.tv_nsec += (interval % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        int err = 0;
+        while (!stopping && err != ETIMEDOUT)
+            err = pthread_cond_timedwait(&stop_cond, &merge_mutex, &until);
+        if (!stopping) merge();
+    }
+    pthread_mutex_unlock(&merge_mutex);
+    return NULL;
+}
+
+//------------------------------------------------------------------------------------------------
+// Setup, reports and teardown
+
+void hot_init(int ms) {
+    int err;
+    if (ms <= 0) return;
+    interval = ms;
+    if ((err = pthread_key_create(&local_key, detach)))
+        handle_error_en(err, "pthread_key_create");
+    if ((err = pthread_create(&merger, 0, merge_loop, NULL)))
+        handle_error_en(err, "pthread_create");
+    enabled = 1;
+}
+
+void hot_report(int n, char *buf, int len) {
+    if (!enabled) {
+        snprintf(buf, len, "hot keys disabled");
+        return;
+    }
+    pthread_mutex_lock(&merge_mutex);
+    if (n <= 0 || n > ntop) n = ntop;
+    int pos = snprintf(buf, len, "%d hot keys", n);
+    for (int i = 0; i < n && pos < len; i++)
+        pos += snprintf(buf + pos, len - pos, "%s%s %u", i == 0 ? ": " : ", ",
+                        top[i].key, top[i].count);
+    pthread_mutex_unlock(&merge_mutex);
+}
+
+void hot_stats(char *buf, int len) {
+    pthread_mutex_lock(&merge_mutex);
+    snprintf(buf, len, "hot enabled=%d interval_ms=%d threads=%d records=%lu "
+             "merges=%lu bytes=%zu",
+             enabled, interval, nlocals, records, merges,
+             enabled ? sizeof(cms) + sizeof(top) + nlocals * sizeof(hot_local_t)
+                     : 0);
+    pthread_mutex_unlock(&merge_mutex);
+}
+
+void hot_cleanup(void) {
+    int err;
+    if (!enabled) return;
+    pthread_mutex_lock(&merge_mutex);
+    stopping = 1;
+    pthread_cond_signal(&stop_cond);
+    pthread_mutex_unlock(&merge_mutex);
+    if ((err = pthread_join(merger, 0))) handle_error_en(err, "pthread_join");
+
+    enabled = 0;
+    pthread_key_delete(local_key);  // no more detach() calls
+    while (locals != NULL) {
+        hot_local_t *l = locals;
+        locals = l->next;
+        pthread_mutex_destroy(&l->mutex);
+        free(l);
+    }
+    nlocals = 0;
+}
@@ -0,0 +1,52 @@
+#ifndef HOT_H_
+#define HOT_H_
+
+#include <stddef.h>
+
+/*
+ * Hot-key detection for the request path. Every thread that serves commands
+ * counts the keys it sees in a count-min sketch of its own and tracks the
+ * HOT_K keys with the highest estimates beside it, under a mutex only a merge
+ * ever contends for. A merger thread folds every thread's counts into a
+ * global sketch once per interval and starts the threads over; the global
+ * counts are halved before each fold, so they weigh recent intervals most.
+ * The global top keys are the HOT_K best of the threads' candidates and the
+ * previous top keys, ranked by the global sketch. Each thread uses a fixed
+ * HOT_DEPTH x HOT_WIDTH counters and HOT_K keys of memory.
+ */
+
+#define HOT_DEPTH 4
+#define HOT_WIDTH 2048  // counters per row, a power of two
+#define HOT_K 32
+#define HOT_DEFAULT_INTERVAL 1000  // milliseconds between merges
+
+/**
+ * hot_init() starts tracking, merging every interval milliseconds, or leaves
+ * it off for 0. Must be called before any client thread starts.
+ */
+void hot_init(int interval);
+
+/**
+ * hot_record() counts one request for key on the calling thread.
+ */
+void hot_record(const char *key);
+
+/**
+ * hot_report() writes the n hottest keys as of the last merge, hottest first,
+ * each with its decayed count, into buf.
+ */
+void hot_report(int n, char *buf, int len);
+
+/**
+ * hot_stats() writes the merge interval, the number of threads tracked, the
+ * requests counted, the merges done and the bytes used into buf.
+ */
+void hot_stats(char *buf, int len);
+
+/**
+ * hot_cleanup() stops the merger and frees every thread's sketch. No other
+ * thread may be recording.
+ */
+void hot_cleanup(void);
+
+#endif  // HOT_H_
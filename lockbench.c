@@ -0,0 +1,218 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./bloom.h"
+#include "./cache.h"
+#include "./db.h"
+#include "./nodelock.h"
+
+#define KEYLEN 16
+#define BUCKETS 40  // latency histogram buckets, powers of two nanoseconds
+
+/*
+ * Measures the node lock the tree was built with (see nodelock.h) under
+ * contention, with no network or client in the way. threads threads run
+ * against one tree of about keys/2 keys for the given number of seconds, each
+ * picking a key at random and querying it, or else adding or removing it
+ * (alternately, so the tree keeps its size). Writes restructure the tree and
+ * write-lock from the root down, so they are where the locks contend most.
+ *
+ * For each mix it reports the node size, total throughput, how evenly the
+ * threads got through their work (the least and most operations done by one
+ * thread and Jain's fairness index, 1 when all did the same) and latency
+ * percentiles. Without -r a read-heavy (95% reads) and a write-heavy (20%
+ * reads) mix are run. Build with `make lock=<type> lockbench` to compare,
+ * or run with -S to measure the lock-free skip list instead of the tree,
+ * with -D to have removals leave tombstones for the compactor and with -z to
+ * compress values. Every value is its key with _0 appended, as in the scripts.
+ */
+
+typedef struct worker {
+    pthread_t thread;
+    unsigned int seed;
+    unsigned long ops;
+    unsigned long hist[BUCKETS];
+} worker_t;
+
+char (*keys)[KEYLEN];
+int nkeys = 100000;
+int nthreads = 8;
+double seconds = 2;
+int read_pct;
+int skiplist;
+int tombstones;
+volatile int running;
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline unsigned long nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void *run(void *arg) {
+    worker_t *w = arg;
+    char result[256];
+    char value[KEYLEN + 2];
+    int add = 1;
+    while (running) {
+        char *key = keys[rand_r(&w->seed) % nkeys];
+        snprintf(value, sizeof(value), "%s_0", key);
+        unsigned long t = nsec();
+        if ((int)(rand_r(&w->seed) % 100) < read_pct) {
+            db_query(key, result, sizeof(result));
+        } else {
+            if (add)
+                db_add(key, value);
+            else
+                db_remove(key);
+            add = !add;
+        }
+        t = nsec() - t;
+        w->hist[t == 0 ? 0 : 63 - __builtin_clzl(t)]++;
+        w->ops++;
+    }
+    return NULL;
+}
+
+/* Returns the latency, in microseconds, below which fraction p of the
+   operations in hist fall (the top of its bucket). */
+double percentile(unsigned long *hist, unsigned long total, double p) {
+    unsigned long seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += hist[i];
+        if (seen >= p * total) return (2UL << i) / 1000.0;
+    }
+    return (2UL << (BUCKETS - 1)) / 1000.0;
+}
+
+void bench(int pct) {
+    worker_t *workers = calloc(nthreads, sizeof(worker_t));
+    if (workers == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    read_pct = pct;
+    running = 1;
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].seed = i + 1;
+        pthread_create(&workers[i].thread, 0, run, &workers[i]);
+    }
+    double start = now();
+    usleep(seconds * 1e6);
+    running = 0;
+    for (int i = 0; i < nthreads; i++) pthread_join(workers[i].thread, 0);
+    double elapsed = now() - start;
+
+    unsigned long total = 0, min = (unsigned long)-1, max = 0;
+    unsigned long hist[BUCKETS] = {0};
+    double squares = 0;
+    for (int i = 0; i < nthreads; i++) {
+        worker_t *w = &workers[i];
+        total += w->ops;
+        squares += (double)w->ops * w->ops;
+        if (w->ops < min) min = w->ops;
+        if (w->ops > max) max = w->ops;
+        for (int j = 0; j < BUCKETS; j++) hist[j] += w->hist[j];
+    }
+    if (skiplist)
+        printf("skiplist ");
+    else
+        printf("lock=%s node_bytes=%zu %s", nodelock_name, sizeof(node_t),
+               tombstones ? "tombstones " : "");
+    printf("reads=%d%% threads=%d keys=%d: "
+           "%.0f ops/s, per thread min=%lu max=%lu fairness=%.3f, "
+           "p50=%.1fus p99=%.1fus p99.9=%.1fus\n",
+           pct, nthreads, nkeys,
+           total / elapsed, min, max,
+           squares > 0 ? (double)total * total / (nthreads * squares) : 0,
+           percentile(hist, total, 0.5), percentile(hist, total, 0.99),
+           percentile(hist, total, 0.999));
+    free(workers);
+}
+
+void usage_error(const char *cmd) {
+    fprintf(stderr,
+            "Usage: %s [-t threads] [-k keys] [-d seconds] [-r read_percent] "
+            "[-S] [-D] [-z]\n",
+            cmd);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    int pct = -1;
+    while ((opt = getopt(argc, argv, "t:k:d:r:SDz")) != -1) {
+        switch (opt) {
+            case 't':
+                if ((nthreads = atoi(optarg)) <= 0) usage_error(argv[0]);
+                break;
+            case 'k':
+                if ((nkeys = atoi(optarg)) <= 0) usage_error(argv[0]);
+                break;
+            case 'd':
+                if ((seconds = atof(optarg)) <= 0) usage_error(argv[0]);
+                break;
+            case 'r':
+                pct = atoi(optarg);
+                if (pct < 0 || pct > 100) usage_error(argv[0]);
+                break;
+            case 'S':
+                skiplist = 1;
+                db_backend(DB_SKIPLIST);
+                break;
+            case 'D':
+                tombstones = 1;
+                break;
+            case 'z':
+                db_compress(1);
+                break;
+            default:
+                usage_error(argv[0]);
+        }
+    }
+    if (optind != argc) usage_error(argv[0]);
+
+    cache_init(0);
+    bloom_init(0);
+    if ((keys = malloc(nkeys * sizeof(*keys))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    // every other key, added in random order so the tree is not a list
+    for (int i = 0; i < nkeys; i++) snprintf(keys[i], KEYLEN, "k%08d", i);
+    unsigned int seed = 0;
+    for (int i = nkeys - 1; i > 0; i--) {
+        int j = rand_r(&seed) % (i + 1);
+        char tmp[KEYLEN];
+        memcpy(tmp, keys[i], KEYLEN);
+        memcpy(keys[i], keys[j], KEYLEN);
+        memcpy(keys[j], tmp, KEYLEN);
+    }
+    for (int i = 0; i < nkeys; i += 2) {
+        char value[KEYLEN + 2];
+        snprintf(value, sizeof(value), "%s_0", keys[i]);
+        db_add(keys[i], value);
+    }
+    if (tombstones) db_tombstones(1);
+
+    if (pct >= 0) {
+        bench(pct);
+    } else {
+        bench(95);
+        bench(20);
+    }
+    db_tombstones(0);
+    db_cleanup();
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,296 @@
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "./comm.h"
+#include "./nodelock.h"
+
+#define NODELOCK_SPINS 100  // checks before a waiter goes to sleep
+
+#if defined(NODELOCK_SPIN) || defined(NODELOCK_MCS)
+
+static void futex_wait(uint32_t *addr, uint32_t val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+/* Wakes up to n threads sleeping on addr. The lock addr is in may be freed
+   by then; a private futex wake only uses the address. */
+static void futex_wake(uint32_t *addr, int n) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+static int spins = -1;  // NODELOCK_SPINS, or 0 with a single CPU
+
+/* Checks a waiter makes before it sleeps. Spinning on one CPU only keeps the
+   holder from running. */
+static inline int spin_limit(void) {
+    if (spins < 0)
+        spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? NODELOCK_SPINS : 0;
+    return spins;
+}
+
+static inline void relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+#endif
+
+#if defined(NODELOCK_SPIN)
+//------------------------------------------------------------------------------------------------
+// Spin-then-park lock
+
+#define SPIN_WRITER (1u << 31)    // held by a writer
+#define SPIN_WAITING (1u << 30)   // a writer waits, new readers stay out
+#define SPIN_SLEEPERS (1u << 29)  // someone sleeps on the word
+#define SPIN_READERS (SPIN_SLEEPERS - 1)
+
+const char *nodelock_name = "spin";
+
+void nodelock_init(nodelock_t *l) { l->word = 0; }
+
+void nodelock_destroy(nodelock_t *l) { (void)l; }
+
+/* Sleeps until l's word is no longer w, flagging that someone sleeps on it
+   first. Returns at once if the word has changed in the meantime. */
+static void spin_sleep(nodelock_t *l, uint32_t w) {
+    if ((w & SPIN_SLEEPERS) == 0 &&
+        !__atomic_compare_exchange_n(&l->word, &w, w | SPIN_SLEEPERS, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+    futex_wait(&l->word, w | SPIN_SLEEPERS);
+}
+
+void nodelock_rdlock(nodelock_t *l) {
+    for (int i = 0;; i++) {
+        uint32_t w = __atomic_load_n(&l->word, __ATOMIC_RELAXED);
+        if ((w & (SPIN_WRITER | SPIN_WAITING)) == 0) {
+            if (__atomic_compare_exchange_n(&l->word, &w, w + 1, 1,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return;
+        } else if (i < spin_limit()) {
+            relax();
+        } else {
+            spin_sleep(l, w);
+        }
+    }
+}
+
+void nodelock_wrlock(nodelock_t *l) {
+    for (int i = 0;; i++) {
+        uint32_t w = __atomic_load_n(&l->word, __ATOMIC_RELAXED);
+        if ((w & (SPIN_WRITER | SPIN_READERS)) == 0) {
+            // taking it clears SPIN_WAITING; other waiting writers set it again
+            if (__atomic_compare_exchange_n(&l->word, &w,
+                                            (w & SPIN_SLEEPERS) | SPIN_WRITER,
+                                            1, __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED))
+                return;
+        } else if ((w & SPIN_WAITING) == 0) {
+            __atomic_compare_exchange_n(&l->word, &w, w | SPIN_WAITING, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        } else if (i < spin_limit()) {
+            relax();
+        } else {
+            spin_sleep(l, w);
+        }
+    }
+}
+
+/* Sleepers are woken when a writer leaves or the last reader does, the only
+   changes any of them waits for. */
+void nodelock_unlock(nodelock_t *l) {
+    uint32_t w = __atomic_load_n(&l->word, __ATOMIC_RELAXED);
+    uint32_t next;
+    do {
+        if (w & SPIN_WRITER) {
+            next = w & ~(SPIN_WRITER | SPIN_SLEEPERS);
+        } else {
+            next = w - 1;
+            if ((next & SPIN_READERS) == 0) next &= ~SPIN_SLEEPERS;
+        }
+    } while (!__atomic_compare_exchange_n(&l->word, &w, next, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if ((w & SPIN_SLEEPERS) && !(next & SPIN_SLEEPERS))
+        futex_wake(&l->word, INT_MAX);
+}
+
+#elif defined(NODELOCK_MCS)
+//------------------------------------------------------------------------------------------------
+// Queue lock
+
+// States of a queue entry's grant, as for part.c's signals
+#define GRANT_CLEAR 0
+#define GRANT_SLEEPING 1
+#define GRANT_SET 2
+
+#define MCS_WRITER_SLEEPS (1u << 31)  // in readers
+#define MCS_HELD 8  // write locks one thread holds at once without malloc
+
+typedef struct nodelock_qnode {
+    struct nodelock_qnode *next;
+    uint32_t granted;
+} qnode_t;
+
+// A reader leaves the queue as soon as it has the lock, so its entry lives on
+// its stack; a writer stays at the head until it unlocks, in one of these or,
+// past MCS_HELD at once (a batch walk holds more), in one of its own.
+static __thread qnode_t held[MCS_HELD];
+static __thread unsigned held_mask;
+
+const char *nodelock_name = "mcs";
+
+void nodelock_init(nodelock_t *l) {
+    l->tail = NULL;
+    l->writer = NULL;
+    l->readers = 0;
+}
+
+void nodelock_destroy(nodelock_t *l) { (void)l; }
+
+static void grant(qnode_t *q) {
+    if (__atomic_exchange_n(&q->granted, GRANT_SET, __ATOMIC_SEQ_CST) ==
+        GRANT_SLEEPING)
+        futex_wake(&q->granted, 1);
+}
+
+static void wait_grant(qnode_t *q) {
+    for (int i = 0; i < spin_limit(); i++) {
+        if (__atomic_load_n(&q->granted, __ATOMIC_ACQUIRE) == GRANT_SET) return;
+        relax();
+    }
+    uint32_t clear = GRANT_CLEAR;
+    if (!__atomic_compare_exchange_n(&q->granted, &clear, GRANT_SLEEPING, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE))
+        return;  // granted in the meantime
+    while (__atomic_load_n(&q->granted, __ATOMIC_ACQUIRE) != GRANT_SET)
+        futex_wait(&q->granted, GRANT_SLEEPING);
+}
+
+/* Joins l's queue as q and waits until q reaches its head. */
+static void enqueue(nodelock_t *l, qnode_t *q) {
+    q->next = NULL;
+    q->granted = GRANT_CLEAR;
+    qnode_t *pred = __atomic_exchange_n(&l->tail, q, __ATOMIC_ACQ_REL);
+    if (pred == NULL) return;
+    __atomic_store_n(&pred->next, q, __ATOMIC_RELEASE);
+    wait_grant(q);
+}
+
+/* Hands the head of l's queue from q to whoever queued behind it, if anyone
+   did. l is not touched once the queue is empty. */
+static void dequeue(nodelock_t *l, qnode_t *q) {
+    qnode_t *next = __atomic_load_n(&q->next, __ATOMIC_ACQUIRE);
+    if (next == NULL) {
+        qnode_t *expected = q;
+        if (__atomic_compare_exchange_n(&l->tail, &expected, NULL, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return;
+        // someone is queueing, wait for it to link itself in
+        while ((next = __atomic_load_n(&q->next, __ATOMIC_ACQUIRE)) == NULL)
+            sched_yield();
+    }
+    grant(next);
+}
+
+void nodelock_rdlock(nodelock_t *l) {
+    qnode_t q;
+    enqueue(l, &q);
+    __atomic_add_fetch(&l->readers, 1, __ATOMIC_SEQ_CST);
+    dequeue(l, &q);
+}
+
+void nodelock_wrlock(nodelock_t *l) {
+    qnode_t *q;
+    if (held_mask != (1u << MCS_HELD) - 1) {
+        int slot = __builtin_ctz(~held_mask);
+        held_mask |= 1u << slot;
+        q = &held[slot];
+    } else if ((q = malloc(sizeof(qnode_t))) == NULL) {
+        handle_error_en(ENOMEM, "nodelock_wrlock");
+    }
+    enqueue(l, q);
+
+    // at the head, no more readers come in; wait for those already in
+    for (int i = 0;; i++) {
+        uint32_t r = __atomic_load_n(&l->readers, __ATOMIC_ACQUIRE);
+        if (r == 0) break;
+        if (i < spin_limit()) {
+            relax();
+            continue;
+        }
+        if ((r & MCS_WRITER_SLEEPS) == 0 &&
+            !__atomic_compare_exchange_n(&l->readers, &r,
+                                         r | MCS_WRITER_SLEEPS, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            continue;
+        futex_wait(&l->readers, r | MCS_WRITER_SLEEPS);
+    }
+    l->writer = q;
+}
+
+/* A writer holds l with no readers in, a reader with at least one. */
+void nodelock_unlock(nodelock_t *l) {
+    if (__atomic_load_n(&l->readers, __ATOMIC_RELAXED) == 0) {
+        qnode_t *q = l->writer;
+        l->writer = NULL;
+        dequeue(l, q);
+        if (q >= held && q < held + MCS_HELD)
+            held_mask &= ~(1u << (q - held));
+        else
+            free(q);
+        return;
+    }
+    // the writer at the head, if it sleeps, is the only one left to change
+    // readers once they reach zero
+    if (__atomic_sub_fetch(&l->readers, 1, __ATOMIC_RELEASE) ==
+        MCS_WRITER_SLEEPS) {
+        __atomic_store_n(&l->readers, 0, __ATOMIC_RELEASE);
+        futex_wake(&l->readers, 1);
+    }
+}
+
+#else
+//------------------------------------------------------------------------------------------------
+// pthread rwlock
+
+const char *nodelock_name = "rwlock";
+
+void nodelock_init(nodelock_t *l) {
+    int err;
+    if ((err = pthread_rwlock_init(l, 0)) != 0)
+        handle_error_en(err, "pthread_rwlock_init");
+}
+
+void nodelock_destroy(nodelock_t *l) {
+    int err;
+    if ((err = pthread_rwlock_destroy(l)) != 0)
+        handle_error_en(err, "pthread_rwlock_destroy");
+}
+
+void nodelock_rdlock(nodelock_t *l) {
+    int err;
+    if ((err = pthread_rwlock_rdlock(l)))
+        handle_error_en(err, "pthread_rwlock_rdlock");
+}
+
+void nodelock_wrlock(nodelock_t *l) {
+    int err;
+    if ((err = pthread_rwlock_wrlock(l)))
+        handle_error_en(err, "pthread_rwlock_wrlock");
+}
+
+void nodelock_unlock(nodelock_t *l) {
+    int err;
+    if ((err = pthread_rwlock_unlock(l)))
+        handle_error_en(err, "pthread_rwlock_unlock");
+}
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef NODELOCK_H_
+#define NODELOCK_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * The reader-writer lock in every tree node, chosen when the server is built
+ * (`make lock=rwlock|spin|mcs`, see README.md):
+ *
+ * rwlock  pthread_rwlock_t, 56 bytes on glibc. The default.
+ * spin    one 32-bit word holding a reader count and writer flags. Waiters
+ *         spin briefly and then sleep on the word with a futex; a waiting
+ *         writer keeps new readers out, so writers are not starved.
+ * mcs     a queue lock after Mellor-Crummey and Scott. Waiters line up in
+ *         arrival order and each spins (then sleeps) on a flag of its own
+ *         rather than on the lock. A reader at the head of the queue lets the
+ *         next waiter in at once, so readers that queue together share the
+ *         lock and a writer waits only for the readers ahead of it.
+ *
+ * Any of them is released with nodelock_unlock() however it was taken, as
+ * with pthread_rwlock_unlock(), and must be released by the thread that took
+ * it.
+ */
+
+#if defined(NODELOCK_SPIN)
+
+typedef struct nodelock {
+    uint32_t word;
+} nodelock_t;
+#define NODELOCK_INITIALIZER {0}
+
+#elif defined(NODELOCK_MCS)
+
+typedef struct nodelock {
+    struct nodelock_qnode *tail;    // the last in the queue, NULL if none
+    struct nodelock_qnode *writer;  // the holding writer's queue entry
+    uint32_t readers;  // readers holding the lock, and a sleeping writer flag
+} nodelock_t;
+#define NODELOCK_INITIALIZER {NULL, NULL, 0}
+
+#else
+
+typedef pthread_rwlock_t nodelock_t;
+#define NODELOCK_INITIALIZER PTHREAD_RWLOCK_INITIALIZER
+
+#endif
+
+extern const char *nodelock_name;  // "rwlock", "spin" or "mcs"
+
+/**
+ * nodelock_init() and nodelock_destroy() set up and tear down an unheld lock.
+ */
+void nodelock_init(nodelock_t *l);
+void nodelock_destroy(nodelock_t *l);
+
+/**
+ * nodelock_rdlock() takes l shared and nodelock_wrlock() exclusively, waiting
+ * as long as it takes. nodelock_unlock() releases either.
+ */
+void nodelock_rdlock(nodelock_t *l);
+void nodelock_wrlock(nodelock_t *l);
+void nodelock_unlock(nodelock_t *l);
+
+#endif  // NODELOCK_H_
@@ -0,0 +1,245 @@
+#define _GNU_SOURCE  // pthread_attr_setaffinity_np
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "./comm.h"
+#include "./hash.h"
+#include "./part.h"
+
+#define PART_SPINS 1000  // checks before a waiting thread goes to sleep
+
+// States of a signal, a word one thread waits on until another sets it
+#define SIGNAL_CLEAR 0
+#define SIGNAL_SLEEPING 1
+#define SIGNAL_SET 2
+
+typedef struct part_req {
+    void (*fn)(void *);
+    void *arg;
+    uint32_t done;  // signal
+    struct part_req *next;
+} part_req_t;
+
+// Each partition sits on cache lines of its own
+typedef struct partition {
+    node_t root;
+    part_req_t *intake;  // posted requests, newest first
+    uint32_t posts;      // bumped after every push, the worker sleeps on it
+    uint32_t sleeping;   // the worker is asleep on posts
+    unsigned long served;
+    int stop;
+    pthread_t thread;
+} __attribute__((aligned(64))) partition_t;
+
+typedef struct part_hold {
+    part_req_t req;
+    uint32_t held;     // signal, set by the worker once it is waiting
+    uint32_t release;  // signal, set by the holder to let it go
+} part_hold_t;
+
+struct part_holds {
+    int n;
+    part_hold_t hold[];
+};
+
+int part_count;
+
+static partition_t *parts;
+static int spins;  // PART_SPINS, or 0 with a single CPU
+
+static void futex_wait(uint32_t *addr, uint32_t val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* Sets signal s, waking its waiter if it sleeps. The waiter may return and
+   free s as soon as it is set, so s is not read afterwards; a private futex
+   wake only uses the address. */
+static void signal_set(uint32_t *s) {
+    if (__atomic_exchange_n(s, SIGNAL_SET, __ATOMIC_SEQ_CST) == SIGNAL_SLEEPING)
+        futex_wake(s);
+}
+
+/* Waits until signal s is set, spinning first and then sleeping. */
+static void signal_wait(uint32_t *s) {
+    for (int i = 0; i < spins; i++)
+        if (__atomic_load_n(s, __ATOMIC_ACQUIRE) == SIGNAL_SET) return;
+
+    uint32_t clear = SIGNAL_CLEAR;
+    if (!__atomic_compare_exchange_n(s, &clear, SIGNAL_SLEEPING, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE))
+        return;  // set in the meantime
+    while (__atomic_load_n(s, __ATOMIC_ACQUIRE) != SIGNAL_SET)
+        futex_wait(s, SIGNAL_SLEEPING);
+}
+
+//------------------------------------------------------------------------------------------------
+// Workers
+
+/* Waits for posts to move past seen. The sequentially consistent flag store
+   and posts load here, and posts increment and flag load in part_post(),
+   make sure that either the poster sees us asleep or we see its post. */
+static void wait_posts(partition_t *p, uint32_t seen) {
+    for (int i = 0; i < spins; i++)
+        if (__atomic_load_n(&p->posts, __ATOMIC_ACQUIRE) != seen) return;
+
+    __atomic_store_n(&p->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&p->posts, __ATOMIC_SEQ_CST) == seen)
+        futex_wait(&p->posts, seen);
+    __atomic_store_n(&p->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+static void *worker(void *arg) {
+    partition_t *p = arg;
+    db_use_tree(&p->root, 1);
+
+    while (!p->stop) {
+        uint32_t seen = __atomic_load_n(&p->posts, __ATOMIC_ACQUIRE);
+        part_req_t *list = __atomic_exchange_n(&p->intake, NULL,
+                                               __ATOMIC_ACQUIRE);
+        if (list == NULL) {
+            wait_posts(p, seen);
+            continue;
+        }
+
+        // the intake is newest first; serve in posting order
+        part_req_t *fifo = NULL;
+        while (list != NULL) {
+            part_req_t *next = list->next;
+            list->next = fifo;
+            fifo = list;
+            list = next;
+        }
+        while (fifo != NULL) {
+            part_req_t *r = fifo;
+            fifo = r->next;  // r belongs to its poster once done is set
+            r->fn(r->arg);
+            __atomic_store_n(&p->served, p->served + 1, __ATOMIC_RELAXED);
+            signal_set(&r->done);
+        }
+    }
+    return NULL;
+}
+
+static void stop_worker(void *arg) {
+    partition_t *p = arg;
+    p->stop = 1;
+}
+
+void part_init(int count) {
+    int err;
+    if (count <= 0) return;
+    if (count > PART_MAX) count = PART_MAX;
+    spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? PART_SPINS : 0;
+
+    if ((err = posix_memalign((void **)&parts, 64,
+                              count * sizeof(partition_t))))
+        handle_error_en(err, "posix_memalign");
+    memset(parts, 0, count * sizeof(partition_t));
+
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 0; i < count; i++) {
+        db_root_init(&parts[i].root);
+
+        pthread_attr_t attr;
+        cpu_set_t cpus;
+        pthread_attr_init(&attr);
+        CPU_ZERO(&cpus);
+        CPU_SET(ncpus > 0 ? i % ncpus : 0, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        if ((err = pthread_create(&parts[i].thread, &attr, worker, &parts[i])))
+            handle_error_en(err, "pthread_create");
+        pthread_attr_destroy(&attr);
+    }
+    part_count = count;
+}
+
+void part_cleanup(void) {
+    int err;
+    for (int i = 0; i < part_count; i++) {
+        part_run(i, stop_worker, &parts[i]);
+        if ((err = pthread_join(parts[i].thread, 0)))
+            handle_error_en(err, "pthread_join");
+        db_use_tree(&parts[i].root, 1);
+        db_cleanup();
+    }
+    db_use_tree(&head, 0);
+    free(parts);
+    parts = NULL;
+    part_count = 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Routing
+
+int part_of(const char *key) { return hash_key(key) % part_count; }
+
+node_t *part_root(int part) { return &parts[part].root; }
+
+/* Pushes req onto part's intake and wakes the worker if it is asleep. */
+static void part_post(int part, part_req_t *req) {
+    partition_t *p = &parts[part];
+    req->done = SIGNAL_CLEAR;
+    req->next = __atomic_load_n(&p->intake, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&p->intake, &req->next, req, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    __atomic_add_fetch(&p->posts, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&p->sleeping, __ATOMIC_SEQ_CST)) futex_wake(&p->posts);
+}
+
+void part_run(int part, void (*fn)(void *), void *arg) {
+    part_req_t req = {fn, arg, SIGNAL_CLEAR, NULL};
+    part_post(part, &req);
+    signal_wait(&req.done);
+}
+
+/* Runs on a held worker until the holder releases it. */
+static void hold_worker(void *arg) {
+    part_hold_t *h = arg;
+    signal_set(&h->held);
+    signal_wait(&h->release);
+}
+
+part_holds_t *part_hold(const size_t *list, int n) {
+    part_holds_t *holds;
+    if ((holds = malloc(sizeof(part_holds_t) + n * sizeof(part_hold_t))) ==
+        NULL)
+        return NULL;
+    holds->n = n;
+    for (int i = 0; i < n; i++) {
+        part_hold_t *h = &holds->hold[i];
+        h->req.fn = hold_worker;
+        h->req.arg = h;
+        h->held = SIGNAL_CLEAR;
+        h->release = SIGNAL_CLEAR;
+        part_post(list[i], &h->req);
+        signal_wait(&h->held);
+    }
+    return holds;
+}
+
+void part_release(part_holds_t *holds) {
+    for (int i = holds->n - 1; i >= 0; i--) {
+        signal_set(&holds->hold[i].release);
+        signal_wait(&holds->hold[i].req.done);  // the worker is done with it
+    }
+    free(holds);
+}
+
+void part_stats(char *buf, int len) {
+    int pos = snprintf(buf, len, "parts count=%d served=", part_count);
+    for (int i = 0; i < part_count && pos < len; i++)
+        pos += snprintf(buf + pos, len - pos, "%s%lu", i == 0 ? "" : ",",
+                        __atomic_load_n(&parts[i].served, __ATOMIC_RELAXED));
+}
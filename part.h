@@ -0,0 +1,73 @@
+#ifndef PART_H_
+#define PART_H_
+
+#include <stddef.h>
+
+#include "./db.h"
+
+/*
+ * Shared-nothing partitioning. With the server's -P option the keyspace is
+ * split by key hash into partitions, each with a tree of its own and a worker
+ * thread (pinned to a core) that is the only thread ever to touch that tree,
+ * so the tree is used without any locks. Any other thread that calls into
+ * db.c has the call shipped to the owning worker through the worker's intake
+ * queue and waits for it to finish. Commands that span partitions visit the
+ * workers one by one (`p`, snapshots, shape statistics) or hold every
+ * partition they touch (transactions, db_clear()).
+ *
+ * The intake is a lock-free stack that any thread pushes onto and only the
+ * worker drains, so posting a request costs one compare-and-swap; the worker
+ * spins briefly and then sleeps on a futex when it runs dry, and is only woken
+ * with a system call when it has flagged itself asleep.
+ */
+
+#define PART_MAX 64
+
+extern int part_count;  // 0 when the tree is not partitioned
+
+typedef struct part_holds part_holds_t;
+
+/**
+ * part_init() starts count partitions (at most PART_MAX), or leaves the tree
+ * unpartitioned for 0. Must be called before any client thread starts.
+ */
+void part_init(int count);
+
+/**
+ * part_of() returns the partition that owns key.
+ */
+int part_of(const char *key);
+
+/**
+ * part_root() returns the root of partition part's tree.
+ */
+node_t *part_root(int part);
+
+/**
+ * part_run() runs fn(arg) on partition part's worker, where db.c works on the
+ * partition's tree, and returns once it has finished.
+ */
+void part_run(int part, void (*fn)(void *), void *arg);
+
+/**
+ * part_hold() stops the workers of the n partitions in parts, which must be
+ * in ascending order, and returns once all of them are waiting; the caller
+ * may then work on their trees itself (see db_use_tree()). part_release()
+ * lets them go again. Holding in ascending order keeps two holders from
+ * deadlocking. Returns NULL if out of memory.
+ */
+part_holds_t *part_hold(const size_t *parts, int n);
+void part_release(part_holds_t *holds);
+
+/**
+ * part_stats() writes the number of requests each worker has served into buf.
+ */
+void part_stats(char *buf, int len);
+
+/**
+ * part_cleanup() stops the workers and frees their trees. No other thread may
+ * be using the database.
+ */
+void part_cleanup(void);
+
+#endif  // PART_H_
@@ -0,0 +1,361 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./comm.h"
+#include "./db.h"
+#include "./repl.h"
+
+#define REPL_BATCH 64  // records copied out of the log per lock acquisition
+
+typedef struct repl_record {
+    unsigned long seq;
+    long ms;
+    char cmd[BUFLEN];
+} repl_record_t;
+
+// Primary side: the mutation log, a ring of the last REPL_LOG_ENTRIES records.
+// Sequence numbers start at 1, so next_seq - 1 is the latest record.
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static repl_record_t *log_ring;  // allocated when the first replica connects
+static unsigned long next_seq = 1;
+static int log_replicas;
+static int log_active;  // read without log_mutex by repl_log
+
+// Replica side: where we follow from and how far behind we are.
+typedef enum { r_disconnected, r_loading, r_streaming } replica_state_t;
+static const char *state_names[] = {"disconnected", "loading", "streaming"};
+
+static int is_replica;
+static char primary_host[BUFLEN];
+static char primary_port[32];
+static pthread_t replica_thread;
+
+static pthread_mutex_t stat_mutex = PTHREAD_MUTEX_INITIALIZER;
+static replica_state_t replica_state;
+static unsigned long applied_seq;
+static unsigned long primary_seq;
+static long apply_delay_ms;  // primary commit to local apply, last record
+static long last_contact_ms;
+static unsigned long snapshots;
+static unsigned long apply_failures;  // writes refused here, e.g. by -m
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void close_file(void *arg) {
+    if (fclose((FILE *)arg) == EOF) perror("fclose");
+}
+
+//------------------------------------------------------------------------------------------------
+// Primary: logging and streaming to replicas
+
+void repl_log(char op, const char *key, const char *value) {
+    if (!__atomic_load_n(&log_active, __ATOMIC_SEQ_CST)) return;
+
+    pthread_mutex_lock(&log_mutex);
+    if (log_active) {
+        repl_record_t *r = &log_ring[next_seq % REPL_LOG_ENTRIES];
+        r->seq = next_seq++;
+        r->ms = now_ms();
+        if (value != NULL)
+            snprintf(r->cmd, BUFLEN, "%c %s %s", op, key, value);
+        else
+            snprintf(r->cmd, BUFLEN, "%c %s", op, key);
+        pthread_cond_broadcast(&log_cond);
+    }
+    pthread_mutex_unlock(&log_mutex);
+}
+
+static void replica_gone(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&log_mutex);
+    if (--log_replicas == 0)
+        __atomic_store_n(&log_active, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&log_mutex);
+    fprintf(stderr, "replica disconnected\n");
+}
+
+/*
+ * Sends every key in the tree, bracketed by S and E. The traversal is not
+ * atomic, but every mutation it might miss or see half of has seq >= pos, and
+ * replaying those on top of the snapshot converges to the primary's state
+ * because adds of present keys and removes of absent keys are no-ops.
+ * Returns 0 on success and -1 if the replica went away.
+ */
+static int send_snapshot(FILE *cxstr, unsigned long pos) {
+    int ret = 0;
+    int oldstate;
+    char line[2 * BUFLEN];
+    FILE *snap;
+
+    if ((snap = tmpfile()) == NULL) {
+        perror("tmpfile");
+        return -1;
+    }
+    pthread_cleanup_push(close_file, snap);
+
+    // never get cancelled while holding locks in the tree
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    db_snapshot(snap);
+    pthread_setcancelstate(oldstate, NULL);
+    rewind(snap);
+
+    if (fprintf(cxstr, "S %lu\n", pos) < 0) ret = -1;
+    while (ret == 0 && fgets(line, sizeof(line), snap) != NULL)
+        if (fputs(line, cxstr) == EOF) ret = -1;
+    if (ret == 0 && (fputs("E\n", cxstr) == EOF || fflush(cxstr) == EOF))
+        ret = -1;
+
+    pthread_cleanup_pop(1);
+    return ret;
+}
+
+/* Streams log records from pos on until the replica goes away or overruns. */
+static void stream_log(FILE *cxstr, unsigned long pos) {
+    repl_record_t batch[REPL_BATCH];
+
+    while (1) {
+        int n = 0;
+        int overrun = 0;
+        unsigned long latest;
+
+        pthread_mutex_lock(&log_mutex);
+        pthread_cleanup_push((void *)&pthread_mutex_unlock, &log_mutex);
+        if (pos == next_seq) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += REPL_HEARTBEAT_MS / 1000;
+            pthread_cond_timedwait(&log_cond, &log_mutex, &deadline);
+        }
+        if (next_seq - pos > REPL_LOG_ENTRIES) {
+            overrun = 1;
+        } else {
+            while (pos < next_seq && n < REPL_BATCH)
+                batch[n++] = log_ring[pos++ % REPL_LOG_ENTRIES];
+        }
+        latest = next_seq - 1;
+        pthread_cleanup_pop(1);
+
+        if (overrun) {
+            fprintf(stderr, "replica fell behind, forcing resync\n");
+            if (fputs("X\n", cxstr) != EOF) fflush(cxstr);
+            return;
+        }
+
+        if (n == 0 && fprintf(cxstr, "H %lu %ld\n", latest, now_ms()) < 0)
+            return;
+        for (int i = 0; i < n; i++) {
+            if (fprintf(cxstr, "L %lu %ld %s\n", batch[i].seq, batch[i].ms,
+                        batch[i].cmd) < 0)
+                return;
+        }
+        if (fflush(cxstr) == EOF) return;
+    }
+}
+
+void repl_serve_replica(FILE *cxstr) {
+    unsigned long pos;
+
+    pthread_mutex_lock(&log_mutex);
+    if (log_ring == NULL &&
+        (log_ring = calloc(REPL_LOG_ENTRIES, sizeof(repl_record_t))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    log_replicas++;
+    __atomic_store_n(&log_active, 1, __ATOMIC_SEQ_CST);
+    pos = next_seq;
+    pthread_mutex_unlock(&log_mutex);
+
+    fprintf(stderr, "replica connected at seq %lu\n", pos);
+    pthread_cleanup_push(replica_gone, NULL);
+    if (send_snapshot(cxstr, pos) == 0) stream_log(cxstr, pos);
+    pthread_cleanup_pop(1);
+}
+
+//------------------------------------------------------------------------------------------------
+// Replica: following a primary
+
+/* Applies one record of the primary's, counting it as failed if this
+   server refused it, since the replica no longer matches the primary then. */
+static void replica_apply(char *cmd) {
+    char key[BUFLEN];
+    char value[BUFLEN];
+    int ret = 0;
+
+    if (cmd[0] == 'a' && sscanf(&cmd[1], "%255s %255s", key, value) == 2)
+        ret = db_add(key, value);
+    else if (cmd[0] == 'w' && sscanf(&cmd[1], "%255s %255s", key, value) == 2)
+        ret = db_upsert(key, value);
+    else if (cmd[0] == 'd' && sscanf(&cmd[1], "%255s", key) == 1)
+        ret = db_remove(key);
+    if (ret >= 0) return;
+
+    pthread_mutex_lock(&stat_mutex);
+    if (apply_failures++ == 0)
+        fprintf(stderr, "replica: refused %s from the primary, diverging\n",
+                key);
+    pthread_mutex_unlock(&stat_mutex);
+}
+
+/* Applies the primary's stream until it ends, errors or times out. */
+static void follow(FILE *cx) {
+    char line[2 * BUFLEN];
+    unsigned long seq;
+    long ms;
+    int off;
+    int oldstate;
+
+    while (fgets(line, sizeof(line), cx) != NULL) {
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+        pthread_mutex_lock(&stat_mutex);
+        last_contact_ms = now_ms();
+        pthread_mutex_unlock(&stat_mutex);
+
+        switch (line[0]) {
+            case 'S':
+                if (sscanf(&line[1], "%lu", &seq) != 1) break;
+                // start over from an empty tree
+                db_clear();
+                pthread_mutex_lock(&stat_mutex);
+                replica_state = r_loading;
+                applied_seq = primary_seq = seq - 1;
+                snapshots++;
+                pthread_mutex_unlock(&stat_mutex);
+                break;
+            case 'a':
+                replica_apply(line);
+                break;
+            case 'E':
+                pthread_mutex_lock(&stat_mutex);
+                replica_state = r_streaming;
+                pthread_mutex_unlock(&stat_mutex);
+                break;
+            case 'L':
+                if (sscanf(&line[1], "%lu %ld %n", &seq, &ms, &off) < 2) break;
+                replica_apply(&line[1 + off]);
+                pthread_mutex_lock(&stat_mutex);
+                applied_seq = seq;
+                if (primary_seq < seq) primary_seq = seq;
+                apply_delay_ms = now_ms() - ms;
+                pthread_mutex_unlock(&stat_mutex);
+                break;
+            case 'H':
+                if (sscanf(&line[1], "%lu %ld", &seq, &ms) != 2) break;
+                pthread_mutex_lock(&stat_mutex);
+                if (primary_seq < seq) primary_seq = seq;
+                pthread_mutex_unlock(&stat_mutex);
+                break;
+            case 'X':
+                pthread_setcancelstate(oldstate, NULL);
+                return;
+        }
+        pthread_setcancelstate(oldstate, NULL);
+    }
+}
+
+static void *replica_main(void *arg) {
+    (void)arg;
+    while (1) {
+        int sock;
+        FILE *cx;
+
+        if ((sock = comm_connect(primary_host, primary_port)) >= 0) {
+            // heartbeats arrive every REPL_HEARTBEAT_MS, so a silent primary
+            // is a dead one
+            struct timeval tv = {REPL_TIMEOUT_S, 0};
+            if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+                perror("setsockopt");
+
+            if (!(cx = fdopen(sock, "w+"))) {
+                perror("fdopen");
+                if (close(sock) < 0) perror("close");
+            } else {
+                fprintf(stderr, "following primary %s:%s\n", primary_host,
+                        primary_port);
+                pthread_cleanup_push(close_file, cx);
+                if (fputs("R\n", cx) != EOF && fflush(cx) != EOF) follow(cx);
+                pthread_cleanup_pop(1);
+
+                pthread_mutex_lock(&stat_mutex);
+                replica_state = r_disconnected;
+                pthread_mutex_unlock(&stat_mutex);
+                fprintf(stderr, "lost primary %s:%s\n", primary_host,
+                        primary_port);
+            }
+        }
+        sleep(1);
+    }
+    return NULL;
+}
+
+void repl_start_replica(const char *primary) {
+    int err;
+    const char *colon = strrchr(primary, ':');
+    if (colon == NULL || colon == primary || colon[1] == '\0' ||
+        (size_t)(colon - primary) >= sizeof(primary_host) ||
+        strlen(colon + 1) >= sizeof(primary_port)) {
+        fprintf(stderr, "replica: expected host:port, got '%s'\n", primary);
+        exit(1);
+    }
+    memcpy(primary_host, primary, colon - primary);
+    primary_host[colon - primary] = '\0';
+    snprintf(primary_port, sizeof(primary_port), "%s", colon + 1);
+
+    is_replica = 1;
+    if ((err = pthread_create(&replica_thread, 0, replica_main, NULL)))
+        handle_error_en(err, "pthread_create");
+}
+
+int repl_is_replica(void) { return is_replica; }
+
+void repl_stop(void) {
+    int err;
+    if (is_replica) {
+        if ((err = pthread_cancel(replica_thread)))
+            handle_error_en(err, "pthread_cancel");
+        if ((err = pthread_join(replica_thread, 0)))
+            handle_error_en(err, "pthread_join");
+    }
+    pthread_mutex_lock(&log_mutex);
+    free(log_ring);
+    log_ring = NULL;
+    pthread_mutex_unlock(&log_mutex);
+}
+
+//------------------------------------------------------------------------------------------------
+// Statistics
+
+void repl_stats(char *buf, int len) {
+    pthread_mutex_lock(&log_mutex);
+    unsigned long seq = next_seq - 1;
+    int replicas = log_replicas;
+    pthread_mutex_unlock(&log_mutex);
+
+    if (!is_replica) {
+        snprintf(buf, len, "repl role=primary seq=%lu replicas=%d", seq,
+                 replicas);
+        return;
+    }
+
+    pthread_mutex_lock(&stat_mutex);
+    snprintf(buf, len,
+             "repl role=replica primary=%s:%s state=%s applied_seq=%lu "
+             "primary_seq=%lu lag_ops=%lu lag_ms=%ld last_contact_ms=%ld "
+             "snapshots=%lu apply_failures=%lu",
+             primary_host, primary_port, state_names[replica_state],
+             applied_seq, primary_seq, primary_seq - applied_seq,
+             apply_delay_ms, last_contact_ms ? now_ms() - last_contact_ms : -1,
+             snapshots, apply_failures);
+    pthread_mutex_unlock(&stat_mutex);
+}
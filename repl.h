@@ -0,0 +1,67 @@
+#ifndef REPL_H_
+#define REPL_H_
+
+#include <stdio.h>
+
+/*
+ * Primary/replica log shipping. Every server can act as a primary: a replica
+ * connects to its normal port and sends `R`, after which that connection
+ * carries a snapshot of the tree followed by the stream of mutations applied
+ * after it. A server started with `-r host:port` is a read-only replica that
+ * applies the stream asynchronously and serves `q` locally.
+ *
+ * Wire format, primary to replica, one record per line:
+ *  S <seq>                  start of a snapshot taken at log position seq
+ *  a <key> <value>          one snapshot entry
+ *  E                        end of snapshot
+ *  L <seq> <ms> <command>   mutation seq, applied on the primary at time ms;
+ *                           command is `a key value`, `d key` or `w key value`
+ *                           (set, which every kind of update is logged as)
+ *  H <seq> <ms>             heartbeat carrying the primary's latest seq
+ *  X                        replica fell too far behind and must resync
+ */
+
+#define REPL_LOG_ENTRIES 16384  // mutations a replica may lag before resync
+#define REPL_HEARTBEAT_MS 1000
+#define REPL_TIMEOUT_S 5  // replica reconnects after this long without data
+
+/**
+ * repl_log() records a mutation for connected replicas. It must be called
+ * while the caller still holds the write lock that orders the mutation against
+ * other writers of the same key, so that the log order matches the tree. It
+ * returns immediately when no replica is connected.
+ */
+void repl_log(char op, const char *key, const char *value);
+
+/**
+ * repl_serve_replica() turns a client connection that sent `R` into a
+ * replication stream. It returns once the replica disconnects or falls too far
+ * behind.
+ */
+void repl_serve_replica(FILE *cxstr);
+
+/**
+ * repl_start_replica() makes this server a read-only replica of primary, given
+ * as host:port, and starts the thread that follows its stream.
+ */
+void repl_start_replica(const char *primary);
+
+/**
+ * repl_is_replica() returns 1 if this server follows a primary.
+ */
+int repl_is_replica(void);
+
+/**
+ * repl_stop() cancels and joins the replica thread, if any. Must be called
+ * before db_cleanup().
+ */
+void repl_stop(void);
+
+/**
+ * repl_stats() writes a one-line summary of this server's role, log position
+ * and, on a replica, its lag behind the primary and how many of the
+ * primary's writes it refused (under its own memory limit) into buf.
+ */
+void repl_stats(char *buf, int len);
+
+#endif  // REPL_H_
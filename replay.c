@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./dbclient.h"
+
+#define BUFSIZE 1024
+#define REPLAY_WINDOW 32  // commands in flight per connection with -f
+#define POLL_CHUNK 64     // connections handed to one dbc_poll_many()
+
+/*
+ * Replays a capture written by the server's -w option (see capture.h). Each
+ * captured connection gets a connection of its own, and its commands are sent
+ * in their original order. By default every command is sent at its original
+ * offset from the start of the capture, scaled by -s; with -f commands are
+ * sent as fast as the server answers them. Latency is measured from sending
+ * a command to receiving its response.
+ */
+
+typedef struct record {
+    int conn;      // index into conns
+    double when;   // seconds after the start of the capture
+    char *command;
+    double sent;   // when it was sent, in seconds since the replay started
+    double latency;
+    int status;
+} record_t;
+
+record_t *records;
+int nrecords;
+dbc_conn_t **conns;  // by captured connection, NULL until first used
+int nconns;
+dbc_conn_t **live;  // the connections opened so far
+int nlive;
+int completed;
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double start;
+
+void response_cb(void *arg, int status, const char *response) {
+    (void)response;
+    record_t *r = arg;
+    r->latency = now() - start - r->sent;
+    r->status = status;
+    completed++;
+}
+
+/*
+ * Reads the capture into records, numbering connections in order of first
+ * appearance. Commands that only make sense to a live server (`R` and `M`,
+ * which switch a connection's protocol) are left out.
+ */
+void load(const char *filename) {
+    FILE *in;
+    if ((in = fopen(filename, "r")) == NULL) {
+        perror(filename);
+        exit(1);
+    }
+
+    unsigned long *ids = NULL;  // capture connection id of each conn
+    int cap = 0;
+    char line[BUFSIZE];
+    while (fgets(line, sizeof(line), in) != NULL) {
+        unsigned long id, us;
+        int off;
+        if (sscanf(line, "%lu %lu %n", &id, &us, &off) < 2) continue;
+        char *command = line + off;
+        command[strcspn(command, "\n")] = '\0';
+        if (command[0] == 'R' || command[0] == 'M') continue;
+
+        int conn = nconns - 1;
+        while (conn >= 0 && ids[conn] != id) conn--;
+        if (conn < 0) {
+            ids = realloc(ids, (nconns + 1) * sizeof(unsigned long));
+            conns = realloc(conns, (nconns + 1) * sizeof(dbc_conn_t *));
+            if (ids == NULL || conns == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            ids[nconns] = id;
+            conns[nconns] = NULL;
+            conn = nconns++;
+        }
+
+        if (nrecords == cap) {
+            cap = cap ? 2 * cap : 1024;
+            if ((records = realloc(records, cap * sizeof(record_t))) == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        record_t *r = &records[nrecords++];
+        memset(r, 0, sizeof(*r));
+        r->conn = conn;
+        r->when = us / 1e6;
+        if ((r->command = strdup(command)) == NULL) {
+            perror("strdup");
+            exit(1);
+        }
+    }
+    free(ids);
+    fclose(in);
+
+    // the capture starts with the server; the replay starts with its first
+    // command
+    for (int i = nrecords - 1; i >= 0; i--) records[i].when -= records[0].when;
+}
+
+int compare_latency(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+void report(double elapsed) {
+    double *lat = malloc((nrecords + 1) * sizeof(double));
+    int n = 0;
+    int failed = 0;
+    double sum = 0;
+    for (int i = 0; i < nrecords; i++) {
+        if (records[i].status != DBC_OK) {
+            failed++;
+            continue;
+        }
+        lat[n++] = records[i].latency * 1e6;
+        sum += records[i].latency * 1e6;
+    }
+    qsort(lat, n, sizeof(double), compare_latency);
+
+    printf("replayed %d commands over %d connections in %.3fs (%.0f ops/s)\n",
+           nrecords, nconns, elapsed, nrecords / elapsed);
+    if (failed) printf("%d commands failed\n", failed);
+    if (n > 0)
+        printf("latency us: mean %.1f p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+               sum / n, lat[n / 2], lat[n * 9 / 10], lat[n * 99 / 100],
+               lat[n - 1]);
+    free(lat);
+}
+
+/*
+ * Prints a usage tip.
+ */
+void usage_error(const char *cmd) {
+    fprintf(stderr,
+            "Usage: %s [-f] [-s speed] <servername> <port> <capture>\n"
+            "  -f        send as fast as possible instead of on schedule\n"
+            "  -s speed  replay the schedule speed times faster\n",
+            cmd);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int fast = 0;
+    double speed = 1.0;
+    int opt;
+    while ((opt = getopt(argc, argv, "fs:")) != -1) {
+        switch (opt) {
+            case 'f':
+                fast = 1;
+                break;
+            case 's':
+                if ((speed = atof(optarg)) <= 0) usage_error(argv[0]);
+                break;
+            default:
+                usage_error(argv[0]);
+        }
+    }
+    if (optind != argc - 3) usage_error(argv[0]);
+    const char *server = argv[optind];
+    const char *port = argv[optind + 1];
+
+    load(argv[optind + 2]);
+    if (nrecords == 0) {
+        fprintf(stderr, "nothing to replay\n");
+        return 1;
+    }
+    if ((live = malloc(nconns * sizeof(dbc_conn_t *))) == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    start = now();
+    int next = 0;
+    while (completed < nrecords) {
+        // send everything that is due, in capture order
+        double elapsed = now() - start;
+        while (next < nrecords) {
+            record_t *r = &records[next];
+            if (!fast && r->when / speed > elapsed) break;
+            if (conns[r->conn] == NULL) {
+                if ((conns[r->conn] = dbc_connect(server, port)) == NULL) {
+                    fprintf(stderr, "Failed to connect to '%s'!\n", server);
+                    return 1;
+                }
+                live[nlive++] = conns[r->conn];
+            }
+            if (fast && dbc_pending(conns[r->conn]) >= REPLAY_WINDOW) break;
+
+            r->sent = elapsed;
+            if (dbc_send(conns[r->conn], r->command, response_cb, r) < 0) {
+                r->status = DBC_ECLOSED;
+                completed++;
+            }
+            next++;
+        }
+
+        // wait for responses, but no longer than until the next send is due
+        int timeout = -1;
+        if (next < nrecords && !fast) {
+            double wait = records[next].when / speed - (now() - start);
+            timeout = wait > 0 ? (int)(wait * 1000) : 0;
+        }
+        if (nlive > POLL_CHUNK) timeout = 0;  // cannot block on one chunk
+        for (int i = 0; i < nlive; i += POLL_CHUNK) {
+            int n = nlive - i < POLL_CHUNK ? nlive - i : POLL_CHUNK;
+            dbc_poll_many(&live[i], n, timeout);
+        }
+    }
+    double elapsed = now() - start;
+
+    for (int i = 0; i < nlive; i++) dbc_close(live[i]);
+    report(elapsed);
+    for (int i = 0; i < nrecords; i++) free(records[i].command);
+    free(records);
+    free(conns);
+    free(live);
+    return 0;
+}
@@ -0,0 +1,182 @@
+#define _GNU_SOURCE  // memfd_create, POLLRDHUP
+#include <errno.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./ring.h"
+
+#define RING_SPINS 1000  // checks before a side goes to sleep
+
+static int spins = -1;  // RING_SPINS, or 0 when the other side cannot be
+                        // running at the same time anyway
+
+static void futex_wait(uint32_t *addr, uint32_t val, int timeout_ms) {
+    struct timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout_ms < 0 ? NULL : &ts,
+            NULL, 0);
+}
+
+static void futex_wake(uint32_t *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/*
+ * Waits until *word differs from val, first by spinning and then by sleeping
+ * on the futex. *waiting is raised while asleep so that the other side knows
+ * to wake us; the sequentially consistent store and load on either side make
+ * sure that one of them sees the other. Returns 0 once *word has changed and
+ * RING_TIMEOUT otherwise.
+ */
+static int wait_change(uint32_t *word, uint32_t val, uint32_t *waiting,
+                       int timeout_ms) {
+    if (spins < 0) spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? RING_SPINS : 0;
+    for (int i = 0; i < spins; i++)
+        if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != val) return 0;
+
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(word, __ATOMIC_SEQ_CST) == val)
+        futex_wait(word, val, timeout_ms);
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    return __atomic_load_n(word, __ATOMIC_ACQUIRE) != val ? 0 : RING_TIMEOUT;
+}
+
+/* Wakes the other side if it flagged itself asleep on word. */
+static void notify(uint32_t *word, uint32_t *waiting) {
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) futex_wake(word);
+}
+
+//------------------------------------------------------------------------------------------------
+// Setup
+
+ring_pair_t *ring_create(int *fd) {
+    int mfd;
+    if ((mfd = memfd_create("db-ring", MFD_CLOEXEC)) < 0) {
+        perror("memfd_create");
+        return NULL;
+    }
+    if (ftruncate(mfd, sizeof(ring_pair_t)) < 0) {
+        perror("ftruncate");
+        close(mfd);
+        return NULL;
+    }
+    ring_pair_t *rings;
+    if ((rings = ring_map(mfd)) == NULL) {
+        close(mfd);
+        return NULL;
+    }
+    *fd = mfd;
+    return rings;
+}
+
+ring_pair_t *ring_map(int fd) {
+    void *p = mmap(NULL, sizeof(ring_pair_t), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    return p;
+}
+
+void ring_unmap(ring_pair_t *rings) {
+    if (munmap(rings, sizeof(ring_pair_t)) < 0) perror("munmap");
+}
+
+//------------------------------------------------------------------------------------------------
+// Pushing and popping lines
+
+int ring_push(ring_t *ring, const char *line, int timeout_ms) {
+    uint32_t head = ring->head;  // only we write it
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    while (head - tail == RING_SLOTS) {
+        if (wait_change(&ring->tail, tail, &ring->space_waiting, timeout_ms))
+            return RING_TIMEOUT;
+        tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    }
+
+    snprintf(ring->slot[head % RING_SLOTS], RING_LINE, "%s", line);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+    notify(&ring->head, &ring->data_waiting);
+    return RING_OK;
+}
+
+int ring_pop(ring_t *ring, char *buf, size_t len, int timeout_ms) {
+    uint32_t tail = ring->tail;  // only we write it
+    if (wait_change(&ring->head, tail, &ring->data_waiting, timeout_ms))
+        return RING_TIMEOUT;
+
+    // the other side can write the slot, so it is copied once and read no
+    // further than its end
+    char line[RING_LINE];
+    memcpy(line, ring->slot[tail % RING_SLOTS], RING_LINE);
+    int ret = memchr(line, '\0', RING_LINE) != NULL ? RING_OK : RING_ILLFORMED;
+    if (ret == RING_OK) snprintf(buf, len, "%s", line);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+    notify(&ring->tail, &ring->space_waiting);
+    return ret;
+}
+
+//------------------------------------------------------------------------------------------------
+// Handing the ring over the Unix socket
+
+int ring_send_fd(int sock, int fd) {
+    char byte = 'M';
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+int ring_recv_fd(int sock) {
+    char byte;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    if (n != 1) return -1;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS)
+        return -1;
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+int ring_peer_gone(int sock) {
+    struct pollfd pfd = {sock, POLLIN | POLLRDHUP, 0};
+    if (poll(&pfd, 1, 0) <= 0) return 0;
+    if (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR)) return 1;
+
+    char byte;
+    return recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
@@ -0,0 +1,89 @@
+#ifndef RING_H_
+#define RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Shared-memory transport for clients on the same host as the server. A
+ * client connects to the server's Unix socket and sends `M`; the server
+ * answers with a memfd, passed with SCM_RIGHTS, holding a ring_pair_t. From
+ * then on commands travel through the request ring and responses through the
+ * response ring, one line per slot, and the socket is only kept open so that
+ * each side notices when the other goes away.
+ *
+ * Each ring has exactly one producer and one consumer. A side that finds its
+ * ring empty (or full) spins briefly and then sleeps on a futex; the other
+ * side only makes the wake-up system call when the sleeper has flagged
+ * itself, so a busy connection runs without system calls.
+ */
+
+#define RING_SLOTS 64
+#define RING_LINE 256  // longest line, matching the server's BUFLEN
+
+#define RING_OK 0
+#define RING_TIMEOUT -1
+#define RING_ILLFORMED -2  // a slot with no terminator, see ring_pop()
+
+typedef struct ring {
+    uint32_t head;           // lines pushed so far, written by the producer
+    uint32_t tail;           // lines popped so far, written by the consumer
+    uint32_t data_waiting;   // the consumer sleeps on head
+    uint32_t space_waiting;  // the producer sleeps on tail
+    char slot[RING_SLOTS][RING_LINE];
+} ring_t;
+
+typedef struct ring_pair {
+    ring_t req;   // client to server
+    ring_t resp;  // server to client
+} ring_pair_t;
+
+/**
+ * ring_create() allocates a zeroed ring_pair_t in a new memfd, maps it and
+ * stores the memfd in *fd. Returns NULL on failure.
+ */
+ring_pair_t *ring_create(int *fd);
+
+/**
+ * ring_map() maps the ring_pair_t in a memfd received from the server.
+ * Returns NULL on failure.
+ */
+ring_pair_t *ring_map(int fd);
+
+/**
+ * ring_unmap() unmaps a ring_pair_t mapped by ring_create() or ring_map().
+ */
+void ring_unmap(ring_pair_t *rings);
+
+/**
+ * ring_push() copies line (without a trailing newline) into the next slot,
+ * waiting up to timeout_ms for space. Returns RING_OK or RING_TIMEOUT.
+ */
+int ring_push(ring_t *ring, const char *line, int timeout_ms);
+
+/**
+ * ring_pop() copies the oldest line into buf, waiting up to timeout_ms for
+ * one to arrive. Returns RING_OK or RING_TIMEOUT, or RING_ILLFORMED if the
+ * line fills its slot with no terminator, in which case it is dropped and
+ * buf left alone.
+ */
+int ring_pop(ring_t *ring, char *buf, size_t len, int timeout_ms);
+
+/**
+ * ring_send_fd() sends fd over the Unix socket sock along with one byte.
+ * Returns 0 on success and -1 on failure.
+ */
+int ring_send_fd(int sock, int fd);
+
+/**
+ * ring_recv_fd() receives a descriptor sent by ring_send_fd(). Returns it, or
+ * -1 if the peer sent something else or the socket failed.
+ */
+int ring_recv_fd(int sock);
+
+/**
+ * ring_peer_gone() returns 1 if the other end of sock has closed it.
+ */
+int ring_peer_gone(int sock);
+
+#endif  // RING_H_
@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
@@ -13,38 +14,184 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "./bloom.h"
+#include "./cache.h"
+#include "./capture.h"
 #include "./comm.h"
 #include "./db.h"
+#include "./handoff.h"
+#include "./hot.h"
+#include "./part.h"
+#include "./repl.h"
 #include "./server.h"
+#include "./trace.h"
+#include "./vindex.h"
+#include "./watch.h"
 
 client_t *thread_list_head;
 pthread_mutex_t thread_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 client_control_t client_control = {PTHREAD_MUTEX_INITIALIZER,
                                    PTHREAD_COND_INITIALIZER, 1};
 server_control_t server_control = {PTHREAD_MUTEX_INITIALIZER,
-                                   PTHREAD_COND_INITIALIZER, 0};
+                                   PTHREAD_COND_INITIALIZER, 0, 0};
 // struct server_accept_control indicates whether the server will accept clients
 // 0 is not accepting, 1 is accepting
 server_accept_control_t server_accept_control = {PTHREAD_MUTEX_INITIALIZER, 1};
 
+// Set by -S. A skip list logs concurrent changes to one key in no particular
+// order, which a replica replaying them could not converge from.
+static int skiplist;
+
+// The hand-off to a new server (see handoff.h), once one has asked for it
+static struct {
+    pthread_mutex_t mutex;
+    int sock;      // the new server, while clients are being passed to it
+    int passed;    // clients passed so far
+    int finished;  // everything was passed, so this server should go
+    int done[2];   // a pipe that wakes the console once finished
+} handoff = {PTHREAD_MUTEX_INITIALIZER, -1, 0, 0, {-1, -1}};
+
+//------------------------------------------------------------------------------------------------
+// Handing off to a new server
+
+/* Passes client's connection on to the server taking over, once its thread
+   has stopped at a command boundary. The thread then exits as usual, which
+   closes only our own copies. */
+static void pass_client(client_t *client) {
+    int fds[2] = {fileno(client->cxstr), -1};
+    int nfds = 1;
+    if (client->ring != NULL) fds[nfds++] = comm_ring_fd(client->ring);
+
+    pthread_mutex_lock(&handoff.mutex);
+    if (handoff.sock >= 0 &&
+        handoff_send(handoff.sock, client->ring != NULL ? 'M' : 'C', fds,
+                     nfds) == 0)
+        handoff.passed++;
+    pthread_mutex_unlock(&handoff.mutex);
+}
+
+/* Waits up to HANDOFF_TIMEOUT_MS for every client thread but self to pass its
+   client on or to be streaming, then cancels whatever is left, so that
+   nothing can change the tree once the snapshot is taken. Replicas and
+   subscribers are disconnected that way too; a replica reconnects to the new
+   server on its own. */
+static void wait_for_clients(client_t *self) {
+    int err;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += HANDOFF_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (HANDOFF_TIMEOUT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&server_control.server_mutex);
+    while (server_control.num_client_threads - server_control.num_streaming >
+               1 &&
+           pthread_cond_timedwait(&server_control.server_cond,
+                                  &server_control.server_mutex,
+                                  &deadline) != ETIMEDOUT)
+        ;
+    pthread_mutex_unlock(&server_control.server_mutex);
+
+    pthread_mutex_lock(&thread_list_mutex);
+    for (client_t *cur = thread_list_head; cur != NULL; cur = cur->next)
+        if (cur != self && (err = pthread_cancel(cur->thread)))
+            handle_error_en(err, "pthread_cancel");
+    pthread_mutex_unlock(&thread_list_mutex);
+
+    pthread_mutex_lock(&server_control.server_mutex);
+    while (server_control.num_client_threads > 1)
+        if ((err = pthread_cond_wait(&server_control.server_cond,
+                                     &server_control.server_mutex)))
+            handle_error_en(err, "pthread_cond_wait");
+    pthread_mutex_unlock(&server_control.server_mutex);
+}
+
+/* Hands this server off to the new one that sent HANDOFF_REQUEST on self's
+   connection (see handoff.h). Once everything is passed the console is woken
+   to shut this server down. Should the new server go away first, this one
+   carries on, without the clients already passed. */
+static void hand_off(client_t *self) {
+    int sock = fileno(self->cxstr);
+    int socks[COMM_MAX_LISTENERS];
+    int unix_fd;
+    int fd;
+    int oldstate;
+    const char *refused = NULL;
+
+    pthread_mutex_lock(&handoff.mutex);
+    if (!handoff_peer_ok(sock))
+        refused = "hand-off refused";
+    else if (handoff.sock >= 0 || handoff.finished)
+        refused = "hand-off already under way";
+    else
+        handoff.sock = sock;
+    pthread_mutex_unlock(&handoff.mutex);
+    if (refused != NULL) {
+        if (fprintf(self->cxstr, "%s\n", refused) >= 0) fflush(self->cxstr);
+        return;
+    }
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    comm_stop_accepting();
+    int n = comm_listener_fds(socks, &unix_fd);
+    int ok = 1;
+    for (int i = 0; ok && i < n; i++)
+        ok = handoff_send(sock, 'L', &socks[i], 1) == 0;
+    if (ok && unix_fd >= 0) ok = handoff_send(sock, 'U', &unix_fd, 1) == 0;
+
+    int begun = ok;
+    if (ok) {
+        comm_handoff_begin();
+        wait_for_clients(self);
+        if ((fd = handoff_snapshot()) < 0) {
+            ok = 0;
+        } else {
+            ok = handoff_send(sock, 'D', &fd, 1) == 0;
+            if (close(fd) < 0) perror("close");
+        }
+    }
+
+    // the new server acknowledges once it has loaded the snapshot
+    char ack;
+    pthread_mutex_lock(&handoff.mutex);
+    if (ok)
+        ok = handoff_send(sock, 'E', NULL, 0) == 0 &&
+             read(sock, &ack, 1) == 1 && ack == 'A';
+    int passed = handoff.passed;
+    handoff.sock = -1;
+    handoff.passed = 0;
+    __atomic_store_n(&handoff.finished, ok, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&handoff.mutex);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (ok) {
+        fprintf(stderr, "handed off %d client%s in %ld ms\n", passed,
+                passed == 1 ? "" : "s",
+                (end.tv_sec - start.tv_sec) * 1000L +
+                    (end.tv_nsec - start.tv_nsec) / 1000000L);
+        if (write(handoff.done[1], "h", 1) != 1) perror("write");
+    } else {
+        fprintf(stderr, "hand-off failed after %d client%s, carrying on\n",
+                passed, passed == 1 ? "" : "s");
+        if (begun) comm_handoff_end();
+        comm_resume_accepting();
+    }
+    pthread_setcancelstate(oldstate, NULL);
+}
+
 //------------------------------------------------------------------------------------------------
 // Client threads' constructor and main method
 
-// Called by listener (in comm.c) to create a new client thread
-void client_constructor(FILE *cxstr) {
-    /*
-     * TODO:
-     * Part 1A:
-     *  You should create a new client_t struct (see server.h) here and
-     * initialize ALL of its fields. Remember that these initializations should
-     * be error-checked.
-     *
-     *  Step 1. Allocate memory for a new client and set its connection stream
-     *          to the input argument.
-     *  Step 2. Initialize the client's list-related fields to a reasonable
-     * default. Step 3. Create the new client thread running the `run_client`
-     * routine. Step 4. Detach the new client thread.
-     */
+/* Starts a thread serving cxstr, through ring if the client uses one. The
+   thread is counted from here rather than once it runs, so that a hand-off
+   that has stopped the accept threads knows of every client it must wait
+   for. */
+static void start_client(FILE *cxstr, comm_ring_t *ring) {
     int err;
     client_t *client;
     if ((client = malloc(sizeof(client_t))) == NULL) {
@@ -54,18 +201,71 @@ void client_constructor(FILE *cxstr) {
     if (cxstr == NULL) {
         fprintf(stderr, "Client Constructor: not a valid file\n");
     }
+    static unsigned long next_id;
+    client->id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
     client->cxstr = cxstr;
+    client->txn = NULL;
+    client->ring = ring;
+    client->streaming = 0;
     client->next = NULL;
     client->prev = NULL;
     client->thread = 0;
-    if ((err = pthread_create(&client->thread, 0, &run_client, client))) {
+    pthread_mutex_lock(&server_control.server_mutex);
+    server_control.num_client_threads++;
+    pthread_mutex_unlock(&server_control.server_mutex);
+    // client may be gone by the time pthread_create() returns, so the thread
+    // fills in client->thread itself
+    pthread_t thread;
+    if ((err = pthread_create(&thread, 0, &run_client, client))) {
         handle_error_en(err, "pthread_create");
     }
-    if ((err = pthread_detach(client->thread))) {
+    if ((err = pthread_detach(thread))) {
         handle_error_en(err, "pthread_detach");
     }
 }
 
+/* Counts a client thread out, waking the main thread once none are left and a
+   hand-off waiting for the others whenever one goes. */
+static void count_out(int streaming) {
+    int err;
+    pthread_mutex_lock(&server_control.server_mutex);
+    server_control.num_client_threads--;
+    if (streaming) server_control.num_streaming--;
+    if ((err = pthread_cond_broadcast(&server_control.server_cond)))
+        handle_error_en(err, "pthread_cond_broadcast");
+    pthread_mutex_unlock(&server_control.server_mutex);
+}
+
+/* Marks client as carrying a replication or notification stream from now on.
+   Such a client runs no more commands, so a hand-off does not wait for it. */
+static void start_streaming(client_t *client) {
+    int err;
+    pthread_mutex_lock(&server_control.server_mutex);
+    client->streaming = 1;
+    server_control.num_streaming++;
+    if ((err = pthread_cond_broadcast(&server_control.server_cond)))
+        handle_error_en(err, "pthread_cond_broadcast");
+    pthread_mutex_unlock(&server_control.server_mutex);
+}
+
+// Called by listener (in comm.c) to create a new client thread
+void client_constructor(FILE *cxstr) {
+    /*
+     * TODO:
+     * Part 1A:
+     *  You should create a new client_t struct (see server.h) here and
+     * initialize ALL of its fields. Remember that these initializations should
+     * be error-checked.
+     *
+     *  Step 1. Allocate memory for a new client and set its connection stream
+     *          to the input argument.
+     *  Step 2. Initialize the client's list-related fields to a reasonable
+     * default. Step 3. Create the new client thread running the `run_client`
+     * routine. Step 4. Detach the new client thread.
+     */
+    start_client(cxstr, NULL);
+}
+
 // Code executed by a client thread
 void *run_client(void *arg) {
     /*
@@ -91,10 +291,13 @@ void *run_client(void *arg) {
      * destroy the passed-in client and return.
      */
     client_t *client = arg;
+    client->thread = pthread_self();
     if (server_accept_control.accepting == 0) {
         client_destructor(client);
+        count_out(0);
         return (void *)-1;
     }
+    comm_log_peer(client->cxstr);
 
     char response[BUFLEN];
     char command[BUFLEN];
@@ -113,16 +316,60 @@ void *run_client(void *arg) {
 
     pthread_cleanup_push((void *)&thread_cleanup, client);
     pthread_mutex_unlock(&thread_list_mutex);
-    pthread_mutex_lock(&server_control.server_mutex);
-    server_control.num_client_threads++;
-    pthread_mutex_unlock(&server_control.server_mutex);
-    while (comm_serve(client->cxstr, response, command) == 0) {
+    // a client in the middle of a transaction is passed on once it ends
+    int ret;
+    while ((ret = client->ring != NULL
+                      ? comm_ring_serve(client->ring, response, command,
+                                        client->txn == NULL)
+                      : comm_serve(client->cxstr, response, command,
+                                   client->txn == NULL)) == 0) {
+        capture_record(client->id, command);
+        uint64_t t = trace_start();
         client_control_wait();
-        interpret_command(command, response, BUFLEN);
+        trace_end("gate", t);
+        if (command[0] == 'R' && client->ring == NULL) {
+            // a replica: this connection now carries the replication stream
+            start_streaming(client);
+            if (skiplist) {
+                if (fprintf(client->cxstr, "not supported\n") >= 0)
+                    fflush(client->cxstr);
+            } else {
+                repl_serve_replica(client->cxstr);
+            }
+            break;
+        }
+        if (command[0] == 'W' && client->ring == NULL) {
+            // a subscriber: this connection now carries its notifications
+            start_streaming(client);
+            watch_serve(client->cxstr, &command[1]);
+            break;
+        }
+        if (command[0] == 'U' && client->ring == NULL &&
+            strcmp(command, HANDOFF_REQUEST) == 0) {
+            // a new server taking over from this one
+            hand_off(client);
+            break;
+        }
+        if (command[0] == 'M' && client->ring == NULL) {
+            // switch to the shared-memory transport; the ring itself is the
+            // acknowledgement
+            if ((client->ring = comm_ring_accept(client->cxstr)) == NULL)
+                snprintf(response, BUFLEN, "shared memory unavailable");
+            else
+                response[0] = '\0';
+            continue;
+        }
+        t = trace_start();
+        if (command[0] == 'B' || client->txn != NULL)
+            interpret_txn_command(&client->txn, command, response, BUFLEN);
+        else
+            interpret_command(command, response, BUFLEN);
+        trace_end("execute", t);
     }
     int err;
     if ((err = pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, 0)))
         handle_error_en(err, "pthread_setcancelstate");
+    if (ret == COMM_HANDOFF) pass_client(client);
     pthread_cleanup_pop(1);
     return NULL;
 }
@@ -136,7 +383,9 @@ void client_destructor(client_t *client) {
      * Part 1A: Free and close all resources associated with a client.
      * (Take a look at `comm_shutdown` in comm.c)
      */
+    if (client->ring != NULL) comm_ring_shutdown(client->ring);
     comm_shutdown(client->cxstr);
+    db_txn_free(client->txn);
     free(client);
 }
 
@@ -151,13 +400,12 @@ void thread_cleanup(void *arg) {
      * routine is ever run. Be sure to protect access to the client list using
      * `thread_list_mutex`.
      */
-    int err;
     pthread_mutex_lock(&thread_list_mutex);
     client_t *client = arg;
     client_t *next = client->next;
     client_t *prev = client->prev;
     if (client == thread_list_head) {
-        thread_list_head = NULL;
+        thread_list_head = next;
     }
     if (next) {
         next->prev = prev;
@@ -167,14 +415,9 @@ void thread_cleanup(void *arg) {
     }
     pthread_mutex_unlock(&thread_list_mutex);
 
+    int streaming = client->streaming;
     client_destructor(client);
-
-    pthread_mutex_lock(&server_control.server_mutex);
-    server_control.num_client_threads--;
-    if (!server_control.num_client_threads)
-        if ((err = pthread_cond_broadcast(&server_control.server_cond)))
-            handle_error_en(err, "pthread_cond_broadcast");
-    pthread_mutex_unlock(&server_control.server_mutex);
+    count_out(streaming);
 }
 
 void delete_all() {
@@ -316,6 +559,124 @@ void sig_handler_destructor(sig_handler_t *sighandler) {
 //------------------------------------------------------------------------------------------------
 // Main function
 
+static void usage(char *cmd) {
+    fprintf(stderr,
+            "Usage: %s [-c cache_entries] [-b bloom_counters] "
+            "[-r primary_host:port] [-u socket_path] [-t trace_every] "
+            "[-w capture_file] [-l listeners] [-q backlog] [-P partitions] "
+            "[-v] [-m max_bytes] [-e] [-k string|int64|binary:len] "
+            "[-H hot_interval_ms] [-S] [-D] [-z] <port number>\n"
+            "       %s [options] -T socket_path, to take over from the server "
+            "listening on socket_path\n",
+            cmd, cmd);
+    exit(1);
+}
+
+/* Takes over from the server listening on the Unix socket at path (see
+   handoff.h): loads its data, then accepts on its listening sockets and
+   serves the clients it passed, all before any of them is heard from. */
+static void take_over(const char *path) {
+    int sock;
+    int fds[HANDOFF_MAX_FDS];
+    int nfds;
+    int socks[COMM_MAX_LISTENERS];
+    int nsocks = 0;
+    int unix_fd = -1;
+    FILE **conns = NULL;
+    comm_ring_t **rings = NULL;
+    int nconns = 0;
+    long keys = 0;
+    long total = 0;
+    char type;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((sock = handoff_connect(path)) < 0) {
+        perror(path);
+        exit(1);
+    }
+    while (1) {
+        if (handoff_recv(sock, &type, fds, &nfds) < 0) {
+            fprintf(stderr, "lost the server at %s during the hand-off\n",
+                    path);
+            exit(1);
+        }
+        if (type == 'E') break;
+        if (type == '\0' || strchr("LUCMD", type) == NULL || nfds == 0) {
+            char why[BUFLEN] = {type};
+            ssize_t len = read(sock, &why[1], BUFLEN - 2);
+            why[len > 0 ? len + 1 : 1] = '\0';
+            why[strcspn(why, "\n")] = '\0';
+            fprintf(stderr, "%s: %s\n", path, why);
+            exit(1);
+        }
+
+        switch (type) {
+            case 'L':
+                if (nsocks < COMM_MAX_LISTENERS) socks[nsocks++] = fds[0];
+                break;
+            case 'U':
+                unix_fd = fds[0];
+                break;
+            case 'D':
+                keys = handoff_load(fds[0], &total);
+                break;
+            default:  // C or M
+                if ((conns = realloc(conns, (nconns + 1) * sizeof(FILE *))) ==
+                        NULL ||
+                    (rings = realloc(rings, (nconns + 1) *
+                                                sizeof(comm_ring_t *))) ==
+                        NULL) {
+                    perror("realloc");
+                    exit(1);
+                }
+                rings[nconns] = NULL;
+                if ((conns[nconns] = fdopen(fds[0], "w+")) == NULL ||
+                    (type == 'M' && nfds == 2 &&
+                     (rings[nconns] = comm_ring_adopt(fds[0], fds[1])) ==
+                         NULL)) {
+                    perror("hand-off");
+                    if (conns[nconns] != NULL) comm_shutdown(conns[nconns]);
+                    break;
+                }
+                nconns++;
+        }
+    }
+    if (write(sock, "A", 1) != 1) {
+        perror("hand-off");
+        exit(1);
+    }
+    if (close(sock) < 0) perror("close");
+
+    comm_adopt_listeners(socks, nsocks, unix_fd, &client_constructor);
+    for (int i = 0; i < nconns; i++) start_client(conns[i], rings[i]);
+    free(conns);
+    free(rings);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(stderr,
+            "took over from %s: %d listener%s, %d client%s and %ld of %ld "
+            "keys in %ld ms\n",
+            path, nsocks, nsocks == 1 ? "" : "s", nconns,
+            nconns == 1 ? "" : "s", keys, total,
+            (end.tv_sec - start.tv_sec) * 1000L +
+                (end.tv_nsec - start.tv_nsec) / 1000000L);
+}
+
+/* Reads the next console command into buf, as read() does, except that it
+   returns 0, like the end of input, once this server has been handed off. */
+static ssize_t read_console(char *buf) {
+    struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0},
+                            {handoff.done[0], POLLIN, 0}};
+    while (poll(fds, 2, -1) < 0)
+        if (errno != EINTR) {
+            perror("poll");
+            return -1;
+        }
+    if (fds[1].revents != 0) return 0;
+    return read(STDIN_FILENO, buf, BUFLEN);
+}
+
 // The arguments to the server should be the port number.
 int main(int argc, char *argv[]) {
     /*
@@ -333,12 +694,136 @@ int main(int argc, char *argv[]) {
     sig_handler_t *sig_handler = sig_handler_constructor();
     if ((err = pthread_sigmask(SIG_BLOCK, &set, 0)) != 0)
         handle_error_en(err, "pthread_sigmask");
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port number>\n", argv[0]);
+    int opt;
+    size_t cache_entries = CACHE_DEFAULT_ENTRIES;
+    size_t bloom_counters = BLOOM_DEFAULT_COUNTERS;
+    char *primary = NULL;
+    char *socket_path = NULL;
+    int trace_interval = 0;
+    char *capture_path = NULL;
+    int listeners = 0;  // one per CPU
+    int backlog = 0;    // SOMAXCONN
+    int partitions = 0;
+    size_t max_bytes = 0;
+    int evict = 0;
+    size_t key_len;
+    int hot_interval = HOT_DEFAULT_INTERVAL;
+    int values = 0;
+    int tombstones = 0;
+    int compress = 0;
+    char *takeover = NULL;
+    while ((opt = getopt(argc, argv, "c:b:r:u:t:w:l:q:P:vm:ek:H:SDzT:")) !=
+           -1) {
+        switch (opt) {
+            case 'c':
+                cache_entries = (size_t)strtoul(optarg, 0, 10);
+                break;
+            case 'b':
+                bloom_counters = (size_t)strtoul(optarg, 0, 10);
+                break;
+            case 'r':
+                primary = optarg;
+                break;
+            case 'u':
+                socket_path = optarg;
+                break;
+            case 't':
+                trace_interval = (int)strtol(optarg, 0, 10);
+                break;
+            case 'w':
+                capture_path = optarg;
+                break;
+            case 'l':
+                listeners = (int)strtol(optarg, 0, 10);
+                break;
+            case 'q':
+                backlog = (int)strtol(optarg, 0, 10);
+                break;
+            case 'P':
+                partitions = (int)strtol(optarg, 0, 10);
+                break;
+            case 'v':
+                values = 1;
+                break;
+            case 'm':
+                max_bytes = (size_t)strtoull(optarg, 0, 10);
+                break;
+            case 'e':
+                evict = 1;
+                break;
+            case 'k':
+                if (strcmp(optarg, "int64") == 0) {
+                    db_key_type(KEY_INT64, 0);
+                } else if (sscanf(optarg, "binary:%zu", &key_len) == 1) {
+                    if (db_key_type(KEY_BINARY, key_len) < 0) usage(argv[0]);
+                } else if (strcmp(optarg, "string") != 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'H':
+                hot_interval = (int)strtol(optarg, 0, 10);
+                break;
+            case 'S':
+                skiplist = 1;
+                break;
+            case 'D':
+                tombstones = 1;
+                break;
+            case 'z':
+                compress = 1;
+                break;
+            case 'T':
+                takeover = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    // the port, listeners and Unix socket of a takeover are the old server's
+    if (optind != argc - (takeover == NULL)) usage(argv[0]);
+    if (takeover != NULL && socket_path != NULL) {
+        fprintf(stderr, "-u cannot be used with -T\n");
+        usage(argv[0]);
+    }
+    // everything here that needs the tree's locks
+    if (skiplist && (partitions > 0 || values || max_bytes > 0 || compress)) {
+        fprintf(stderr, "-S cannot be used with -P, -v, -m or -z\n");
+        usage(argv[0]);
+    }
+    if (tombstones && (skiplist || max_bytes > 0)) {
+        fprintf(stderr, "-D cannot be used with -S or -m\n");
+        usage(argv[0]);
+    }
+    int port = takeover == NULL ? (int)strtol(argv[optind], 0, 10) : 0;
+    if (skiplist) db_backend(DB_SKIPLIST);
+    if (compress) db_compress(1);
+    if (values) vindex_init();
+    cache_init(cache_entries);
+    bloom_init(bloom_counters);
+    db_mem_limit(max_bytes, evict);
+    trace_init(trace_interval);
+    hot_init(hot_interval);
+    part_init(partitions);
+    if (tombstones) db_tombstones(1);
+    if (capture_path != NULL && capture_open(capture_path) < 0) {
+        perror(capture_path);
+        exit(1);
+    }
+    if (pipe(handoff.done) < 0) {
+        perror("pipe");
         exit(1);
     }
-    int port = (int)strtol(argv[1], 0, 10);
-    pthread_t lThread = start_listener(port, &client_constructor);
+    // loaded before a replica starts following, which would clear it
+    if (takeover != NULL) {
+        take_over(takeover);
+        socket_path = takeover;
+    }
+    if (primary != NULL) repl_start_replica(primary);
+    if (takeover == NULL) {
+        start_listeners(port, listeners, backlog, &client_constructor);
+        if (socket_path != NULL)
+            start_unix_listener(socket_path, backlog, &client_constructor);
+    }
 
     /*
      * Part 3A: Before joining the listener thread, loop for command line input
@@ -347,7 +832,7 @@ int main(int argc, char *argv[]) {
     char buf[BUFLEN];
     memset(buf, 0, BUFLEN);
     ssize_t bytesRead;
-    while ((bytesRead = read(STDIN_FILENO, buf, BUFLEN)) > 0) {
+    while ((bytesRead = read_console(buf)) > 0) {
         if (buf[0] == 'p') {
             char *file = strtok(&buf[1], " \t\n");
             db_print(file);
@@ -357,6 +842,22 @@ int main(int argc, char *argv[]) {
                 perror("printf");
                 exit(0);
             }
+        } else if (buf[0] == 'i' || buf[0] == 'h') {
+            char response[BUFLEN];
+            interpret_command(buf, response, BUFLEN);
+            if (printf("%s\n", response) < 0) {
+                perror("printf");
+                exit(0);
+            }
+        } else if (buf[0] == 'T') {
+            char *file = strtok(&buf[1], " \t\n");
+            if (file == NULL) file = TRACE_FILE;
+            if (trace_dump(file) < 0)
+                perror("trace_dump");
+            else if (printf("Trace written to %s\n", file) < 0) {
+                perror("printf");
+                exit(0);
+            }
         } else if (buf[0] == 'g') {
             client_control_release();
             if (printf("All clients resumed\n") < 0) {
@@ -382,9 +883,12 @@ int main(int argc, char *argv[]) {
      * list is empty, cleanup the database, and then cancel and join with the
      * listener thread.
      */
-    if (bytesRead == EOF) {
+    if (bytesRead == 0) {
         server_accept_control.accepting = 0;
-        if (printf("Zero client connections, cleaning up database\n") < 0) {
+        if (printf("%s, cleaning up database\n",
+                   __atomic_load_n(&handoff.finished, __ATOMIC_SEQ_CST)
+                       ? "Handed off to the new server"
+                       : "Zero client connections") < 0) {
             perror("printf");
             exit(0);
         }
@@ -397,13 +901,24 @@ int main(int argc, char *argv[]) {
                               &server_control.server_mutex))
             handle_error_en(errno, "pthread_cond_wait");
     pthread_mutex_unlock(&server_control.server_mutex);
+    repl_stop();
+    watch_cleanup();
+    db_tombstones(0);
+    part_cleanup();
     db_cleanup();
+    cache_cleanup();
+    bloom_cleanup();
+    vindex_cleanup();
+    hot_cleanup();
+    trace_cleanup();
+    capture_close();
     if (printf("Database clean complete\n") < 0) {
         perror("printf");
         exit(0);
     }
-    if (pthread_cancel(lThread)) handle_error_en(errno, "pthread_cancel");
-    if (pthread_join(lThread, 0)) handle_error_en(errno, "pthread_join");
+    stop_listeners();
+    // the socket file now belongs to the server this one handed off to
+    if (socket_path != NULL && !handoff.finished) unlink(socket_path);
     if (pthread_mutex_destroy(&server_control.server_mutex))
         handle_error_en(errno, "pthread_mutex_destroy");
     if (pthread_cond_destroy(&server_control.server_cond))
@@ -9,6 +9,7 @@ typedef struct server_control {
     pthread_mutex_t server_mutex;
     pthread_cond_t server_cond;
     int num_client_threads;
+    int num_streaming;  // of those, replicas and subscribers (see run_client)
 } server_control_t;
 
 /*
@@ -35,7 +36,11 @@ typedef struct client_control {
  */
 typedef struct client {
     pthread_t thread;
-    FILE *cxstr;  // File stream for input and output
+    unsigned long id;   // Connection number, for workload capture
+    FILE *cxstr;        // File stream for input and output
+    comm_ring_t *ring;  // Shared-memory transport, once the client asks for it
+    db_txn_t *txn;      // Transaction opened with `B`, or NULL
+    int streaming;      // Serving a replica or subscriber, not commands
 
     // For client list
     struct client *prev;
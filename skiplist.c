@@ -0,0 +1,491 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./comm.h"
+#include "./skiplist.h"
+
+#define SL_RETIRE_BATCH 64  // retirements between tries to move the epoch on
+
+// What a retired allocation is, and so how it is freed
+#define RETIRED_NODE 0
+#define RETIRED_VALUE 1
+
+// States of a node, exchanged by its inserter once linked and its remover
+// once marked, so that the last of them knows to unlink and retire it
+#define NODE_LINKING 0
+#define NODE_LINKED 1
+#define NODE_REMOVED 2
+
+typedef struct retired {
+    struct retired *next;
+    int kind;
+} retired_t;
+
+typedef struct sl_value {
+    retired_t retired;
+    char text[];
+} sl_value_t;
+
+typedef struct sl_node {
+    retired_t retired;
+    const char *key;  // in the node's own allocation, after next
+    uint64_t kp;
+    sl_value_t *value;
+    int level;
+    int state;
+    struct sl_node *next[];  // low bit set once the node is removed
+} sl_node_t;
+
+// A thread's epoch and what it has retired. Records are only ever added to
+// the list; a thread that exits leaves its record to the next one to start.
+typedef struct ebr_thread {
+    unsigned long state;  // epoch << 1 | 1 while inside a call, else 0
+    int in_use;
+    retired_t *limbo[3];  // retired in limbo_epoch[i], i being that epoch % 3
+    unsigned long limbo_epoch[3];
+    unsigned long pending;  // retired since the last try to move the epoch
+    uint64_t seed;
+    // only written by the owner, summed by sl_stats()
+    unsigned long added;
+    unsigned long removed;
+    unsigned long retired;
+    unsigned long freed;
+    struct ebr_thread *next;
+} ebr_thread_t;
+
+static sl_node_t *head;
+static sl_compare_t compare;
+static unsigned long epoch = 1;
+static ebr_thread_t *threads;
+static pthread_key_t self_key;
+static __thread ebr_thread_t *self;
+
+static inline int is_marked(sl_node_t *p) { return ((uintptr_t)p & 1) != 0; }
+
+static inline sl_node_t *marked(sl_node_t *p) {
+    return (sl_node_t *)((uintptr_t)p | 1);
+}
+
+static inline sl_node_t *unmarked(sl_node_t *p) {
+    return (sl_node_t *)((uintptr_t)p & ~(uintptr_t)1);
+}
+
+static inline sl_node_t *next_of(sl_node_t *node, int i) {
+    return __atomic_load_n(&node->next[i], __ATOMIC_ACQUIRE);
+}
+
+static inline int cas_next(sl_node_t *node, int i, sl_node_t *old,
+                           sl_node_t *new) {
+    return __atomic_compare_exchange_n(&node->next[i], &old, new, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+//------------------------------------------------------------------------------------------------
+// Epochs
+
+/* Frees list, whose epoch has passed, into t's count. */
+static void free_retired(ebr_thread_t *t, retired_t *list) {
+    while (list != NULL) {
+        retired_t *next = list->next;
+        if (list->kind == RETIRED_NODE)
+            free(((sl_node_t *)list)->value);
+        free(list);
+        t->freed++;
+        list = next;
+    }
+}
+
+static void detach(void *arg) {
+    ebr_thread_t *t = arg;
+    __atomic_store_n(&t->state, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&t->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/* Takes a record no thread is using, or adds a new one. */
+static ebr_thread_t *attach(void) {
+    ebr_thread_t *t;
+    for (t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL;
+         t = t->next) {
+        int unused = 0;
+        if (__atomic_load_n(&t->in_use, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&t->in_use, &unused, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (t == NULL) {
+        if ((t = calloc(1, sizeof(ebr_thread_t))) == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        t->in_use = 1;
+        t->seed = (uintptr_t)t | 1;
+        t->next = __atomic_load_n(&threads, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&threads, &t->next, t, 0,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+            ;
+    }
+    int err;
+    if ((err = pthread_setspecific(self_key, t)))
+        handle_error_en(err, "pthread_setspecific");
+    return self = t;
+}
+
+/* Moves the epoch on if every thread inside a call has seen it. */
+static void try_advance(void) {
+    unsigned long e = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+    for (ebr_thread_t *t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE);
+         t != NULL; t = t->next) {
+        unsigned long s = __atomic_load_n(&t->state, __ATOMIC_SEQ_CST);
+        if ((s & 1) && (s >> 1) != e) return;
+    }
+    __atomic_compare_exchange_n(&epoch, &e, e + 1, 0, __ATOMIC_SEQ_CST,
+                                __ATOMIC_RELAXED);
+}
+
+/* Announces the calling thread inside the current epoch, and frees what it
+   retired two epochs or more before. */
+static ebr_thread_t *enter(void) {
+    ebr_thread_t *t = self != NULL ? self : attach();
+    unsigned long e = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+    while (1) {
+        __atomic_store_n(&t->state, e << 1 | 1, __ATOMIC_SEQ_CST);
+        unsigned long now = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+        if (now == e) break;
+        e = now;
+    }
+    for (int i = 0; i < 3; i++) {
+        if (t->limbo[i] != NULL && t->limbo_epoch[i] + 2 <= e) {
+            free_retired(t, t->limbo[i]);
+            t->limbo[i] = NULL;
+        }
+    }
+    return t;
+}
+
+static void leave(ebr_thread_t *t) {
+    __atomic_store_n(&t->state, 0, __ATOMIC_RELEASE);
+}
+
+/* Frees r, which can no longer be reached, once no call that could have seen
+   it is left. That is judged by the epoch now, not the one the caller
+   entered in: a call may have come in since the epoch moved on. */
+static void retire(ebr_thread_t *t, retired_t *r, int kind) {
+    unsigned long e = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+    int slot = e % 3;
+    if (t->limbo_epoch[slot] != e) {
+        // retired three epochs or more before, so long past
+        free_retired(t, t->limbo[slot]);
+        t->limbo[slot] = NULL;
+        t->limbo_epoch[slot] = e;
+    }
+    r->kind = kind;
+    r->next = t->limbo[slot];
+    t->limbo[slot] = r;
+    t->retired++;
+    if (++t->pending >= SL_RETIRE_BATCH) {
+        t->pending = 0;
+        try_advance();
+    }
+}
+
+//------------------------------------------------------------------------------------------------
+// Searching
+
+static inline int compare_node(const char *key, uint64_t kp, sl_node_t *node) {
+    return compare(key, kp, node->key, node->kp);
+}
+
+/* Fills preds and succs with the last node before key and the first node at
+   or after it on every level, unlinking every removed node on the way.
+   Passing target goes on past nodes with key until target itself, so that a
+   removed target is unlinked even from behind a newer node with its key.
+   Returns 1 if succs[0] holds key. */
+static int find(const char *key, uint64_t kp, sl_node_t *target,
+                sl_node_t **preds, sl_node_t **succs) {
+    sl_node_t *pred, *curr, *succ;
+retry:
+    pred = head;
+    for (int i = SL_MAX_LEVEL - 1; i >= 0; i--) {
+        curr = unmarked(next_of(pred, i));
+        while (curr != NULL) {
+            succ = next_of(curr, i);
+            if (is_marked(succ)) {
+                if (!cas_next(pred, i, curr, unmarked(succ))) goto retry;
+                curr = unmarked(succ);
+                continue;
+            }
+            int cmp = compare_node(key, kp, curr);
+            if (cmp < 0 || (cmp == 0 && (target == NULL || curr == target)))
+                break;
+            pred = curr;
+            curr = succ;
+        }
+        preds[i] = pred;
+        succs[i] = curr;
+    }
+    return succs[0] != NULL && compare_node(key, kp, succs[0]) == 0;
+}
+
+/* Returns the node holding key, or NULL, skipping over removed nodes without
+   unlinking them. */
+static sl_node_t *lookup(const char *key, uint64_t kp) {
+    sl_node_t *pred = head, *curr = NULL;
+    for (int i = SL_MAX_LEVEL - 1; i >= 0; i--) {
+        curr = unmarked(next_of(pred, i));
+        while (curr != NULL) {
+            sl_node_t *succ = next_of(curr, i);
+            if (is_marked(succ)) {
+                curr = unmarked(succ);
+                continue;
+            }
+            int cmp = compare_node(key, kp, curr);
+            if (cmp < 0) break;
+            if (cmp == 0) return curr;
+            pred = curr;
+            curr = succ;
+        }
+    }
+    return NULL;
+}
+
+/* Unlinks node, which is removed, from every level and retires it. */
+static void unlink_node(ebr_thread_t *t, sl_node_t *node) {
+    sl_node_t *preds[SL_MAX_LEVEL], *succs[SL_MAX_LEVEL];
+    find(node->key, node->kp, node, preds, succs);
+    retire(t, &node->retired, RETIRED_NODE);
+    t->removed++;
+}
+
+//------------------------------------------------------------------------------------------------
+// Operations
+
+void sl_init(sl_compare_t cmp) {
+    int err;
+    compare = cmp;
+    if ((head = calloc(1, sizeof(sl_node_t) +
+                              SL_MAX_LEVEL * sizeof(sl_node_t *))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    head->level = SL_MAX_LEVEL;
+    if ((err = pthread_key_create(&self_key, detach)))
+        handle_error_en(err, "pthread_key_create");
+}
+
+static sl_value_t *value_new(const char *text) {
+    size_t len = strlen(text) + 1;
+    sl_value_t *v;
+    if ((v = malloc(sizeof(sl_value_t) + len)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(v->text, text, len);
+    return v;
+}
+
+/* A level from 1 to SL_MAX_LEVEL, each one half as likely as the one below. */
+static int random_level(ebr_thread_t *t) {
+    t->seed ^= t->seed << 13;
+    t->seed ^= t->seed >> 7;
+    t->seed ^= t->seed << 17;
+    return 1 + __builtin_ctzll(t->seed | 1ULL << (SL_MAX_LEVEL - 1));
+}
+
+int sl_query(const char *key, uint64_t kp, char *result, int len) {
+    ebr_thread_t *t = enter();
+    sl_node_t *node = lookup(key, kp);
+    if (node != NULL)
+        snprintf(result, len, "%s",
+                 __atomic_load_n(&node->value, __ATOMIC_ACQUIRE)->text);
+    leave(t);
+    return node != NULL;
+}
+
+int sl_add(const char *key, uint64_t kp, const char *value) {
+    sl_node_t *preds[SL_MAX_LEVEL], *succs[SL_MAX_LEVEL];
+    sl_node_t *node = NULL;
+    ebr_thread_t *t = enter();
+
+    while (1) {
+        if (find(key, kp, NULL, preds, succs)) {
+            leave(t);
+            if (node != NULL) {
+                free(node->value);
+                free(node);
+            }
+            return 0;
+        }
+        if (node == NULL) {
+            int level = random_level(t);
+            size_t key_len = strlen(key) + 1;
+            if ((node = malloc(sizeof(sl_node_t) +
+                               level * sizeof(sl_node_t *) + key_len)) ==
+                NULL) {
+                perror("malloc");
+                exit(1);
+            }
+            node->key = memcpy(&node->next[level], key, key_len);
+            node->kp = kp;
+            node->value = value_new(value);
+            node->level = level;
+            node->state = NODE_LINKING;
+        }
+        for (int i = 0; i < node->level; i++) node->next[i] = succs[i];
+        // the key is in once linked on level 0
+        if (cas_next(preds[0], 0, succs[0], node)) break;
+    }
+    t->added++;
+
+    for (int i = 1; i < node->level; i++) {
+        while (1) {
+            sl_node_t *old = next_of(node, i);
+            if (is_marked(old)) goto linked;
+            if (old != succs[i] && !cas_next(node, i, old, succs[i]))
+                goto linked;  // removed in the meantime
+            if (cas_next(preds[i], i, succs[i], node)) break;
+            find(key, kp, NULL, preds, succs);
+            if (succs[0] != node) goto linked;
+        }
+    }
+linked:
+    if (__atomic_exchange_n(&node->state, NODE_LINKED, __ATOMIC_ACQ_REL) ==
+        NODE_REMOVED)
+        unlink_node(t, node);
+    leave(t);
+    return 1;
+}
+
+int sl_update(const char *key, uint64_t kp, const char *expected,
+              const char *value) {
+    ebr_thread_t *t = enter();
+    sl_node_t *node = lookup(key, kp);
+    if (node == NULL) {
+        leave(t);
+        return 0;
+    }
+    sl_value_t *new = value_new(value);
+    sl_value_t *old = __atomic_load_n(&node->value, __ATOMIC_ACQUIRE);
+    do {
+        if (expected != NULL && strcmp(old->text, expected) != 0) {
+            leave(t);
+            free(new);
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&node->value, &old, new, 0,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    retire(t, &old->retired, RETIRED_VALUE);
+    leave(t);
+    return 1;
+}
+
+int sl_remove(const char *key, uint64_t kp) {
+    sl_node_t *preds[SL_MAX_LEVEL], *succs[SL_MAX_LEVEL];
+    ebr_thread_t *t = enter();
+    if (!find(key, kp, NULL, preds, succs)) {
+        leave(t);
+        return 0;
+    }
+    sl_node_t *node = succs[0];
+    for (int i = node->level - 1; i >= 1; i--) {
+        sl_node_t *succ = next_of(node, i);
+        while (!is_marked(succ) && !cas_next(node, i, succ, marked(succ)))
+            succ = next_of(node, i);
+    }
+    // whoever marks level 0 removes the key
+    sl_node_t *succ = next_of(node, 0);
+    while (1) {
+        if (is_marked(succ)) {
+            leave(t);
+            return 0;
+        }
+        if (cas_next(node, 0, succ, marked(succ))) break;
+        succ = next_of(node, 0);
+    }
+    if (__atomic_exchange_n(&node->state, NODE_REMOVED, __ATOMIC_ACQ_REL) ==
+        NODE_LINKED)
+        unlink_node(t, node);
+    leave(t);
+    return 1;
+}
+
+void sl_walk(void (*fn)(const char *key, const char *value, void *arg),
+             void *arg) {
+    ebr_thread_t *t = enter();
+    for (sl_node_t *node = unmarked(next_of(head, 0)); node != NULL;) {
+        sl_node_t *next = next_of(node, 0);
+        if (!is_marked(next))
+            fn(node->key, __atomic_load_n(&node->value, __ATOMIC_ACQUIRE)->text,
+               arg);
+        node = unmarked(next);
+    }
+    leave(t);
+}
+
+void sl_clear(void) {
+    while (1) {
+        ebr_thread_t *t = enter();
+        sl_node_t *node = unmarked(next_of(head, 0));
+        while (node != NULL && is_marked(next_of(node, 0)))
+            node = unmarked(next_of(node, 0));
+        if (node == NULL) {
+            leave(t);
+            return;
+        }
+        char *key = strdup(node->key);
+        uint64_t kp = node->kp;
+        leave(t);
+        if (key == NULL) {
+            perror("strdup");
+            exit(1);
+        }
+        sl_remove(key, kp);
+        free(key);
+    }
+}
+
+//------------------------------------------------------------------------------------------------
+// Statistics and teardown
+
+void sl_stats(char *buf, int len) {
+    unsigned long added = 0, removed = 0, retired = 0, freed = 0;
+    int nthreads = 0;
+    for (ebr_thread_t *t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE);
+         t != NULL; t = t->next) {
+        added += __atomic_load_n(&t->added, __ATOMIC_RELAXED);
+        removed += __atomic_load_n(&t->removed, __ATOMIC_RELAXED);
+        retired += __atomic_load_n(&t->retired, __ATOMIC_RELAXED);
+        freed += __atomic_load_n(&t->freed, __ATOMIC_RELAXED);
+        nthreads++;
+    }
+    snprintf(buf, len,
+             "skiplist keys=%ld epoch=%lu threads=%d retired=%lu freed=%lu",
+             (long)(added - removed), __atomic_load_n(&epoch, __ATOMIC_RELAXED),
+             nthreads, retired, freed);
+}
+
+void sl_cleanup(void) {
+    sl_node_t *node = unmarked(head->next[0]);
+    while (node != NULL) {
+        sl_node_t *next = unmarked(node->next[0]);
+        free(node->value);
+        free(node);
+        node = next;
+    }
+    free(head);
+    head = NULL;
+
+    ebr_thread_t *t = threads;
+    while (t != NULL) {
+        ebr_thread_t *next = t->next;
+        for (int i = 0; i < 3; i++) free_retired(t, t->limbo[i]);
+        free(t);
+        t = next;
+    }
+    threads = NULL;
+    self = NULL;
+    pthread_key_delete(self_key);
+}
@@ -0,0 +1,87 @@
+#ifndef SKIPLIST_H_
+#define SKIPLIST_H_
+
+#include <stdint.h>
+
+/*
+ * A lock-free skip list, the alternative to the tree for holding the keys
+ * (see db_backend()). Nothing here takes a lock: every change is a
+ * compare-and-swap on one pointer.
+ *
+ * A node is removed by marking the low bit of each of its next pointers, top
+ * level first; whoever marks level 0 has removed the key. Marked nodes are
+ * unlinked by any search that passes them. A node is linked bottom level
+ * first, and its inserter stops linking once it finds its node marked; the
+ * last of the inserter and the remover to finish searches once more to unlink
+ * whatever is left, so a node is never linked again once it is retired.
+ * Values are replaced by swapping a pointer, so an update never waits either.
+ *
+ * Removed nodes and replaced values are freed through epochs: every call
+ * announces the epoch it started in, and what was retired in epoch e is freed
+ * once the epoch has reached e + 2, when no call that could still see it is
+ * left. A call that stalls holds up only the freeing, never another call.
+ */
+
+#define SL_MAX_LEVEL 24  // enough for 2^24 keys at their expected height
+
+/**
+ * A comparison of two keys with their prefixes, as db.c orders them.
+ */
+typedef int (*sl_compare_t)(const char *a, uint64_t ap, const char *b,
+                            uint64_t bp);
+
+/**
+ * sl_init() creates the empty list, ordered by compare. Must be called
+ * before any other sl_*() function.
+ */
+void sl_init(sl_compare_t compare);
+
+/**
+ * sl_query() copies key's value into result. Returns 1, or 0 if key is not
+ * in the list.
+ */
+int sl_query(const char *key, uint64_t kp, char *result, int len);
+
+/**
+ * sl_add() adds key with value. Returns 1, or 0 if key is already there.
+ */
+int sl_add(const char *key, uint64_t kp, const char *value);
+
+/**
+ * sl_update() replaces key's value with value, if it is expected or expected
+ * is NULL. Returns 1 if it did, 0 if key is not in the list and -1 if its
+ * value was not expected.
+ */
+int sl_update(const char *key, uint64_t kp, const char *expected,
+              const char *value);
+
+/**
+ * sl_remove() removes key. Returns 1, or 0 if key is not in the list.
+ */
+int sl_remove(const char *key, uint64_t kp);
+
+/**
+ * sl_walk() calls fn with every key and its value, in order. A key added or
+ * removed during the walk may or may not be seen.
+ */
+void sl_walk(void (*fn)(const char *key, const char *value, void *arg),
+             void *arg);
+
+/**
+ * sl_clear() removes every key.
+ */
+void sl_clear(void);
+
+/**
+ * sl_stats() writes the number of keys, the epoch, the threads that used the
+ * list and how many nodes and values were retired and freed into buf.
+ */
+void sl_stats(char *buf, int len);
+
+/**
+ * sl_cleanup() frees the list and everything retired. No other thread may be
+ * using it.
+ */
+void sl_cleanup(void);
+
+#endif  // SKIPLIST_H_
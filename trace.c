@@ -0,0 +1,157 @@
+#define _GNU_SOURCE  // gettid via syscall
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./comm.h"
+#include "./trace.h"
+
+typedef struct trace_event {
+    const char *name;
+    uint64_t start;  // nanoseconds on CLOCK_MONOTONIC
+    uint64_t end;
+    unsigned long req;
+} trace_event_t;
+
+// One per client thread. A buffer outlives its thread so that its spans can
+// still be dumped; a new thread takes over a dead one before allocating.
+typedef struct trace_buf {
+    pthread_mutex_t mutex;  // between the owner and trace_dump()
+    long tid;
+    int live;
+    size_t head;  // events recorded so far
+    trace_event_t events[TRACE_EVENTS];
+    struct trace_buf *next;
+} trace_buf_t;
+
+int trace_every;
+__thread int trace_on;
+
+static __thread trace_buf_t *my_buf;
+static __thread unsigned long my_count;  // requests seen by this thread
+static __thread unsigned long my_req;    // id of the sampled request
+static __thread uint64_t my_req_start;
+
+static unsigned long next_req;
+static trace_buf_t *buffers;
+static pthread_mutex_t buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t buf_key;
+
+/* Thread exit: hand the buffer back for another thread to reuse. */
+static void release_buf(void *arg) {
+    trace_buf_t *b = arg;
+    pthread_mutex_lock(&buffers_mutex);
+    b->live = 0;
+    pthread_mutex_unlock(&buffers_mutex);
+}
+
+static trace_buf_t *get_buf(void) {
+    if (my_buf != NULL) return my_buf;
+
+    pthread_mutex_lock(&buffers_mutex);
+    trace_buf_t *b = buffers;
+    while (b != NULL && b->live) b = b->next;
+    if (b == NULL && (b = calloc(1, sizeof(trace_buf_t))) != NULL) {
+        pthread_mutex_init(&b->mutex, 0);
+        b->next = buffers;
+        buffers = b;
+    }
+    if (b != NULL) {
+        b->live = 1;
+        b->tid = syscall(SYS_gettid);
+    }
+    pthread_mutex_unlock(&buffers_mutex);
+
+    if (b != NULL) pthread_setspecific(buf_key, b);
+    return my_buf = b;
+}
+
+//------------------------------------------------------------------------------------------------
+// Recording
+
+void trace_init(int every) {
+    int err;
+    if (every <= 0) return;
+    if ((err = pthread_key_create(&buf_key, release_buf)))
+        handle_error_en(err, "pthread_key_create");
+    trace_every = every;
+}
+
+uint64_t trace_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void trace_request_begin(void) {
+    trace_on = 0;
+    if (trace_every == 0 || my_count++ % trace_every != 0) return;
+    my_req = __atomic_add_fetch(&next_req, 1, __ATOMIC_RELAXED);
+    my_req_start = trace_clock();
+    trace_on = 1;
+}
+
+void trace_request_end(void) {
+    if (!trace_on) return;
+    trace_record("request", my_req_start, trace_clock());
+    trace_on = 0;
+}
+
+void trace_record(const char *name, uint64_t start, uint64_t end) {
+    trace_buf_t *b;
+    if ((b = get_buf()) == NULL) return;
+
+    pthread_mutex_lock(&b->mutex);
+    trace_event_t *e = &b->events[b->head++ % TRACE_EVENTS];
+    e->name = name;
+    e->start = start;
+    e->end = end;
+    e->req = my_req;
+    pthread_mutex_unlock(&b->mutex);
+}
+
+//------------------------------------------------------------------------------------------------
+// Export
+
+int trace_dump(const char *filename) {
+    FILE *out;
+    if ((out = fopen(filename, "w")) == NULL) return -1;
+
+    int pid = getpid();
+    int first = 1;
+    fprintf(out, "{\"traceEvents\":[");
+    pthread_mutex_lock(&buffers_mutex);
+    for (trace_buf_t *b = buffers; b != NULL; b = b->next) {
+        pthread_mutex_lock(&b->mutex);
+        size_t n = b->head < TRACE_EVENTS ? b->head : TRACE_EVENTS;
+        for (size_t i = b->head - n; i < b->head; i++) {
+            trace_event_t *e = &b->events[i % TRACE_EVENTS];
+            fprintf(out,
+                    "%s\n{\"name\":\"%s\",\"cat\":\"db\",\"ph\":\"X\","
+                    "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%ld,"
+                    "\"args\":{\"req\":%lu}}",
+                    first ? "" : ",", e->name, e->start / 1000.0,
+                    (e->end - e->start) / 1000.0, pid, b->tid, e->req);
+            first = 0;
+        }
+        pthread_mutex_unlock(&b->mutex);
+    }
+    pthread_mutex_unlock(&buffers_mutex);
+    fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+    return fclose(out) == 0 ? 0 : -1;
+}
+
+void trace_cleanup(void) {
+    pthread_mutex_lock(&buffers_mutex);
+    while (buffers != NULL) {
+        trace_buf_t *b = buffers;
+        buffers = b->next;
+        pthread_mutex_destroy(&b->mutex);
+        free(b);
+    }
+    pthread_mutex_unlock(&buffers_mutex);
+}
@@ -0,0 +1,65 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * Sampled per-request tracing. With tracing on (the server's -t option), one
+ * request in every trace_every has each stage it passes through (reading the
+ * command, the stop/go gate, execution, every tree lock it waits for, writing
+ * the response) recorded as a span in a ring buffer owned by the client
+ * thread. trace_dump() writes every buffer out in the Chrome trace-event
+ * format, which chrome://tracing and Perfetto open directly.
+ *
+ * When tracing is off, or the current request is not sampled, trace_start()
+ * and trace_end() cost a thread-local load and a branch.
+ */
+
+#define TRACE_EVENTS 4096        // spans kept per thread, oldest overwritten
+#define TRACE_FILE "trace.json"  // written by the console command `T`
+
+extern int trace_every;        // sampling interval, 0 when tracing is off
+extern __thread int trace_on;  // the calling thread's request is sampled
+
+/**
+ * trace_init() turns tracing on for one request in every `every`, or leaves
+ * it off for 0. Must be called before any client thread starts.
+ */
+void trace_init(int every);
+
+/**
+ * trace_request_begin() decides whether the calling thread's next request is
+ * sampled. trace_request_end() records the span covering the whole request,
+ * if it was.
+ */
+void trace_request_begin(void);
+void trace_request_end(void);
+
+uint64_t trace_clock(void);
+void trace_record(const char *name, uint64_t start, uint64_t end);
+
+/**
+ * trace_start() returns the start time of a span, and trace_end() records the
+ * span from then until now under name, which must be a string literal. Both
+ * do nothing unless the current request is sampled.
+ */
+static inline uint64_t trace_start(void) {
+    return trace_on ? trace_clock() : 0;
+}
+
+static inline void trace_end(const char *name, uint64_t start) {
+    if (trace_on) trace_record(name, start, trace_clock());
+}
+
+/**
+ * trace_dump() writes every recorded span to filename as Chrome trace-event
+ * JSON. Returns 0 on success and -1 if the file cannot be written.
+ */
+int trace_dump(const char *filename);
+
+/**
+ * trace_cleanup() frees every buffer. No client thread may be running.
+ */
+void trace_cleanup(void);
+
+#endif  // TRACE_H_
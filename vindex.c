@@ -0,0 +1,308 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./comm.h"
+#include "./hash.h"
+#include "./vindex.h"
+
+typedef struct vindex_entry {
+    char *value;
+    uint64_t hash;
+    char **keys;  // sorted, each its own allocation
+    size_t nkeys;
+    size_t cap;
+    struct vindex_entry *next;
+} vindex_entry_t;
+
+typedef struct vindex_shard {
+    pthread_rwlock_t lock;
+    vindex_entry_t **buckets;  // hash chains, nbuckets is a power of two
+    size_t nbuckets;
+    size_t values;
+    size_t keys;
+    size_t bytes;
+    unsigned long lookups;
+} vindex_shard_t;
+
+static vindex_shard_t shards[VINDEX_SHARDS];
+static int enabled;
+
+static inline vindex_shard_t *shard_of(uint64_t hash) {
+    return &shards[hash >> 60];
+}
+
+static vindex_entry_t **find(vindex_shard_t *s, const char *value,
+                             uint64_t hash) {
+    vindex_entry_t **pp = &s->buckets[hash & (s->nbuckets - 1)];
+    while (*pp != NULL) {
+        if ((*pp)->hash == hash && strcmp((*pp)->value, value) == 0) break;
+        pp = &(*pp)->next;
+    }
+    return pp;
+}
+
+/* Returns the position of key in e's keys, or where it would go. */
+static size_t key_pos(vindex_entry_t *e, const char *key) {
+    size_t lo = 0;
+    size_t hi = e->nkeys;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(e->keys[mid], key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Doubles the shard's bucket array once it holds as many values as buckets.
+   Failing to grow only makes the chains longer. */
+static void grow(vindex_shard_t *s) {
+    if (s->values < s->nbuckets) return;
+    size_t n = 2 * s->nbuckets;
+    vindex_entry_t **buckets;
+    if ((buckets = calloc(n, sizeof(vindex_entry_t *))) == NULL) return;
+    for (size_t i = 0; i < s->nbuckets; i++) {
+        while (s->buckets[i] != NULL) {
+            vindex_entry_t *e = s->buckets[i];
+            s->buckets[i] = e->next;
+            e->next = buckets[e->hash & (n - 1)];
+            buckets[e->hash & (n - 1)] = e;
+        }
+    }
+    free(s->buckets);
+    s->buckets = buckets;
+    s->nbuckets = n;
+}
+
+/* Lists key under value in shard s, which the caller has write-locked. */
+static void add_locked(vindex_shard_t *s, const char *value, uint64_t hash,
+                       const char *key) {
+    vindex_entry_t **pp = find(s, value, hash);
+    vindex_entry_t *e = *pp;
+    if (e == NULL) {
+        if ((e = calloc(1, sizeof(vindex_entry_t))) == NULL ||
+            (e->value = strdup(value)) == NULL) {
+            free(e);
+            return;
+        }
+        e->hash = hash;
+        *pp = e;
+        s->values++;
+        s->bytes += sizeof(vindex_entry_t) + strlen(value) + 1;
+        grow(s);
+    }
+
+    size_t pos = key_pos(e, key);
+    if (pos < e->nkeys && strcmp(e->keys[pos], key) == 0) return;
+    if (e->nkeys == e->cap) {
+        size_t cap = e->cap ? 2 * e->cap : 4;
+        char **keys;
+        if ((keys = realloc(e->keys, cap * sizeof(char *))) == NULL) return;
+        s->bytes += (cap - e->cap) * sizeof(char *);
+        e->keys = keys;
+        e->cap = cap;
+    }
+    char *copy;
+    if ((copy = strdup(key)) == NULL) return;
+    memmove(&e->keys[pos + 1], &e->keys[pos],
+            (e->nkeys - pos) * sizeof(char *));
+    e->keys[pos] = copy;
+    e->nkeys++;
+    s->keys++;
+    s->bytes += strlen(key) + 1;
+}
+
+/* Takes key off value in shard s, which the caller has write-locked, and
+   drops the value once no key holds it. */
+static void remove_locked(vindex_shard_t *s, const char *value, uint64_t hash,
+                          const char *key) {
+    vindex_entry_t **pp = find(s, value, hash);
+    vindex_entry_t *e = *pp;
+    if (e == NULL) return;
+
+    size_t pos = key_pos(e, key);
+    if (pos == e->nkeys || strcmp(e->keys[pos], key) != 0) return;
+    s->bytes -= strlen(key) + 1;
+    free(e->keys[pos]);
+    memmove(&e->keys[pos], &e->keys[pos + 1],
+            (e->nkeys - pos - 1) * sizeof(char *));
+    e->nkeys--;
+    s->keys--;
+    if (e->nkeys > 0) return;
+
+    *pp = e->next;
+    s->values--;
+    s->bytes -= sizeof(vindex_entry_t) + strlen(e->value) + 1 +
+                e->cap * sizeof(char *);
+    free(e->keys);
+    free(e->value);
+    free(e);
+}
+
+static void wrlock(vindex_shard_t *s) {
+    int err;
+    if ((err = pthread_rwlock_wrlock(&s->lock)))
+        handle_error_en(err, "pthread_rwlock_wrlock");
+}
+
+static void rdlock(vindex_shard_t *s) {
+    int err;
+    if ((err = pthread_rwlock_rdlock(&s->lock)))
+        handle_error_en(err, "pthread_rwlock_rdlock");
+}
+
+static void unlock_shard(vindex_shard_t *s) {
+    int err;
+    if ((err = pthread_rwlock_unlock(&s->lock)))
+        handle_error_en(err, "pthread_rwlock_unlock");
+}
+
+//------------------------------------------------------------------------------------------------
+// Setup and teardown
+
+void vindex_init(void) {
+    int err;
+    for (int i = 0; i < VINDEX_SHARDS; i++) {
+        vindex_shard_t *s = &shards[i];
+        memset(s, 0, sizeof(*s));
+        if ((err = pthread_rwlock_init(&s->lock, 0)))
+            handle_error_en(err, "pthread_rwlock_init");
+        s->nbuckets = 64;
+        if ((s->buckets = calloc(s->nbuckets, sizeof(vindex_entry_t *))) ==
+            NULL) {
+            perror("calloc");
+            exit(1);
+        }
+    }
+    enabled = 1;
+}
+
+int vindex_enabled(void) { return enabled; }
+
+/* Frees every entry of shard s, which the caller has write-locked. */
+static void empty_shard(vindex_shard_t *s) {
+    for (size_t i = 0; i < s->nbuckets; i++) {
+        while (s->buckets[i] != NULL) {
+            vindex_entry_t *e = s->buckets[i];
+            s->buckets[i] = e->next;
+            for (size_t j = 0; j < e->nkeys; j++) free(e->keys[j]);
+            free(e->keys);
+            free(e->value);
+            free(e);
+        }
+    }
+    s->values = 0;
+    s->keys = 0;
+    s->bytes = 0;
+}
+
+void vindex_reset(void) {
+    if (!enabled) return;
+    for (int i = 0; i < VINDEX_SHARDS; i++) {
+        wrlock(&shards[i]);
+        empty_shard(&shards[i]);
+        unlock_shard(&shards[i]);
+    }
+}
+
+void vindex_cleanup(void) {
+    int err;
+    if (!enabled) return;
+    for (int i = 0; i < VINDEX_SHARDS; i++) {
+        vindex_shard_t *s = &shards[i];
+        empty_shard(s);
+        free(s->buckets);
+        if ((err = pthread_rwlock_destroy(&s->lock)))
+            handle_error_en(err, "pthread_rwlock_destroy");
+        memset(s, 0, sizeof(*s));
+    }
+    enabled = 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Maintenance and lookup
+
+void vindex_add(const char *value, const char *key) {
+    if (!enabled) return;
+    uint64_t hash = hash_key(value);
+    vindex_shard_t *s = shard_of(hash);
+    wrlock(s);
+    add_locked(s, value, hash, key);
+    unlock_shard(s);
+}
+
+void vindex_remove(const char *value, const char *key) {
+    if (!enabled) return;
+    uint64_t hash = hash_key(value);
+    vindex_shard_t *s = shard_of(hash);
+    wrlock(s);
+    remove_locked(s, value, hash, key);
+    unlock_shard(s);
+}
+
+void vindex_move(const char *key, const char *old_value,
+                 const char *new_value) {
+    if (!enabled || strcmp(old_value, new_value) == 0) return;
+    uint64_t old_hash = hash_key(old_value);
+    uint64_t new_hash = hash_key(new_value);
+    vindex_shard_t *from = shard_of(old_hash);
+    vindex_shard_t *to = shard_of(new_hash);
+
+    // both shards at once, in address order
+    vindex_shard_t *first = from < to ? from : to;
+    vindex_shard_t *second = from < to ? to : from;
+    wrlock(first);
+    if (second != first) wrlock(second);
+    remove_locked(from, old_value, old_hash, key);
+    add_locked(to, new_value, new_hash, key);
+    if (second != first) unlock_shard(second);
+    unlock_shard(first);
+}
+
+void vindex_lookup(const char *value, size_t offset, char *buf, int len) {
+    if (!enabled) {
+        snprintf(buf, len, "value index disabled");
+        return;
+    }
+    uint64_t hash = hash_key(value);
+    vindex_shard_t *s = shard_of(hash);
+
+    rdlock(s);
+    __atomic_add_fetch(&s->lookups, 1, __ATOMIC_RELAXED);
+    vindex_entry_t *e = *find(s, value, hash);
+    size_t nkeys = e != NULL ? e->nkeys : 0;
+    int pos = snprintf(buf, len, "%zu keys", nkeys);
+    for (size_t i = offset; i < nkeys; i++) {
+        // keep room for " ..." in case a later key does not fit
+        int need = strlen(e->keys[i]) + (i == offset ? 2 : 1) +
+                   (i + 1 < nkeys ? 4 : 0);
+        if (pos + need >= len) {
+            if (pos + 4 < len) snprintf(buf + pos, len - pos, " ...");
+            break;
+        }
+        pos += snprintf(buf + pos, len - pos, "%s%s", i == offset ? ": " : " ",
+                        e->keys[i]);
+    }
+    unlock_shard(s);
+}
+
+void vindex_stats(char *buf, int len) {
+    size_t values = 0, keys = 0, bytes = 0;
+    unsigned long lookups = 0;
+    for (int i = 0; enabled && i < VINDEX_SHARDS; i++) {
+        vindex_shard_t *s = &shards[i];
+        rdlock(s);
+        values += s->values;
+        keys += s->keys;
+        bytes += s->bytes + s->nbuckets * sizeof(void *);
+        lookups += __atomic_load_n(&s->lookups, __ATOMIC_RELAXED);
+        unlock_shard(s);
+    }
+    snprintf(buf, len, "vindex enabled=%d values=%zu keys=%zu lookups=%lu "
+             "bytes=%zu",
+             enabled, values, keys, lookups, bytes);
+}
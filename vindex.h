@@ -0,0 +1,61 @@
+#ifndef VINDEX_H_
+#define VINDEX_H_
+
+#include <stddef.h>
+
+/*
+ * An optional secondary index from each value in the tree to the keys that
+ * hold it, for the `v` command. Values hash to shards, each a chained hash
+ * table behind its own rwlock; a value's keys are kept in a sorted array, so
+ * they can be listed in order and paged through. The tree keeps the index in
+ * step while it holds the lock on the node being changed, so a key is always
+ * listed under the value it holds in the tree.
+ */
+
+#define VINDEX_SHARDS 16
+
+/**
+ * vindex_init() turns the index on. Without it every other function does
+ * nothing. Must be called before any client thread starts.
+ */
+void vindex_init(void);
+
+/**
+ * vindex_enabled() returns 1 if the index is on.
+ */
+int vindex_enabled(void);
+
+/**
+ * vindex_add() lists key under value and vindex_remove() takes it off again.
+ * vindex_move() moves key from old_value to new_value in one step, so that no
+ * lookup finds it under neither or both.
+ */
+void vindex_add(const char *value, const char *key);
+void vindex_remove(const char *value, const char *key);
+void vindex_move(const char *key, const char *old_value,
+                 const char *new_value);
+
+/**
+ * vindex_lookup() writes the number of keys holding value and as many of
+ * them as fit into buf, in key order and starting at the offset'th, ending
+ * with "..." if some did not fit.
+ */
+void vindex_lookup(const char *value, size_t offset, char *buf, int len);
+
+/**
+ * vindex_reset() empties the index, for when the tree is cleared.
+ */
+void vindex_reset(void);
+
+/**
+ * vindex_stats() writes the number of distinct values, listed keys, lookups
+ * and bytes used into buf.
+ */
+void vindex_stats(char *buf, int len);
+
+/**
+ * vindex_cleanup() frees the index.
+ */
+void vindex_cleanup(void);
+
+#endif  // VINDEX_H_
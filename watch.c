@@ -0,0 +1,324 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "./comm.h"
+#include "./db.h"
+#include "./watch.h"
+
+#define WATCH_BATCH 64  // changes copied out per lock acquisition
+
+typedef struct watch_event {
+    unsigned long seq;  // 0 for a drop notice, whose cmd is the count
+    size_t key_len;     // the key starts at cmd + 2
+    char cmd[BUFLEN];
+} watch_event_t;
+
+typedef struct pattern {
+    char text[BUFLEN];
+    size_t len;
+    int prefix;  // matches every key starting with text
+} pattern_t;
+
+typedef struct watcher {
+    pattern_t patterns[WATCH_PATTERNS];
+    int npatterns;
+
+    // the queue, filled by the dispatcher and written out by the subscriber
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    watch_event_t *queue;
+    size_t head;
+    size_t count;
+    unsigned long lost;  // dropped since the last drop notice
+
+    struct watcher *next;
+    struct watcher *prev;
+} watcher_t;
+
+// The change log, a ring of the last WATCH_LOG_ENTRIES changes, as in repl.c.
+// Sequence numbers start at 1, so next_seq - 1 is the latest change.
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static watch_event_t *log_ring;  // allocated when the first subscriber comes
+static unsigned long next_seq = 1;
+static pthread_t dispatcher;
+static int dispatching;
+static int stopping;
+
+// The subscribers and what was handed to them, under watchers_mutex
+static pthread_mutex_t watchers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static watcher_t *watchers;
+static int nwatchers;
+static int active;  // read without watchers_mutex by watch_log
+static unsigned long queued;
+static unsigned long dropped;
+
+void watch_log(char op, const char *key, const char *value) {
+    if (!__atomic_load_n(&active, __ATOMIC_SEQ_CST)) return;
+
+    pthread_mutex_lock(&log_mutex);
+    if (log_ring != NULL) {
+        watch_event_t *e = &log_ring[next_seq % WATCH_LOG_ENTRIES];
+        e->seq = next_seq++;
+        e->key_len = strlen(key);
+        if (value != NULL)
+            snprintf(e->cmd, BUFLEN, "%c %s %s", op, key, value);
+        else
+            snprintf(e->cmd, BUFLEN, "%c %s", op, key);
+        if (e->key_len > BUFLEN - 3) e->key_len = BUFLEN - 3;
+        pthread_cond_signal(&log_cond);
+    }
+    pthread_mutex_unlock(&log_mutex);
+}
+
+//------------------------------------------------------------------------------------------------
+// Dispatching changes to subscribers
+
+static int matches(watcher_t *w, watch_event_t *e) {
+    const char *key = e->cmd + 2;
+    for (int i = 0; i < w->npatterns; i++) {
+        pattern_t *p = &w->patterns[i];
+        if ((p->prefix ? e->key_len >= p->len : e->key_len == p->len) &&
+            memcmp(key, p->text, p->len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Queues e for w, or counts it lost if w's queue is full. A drop notice goes
+   in ahead of the first change queued after a loss, so that w learns of it
+   in order. The caller holds watchers_mutex. */
+static void deliver(watcher_t *w, watch_event_t *e) {
+    pthread_mutex_lock(&w->mutex);
+    size_t need = w->lost > 0 ? 2 : 1;
+    if (w->count + need > WATCH_QUEUE) {
+        w->lost++;
+        dropped++;
+    } else {
+        if (w->lost > 0) {
+            watch_event_t *notice = &w->queue[(w->head + w->count++) %
+                                              WATCH_QUEUE];
+            notice->seq = 0;
+            snprintf(notice->cmd, BUFLEN, "%lu", w->lost);
+            w->lost = 0;
+        }
+        w->queue[(w->head + w->count++) % WATCH_QUEUE] = *e;
+        queued++;
+        pthread_cond_signal(&w->cond);
+    }
+    pthread_mutex_unlock(&w->mutex);
+}
+
+/* Matches the log against every subscription, never blocking on a
+   subscriber's connection. Should the log outrun it, every subscriber is
+   told that the skipped changes may have been lost. */
+static void *dispatch(void *arg) {
+    (void)arg;
+    watch_event_t batch[WATCH_BATCH];
+    unsigned long pos;
+
+    pthread_mutex_lock(&log_mutex);
+    pos = next_seq;
+    while (!stopping) {
+        if (pos == next_seq) {
+            pthread_cond_wait(&log_cond, &log_mutex);
+            continue;
+        }
+        unsigned long skipped = 0;
+        if (next_seq - pos > WATCH_LOG_ENTRIES) {
+            skipped = next_seq - WATCH_LOG_ENTRIES - pos;
+            pos += skipped;
+        }
+        int n = 0;
+        while (pos < next_seq && n < WATCH_BATCH)
+            batch[n++] = log_ring[pos++ % WATCH_LOG_ENTRIES];
+        pthread_mutex_unlock(&log_mutex);
+
+        pthread_mutex_lock(&watchers_mutex);
+        for (watcher_t *w = watchers; skipped > 0 && w != NULL; w = w->next) {
+            pthread_mutex_lock(&w->mutex);
+            w->lost += skipped;
+            dropped += skipped;
+            pthread_cond_signal(&w->cond);
+            pthread_mutex_unlock(&w->mutex);
+        }
+        for (int i = 0; i < n; i++)
+            for (watcher_t *w = watchers; w != NULL; w = w->next)
+                if (matches(w, &batch[i])) deliver(w, &batch[i]);
+        pthread_mutex_unlock(&watchers_mutex);
+
+        pthread_mutex_lock(&log_mutex);
+    }
+    pthread_mutex_unlock(&log_mutex);
+    return NULL;
+}
+
+//------------------------------------------------------------------------------------------------
+// Subscribers
+
+/* Fills w's patterns from args. Returns NULL, or the error to send back. */
+static const char *parse_patterns(watcher_t *w, char *args) {
+    char *saveptr;
+    for (char *tok = strtok_r(args, " \t\n", &saveptr); tok != NULL;
+         tok = strtok_r(NULL, " \t\n", &saveptr)) {
+        if (w->npatterns == WATCH_PATTERNS) return "too many patterns";
+        pattern_t *p = &w->patterns[w->npatterns++];
+        size_t len = strlen(tok);
+        if (tok[len - 1] == '*') {
+            tok[--len] = '\0';
+            p->prefix = 1;
+        } else if (db_key_normalize(tok) < 0) {
+            return "invalid key";
+        }
+        snprintf(p->text, BUFLEN, "%s", tok);
+        p->len = strlen(p->text);
+    }
+    return w->npatterns == 0 ? "ill-formed command" : NULL;
+}
+
+static void start_dispatcher(void) {
+    int err;
+    pthread_mutex_lock(&log_mutex);
+    if (log_ring == NULL &&
+        (log_ring = calloc(WATCH_LOG_ENTRIES, sizeof(watch_event_t))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    if (!dispatching) {
+        if ((err = pthread_create(&dispatcher, 0, dispatch, NULL)))
+            handle_error_en(err, "pthread_create");
+        dispatching = 1;
+    }
+    pthread_mutex_unlock(&log_mutex);
+}
+
+static void watcher_gone(void *arg) {
+    watcher_t *w = arg;
+    pthread_mutex_lock(&watchers_mutex);
+    if (w->prev != NULL)
+        w->prev->next = w->next;
+    else
+        watchers = w->next;
+    if (w->next != NULL) w->next->prev = w->prev;
+    if (--nwatchers == 0) __atomic_store_n(&active, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&watchers_mutex);
+
+    pthread_mutex_destroy(&w->mutex);
+    pthread_cond_destroy(&w->cond);
+    free(w->queue);
+    free(w);
+}
+
+/* Writes w's queue out as it fills, with a heartbeat whenever it stays empty
+   for WATCH_HEARTBEAT_MS, until the subscriber goes away. */
+static void stream_changes(watcher_t *w, FILE *cxstr) {
+    watch_event_t batch[WATCH_BATCH];
+
+    while (1) {
+        int n = 0;
+        unsigned long lost = 0;
+
+        pthread_mutex_lock(&w->mutex);
+        pthread_cleanup_push((void *)&pthread_mutex_unlock, &w->mutex);
+        if (w->count == 0 && w->lost == 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += WATCH_HEARTBEAT_MS / 1000;
+            pthread_cond_timedwait(&w->cond, &w->mutex, &deadline);
+        }
+        while (w->count > 0 && n < WATCH_BATCH) {
+            batch[n++] = w->queue[w->head];
+            w->head = (w->head + 1) % WATCH_QUEUE;
+            w->count--;
+        }
+        // everything queued came before what was lost since
+        if (w->count == 0) {
+            lost = w->lost;
+            w->lost = 0;
+        }
+        pthread_cleanup_pop(1);
+
+        if (n == 0 && lost == 0 &&
+            fprintf(cxstr, "H %lu\n",
+                    __atomic_load_n(&next_seq, __ATOMIC_RELAXED) - 1) < 0)
+            return;
+        for (int i = 0; i < n; i++) {
+            if ((batch[i].seq == 0
+                     ? fprintf(cxstr, "O %s\n", batch[i].cmd)
+                     : fprintf(cxstr, "N %lu %s\n", batch[i].seq,
+                               batch[i].cmd)) < 0)
+                return;
+        }
+        if (lost > 0 && fprintf(cxstr, "O %lu\n", lost) < 0) return;
+        if (fflush(cxstr) == EOF) return;
+    }
+}
+
+void watch_serve(FILE *cxstr, char *args) {
+    watcher_t *w;
+    const char *error;
+
+    if ((w = calloc(1, sizeof(watcher_t))) == NULL ||
+        (w->queue = calloc(WATCH_QUEUE, sizeof(watch_event_t))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    if ((error = parse_patterns(w, args)) != NULL) {
+        if (fprintf(cxstr, "%s\n", error) >= 0) fflush(cxstr);
+        free(w->queue);
+        free(w);
+        return;
+    }
+    pthread_mutex_init(&w->mutex, 0);
+    pthread_cond_init(&w->cond, 0);
+
+    // a subscriber that stops reading fails its writes rather than holding
+    // on to its thread
+    struct timeval tv = {WATCH_SEND_TIMEOUT_S, 0};
+    if (setsockopt(fileno(cxstr), SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0)
+        perror("setsockopt");
+
+    start_dispatcher();
+    pthread_mutex_lock(&watchers_mutex);
+    w->next = watchers;
+    if (watchers != NULL) watchers->prev = w;
+    watchers = w;
+    nwatchers++;
+    __atomic_store_n(&active, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&watchers_mutex);
+
+    pthread_cleanup_push(watcher_gone, w);
+    if (fprintf(cxstr, "watching %d\n", w->npatterns) >= 0 &&
+        fflush(cxstr) != EOF)
+        stream_changes(w, cxstr);
+    pthread_cleanup_pop(1);
+}
+
+//------------------------------------------------------------------------------------------------
+// Statistics and teardown
+
+void watch_stats(char *buf, int len) {
+    unsigned long seq = __atomic_load_n(&next_seq, __ATOMIC_RELAXED) - 1;
+    pthread_mutex_lock(&watchers_mutex);
+    snprintf(buf, len, "watch subscribers=%d seq=%lu queued=%lu dropped=%lu",
+             nwatchers, seq, queued, dropped);
+    pthread_mutex_unlock(&watchers_mutex);
+}
+
+void watch_cleanup(void) {
+    int err;
+    pthread_mutex_lock(&log_mutex);
+    stopping = 1;
+    pthread_cond_signal(&log_cond);
+    pthread_mutex_unlock(&log_mutex);
+    if (dispatching && (err = pthread_join(dispatcher, 0)))
+        handle_error_en(err, "pthread_join");
+    dispatching = 0;
+    free(log_ring);
+    log_ring = NULL;
+}
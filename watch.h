@@ -0,0 +1,60 @@
+#ifndef WATCH_H_
+#define WATCH_H_
+
+#include <stdio.h>
+
+/*
+ * Change notifications pushed to subscribers. A client connection that sends
+ * `W <pattern> ...` becomes a subscription for the rest of its life: each
+ * pattern is a key, or a prefix followed by `*` (`*` alone matches every
+ * key), and the connection then receives every change to a matching key.
+ *
+ * Writers only append the change to a shared log, as for replication (see
+ * repl.h). A dispatcher thread matches the log against the subscriptions and
+ * copies each match into its subscriber's queue of WATCH_QUEUE entries, and
+ * the subscriber's own thread writes its queue out. A subscriber whose queue
+ * is full loses the changes that do not fit and is told how many; one that
+ * stops reading for WATCH_SEND_TIMEOUT_S is disconnected.
+ *
+ * Wire format, server to subscriber, one line each:
+ *  watching <n>              acknowledges the n patterns
+ *  N <seq> <command>         change seq; command is `a key value`, `d key` or
+ *                            `w key value` (set), as in the replication log
+ *  O <count>                 count changes were dropped here
+ *  H <seq>                   heartbeat carrying the latest seq
+ */
+
+#define WATCH_PATTERNS 16
+#define WATCH_LOG_ENTRIES 4096  // changes the dispatcher may lag behind
+#define WATCH_QUEUE 1024        // changes one subscriber may lag behind
+#define WATCH_HEARTBEAT_MS 1000
+#define WATCH_SEND_TIMEOUT_S 10
+
+/**
+ * watch_log() records a change for the subscribers. Like repl_log(), it must
+ * be called while the caller still holds the lock that orders the change
+ * against other writers of the same key, and returns immediately when no one
+ * is subscribed.
+ */
+void watch_log(char op, const char *key, const char *value);
+
+/**
+ * watch_serve() turns a client connection that sent `W` into a subscription
+ * to the patterns in args. It returns once the subscriber disconnects, stops
+ * reading or sent no valid patterns.
+ */
+void watch_serve(FILE *cxstr, char *args);
+
+/**
+ * watch_stats() writes the number of subscribers, the latest change and how
+ * many changes were queued and dropped into buf.
+ */
+void watch_stats(char *buf, int len);
+
+/**
+ * watch_cleanup() stops the dispatcher and frees the log. No subscriber may
+ * be left.
+ */
+void watch_cleanup(void);
+
+#endif  // WATCH_H_